@@ -0,0 +1,87 @@
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <psMakeTrench.hpp>
+#include <psUtils.hpp>
+
+// Compares the cell lookup of csDenseCellSet with the dense index map
+// (default) and with the BVH: build time, memory and lookup throughput.
+//
+// Usage: CellSetBenchmark [gridDelta] [numberOfQueries]
+
+using NumericType = double;
+constexpr int D = 3;
+
+int main(int argc, char *argv[]) {
+  NumericType gridDelta = 0.05;
+  if (argc > 1)
+    gridDelta = std::atof(argv[1]);
+
+  unsigned numQueries = 10'000'000;
+  if (argc > 2) {
+    int tmp = std::atoi(argv[2]);
+    if (tmp > 0)
+      numQueries = static_cast<unsigned>(tmp);
+  }
+
+  const NumericType extent = 4.;
+  const NumericType trenchDepth = 2.;
+  const NumericType cellSetDepth = -1.;
+
+  auto domain = psSmartPointer<psDomain<NumericType, D>>::New();
+  psMakeTrench<NumericType, D>(domain, gridDelta, extent, extent,
+                               1. /* trench width */, trenchDepth)
+      .apply();
+
+  // random query points in the bounding box of the cell set
+  std::vector<std::array<NumericType, 3>> queries(numQueries);
+  {
+    std::mt19937_64 rng(1);
+    std::uniform_real_distribution<NumericType> lateral(-extent / 2.,
+                                                        extent / 2.);
+    std::uniform_real_distribution<NumericType> vertical(cellSetDepth,
+                                                         trenchDepth);
+    for (auto &q : queries)
+      q = {lateral(rng), lateral(rng), vertical(rng)};
+  }
+
+  for (const bool useBVH : {false, true}) {
+    std::cout << (useBVH ? "BVH" : "Index map") << "\n";
+
+    auto cellSet = psSmartPointer<csDenseCellSet<NumericType, D>>::New();
+    cellSet->setUseBVH(useBVH);
+
+    psUtils::Timer timer;
+    timer.start();
+    cellSet->fromLevelSets(domain->getLevelSets(), nullptr, cellSetDepth);
+    timer.finish();
+    std::cout << "  Cells: " << cellSet->getNumberOfCells() << "\n";
+    std::cout << "  Cell set build time: " << timer.currentDuration * 1e-9
+              << "s\n";
+
+    timer.start();
+    cellSet->buildCellLookup();
+    timer.finish();
+    std::cout << "  Lookup build time: " << timer.currentDuration * 1e-9
+              << "s\n";
+
+    const auto lookupMemory =
+        useBVH ? cellSet->getBVH()->getMemorySize()
+               : cellSet->getIndexMapSize() * sizeof(int);
+    std::cout << "  Lookup memory: " << lookupMemory / 1e6 << "MB\n";
+
+    long found = 0;
+    timer.start();
+#pragma omp parallel for reduction(+ : found)
+    for (long i = 0; i < static_cast<long>(queries.size()); ++i) {
+      if (cellSet->getIndex(queries[i]) >= 0)
+        ++found;
+    }
+    timer.finish();
+    std::cout << "  Lookups: " << found << " of " << numQueries
+              << " points inside cells, "
+              << numQueries / (timer.currentDuration * 1e-9) / 1e6
+              << " million lookups/s\n";
+  }
+}
@@ -0,0 +1,149 @@
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <lsToDiskMesh.hpp>
+
+#include <SimpleDeposition.hpp>
+#include <psMakeHole.hpp>
+#include <psMakeTrench.hpp>
+#include <psQuasiRandomSource.hpp>
+#include <psUtils.hpp>
+#include <psViewFactorFlux.hpp>
+
+// Compares the flux error of pseudo-random and quasi-random source sampling
+// for an increasing number of rays per point on a trench and a hole. The
+// reference flux is calculated with a large number of rays per point.
+//
+// Usage: FluxConvergence [stickingProbability] [referenceRaysPerPoint]
+
+using NumericType = double;
+constexpr int D = 3;
+
+struct SurfaceDisks {
+  std::vector<std::array<NumericType, 3>> points;
+  std::vector<std::array<NumericType, 3>> normals;
+  std::vector<NumericType> materialIds;
+  NumericType gridDelta;
+};
+
+SurfaceDisks
+extractDisks(psSmartPointer<psDomain<NumericType, D>> domain) {
+  auto mesh = psSmartPointer<lsMesh<NumericType>>::New();
+  lsToDiskMesh<NumericType, D> meshConverter(mesh);
+  for (auto ls : *domain->getLevelSets())
+    meshConverter.insertNextLevelSet(ls);
+  meshConverter.apply();
+
+  SurfaceDisks disks;
+  disks.points = mesh->getNodes();
+  disks.normals = *mesh->getCellData().getVectorData("Normals");
+  disks.materialIds = *mesh->getCellData().getScalarData("MaterialIds");
+  disks.gridDelta = domain->getGrid().getGridDelta();
+  return disks;
+}
+
+std::vector<NumericType>
+calculateFlux(const SurfaceDisks &disks, const NumericType sticking,
+              const size_t raysPerPoint, const psSourceSamplingType sampling,
+              double &time) {
+  std::unique_ptr<rayAbstractParticle<NumericType>> particle =
+      std::make_unique<SimpleDepositionParticle<NumericType, D>>(sticking, 1.);
+
+  psUtils::Timer timer;
+  timer.start();
+  psViewFactorFlux<NumericType, D> fluxEngine;
+  fluxEngine.setNumberOfRaysPerPoint(raysPerPoint);
+  fluxEngine.setSourceSampling(sampling);
+  fluxEngine.setGeometry(disks.points, disks.normals, disks.materialIds,
+                         disks.gridDelta);
+  auto flux = fluxEngine.calculateFlux(particle, nullptr);
+  timer.finish();
+  time = timer.currentDuration * 1e-9;
+  return flux;
+}
+
+// root mean square of the error relative to the mean reference flux
+NumericType relativeError(const std::vector<NumericType> &flux,
+                          const std::vector<NumericType> &reference) {
+  NumericType sumSquared = 0.;
+  NumericType mean = 0.;
+  for (size_t i = 0; i < flux.size(); ++i) {
+    const auto diff = flux[i] - reference[i];
+    sumSquared += diff * diff;
+    mean += reference[i];
+  }
+  mean /= reference.size();
+  return std::sqrt(sumSquared / flux.size()) / mean;
+}
+
+void runConvergence(const std::string &name, const SurfaceDisks &disks,
+                    const NumericType sticking, const size_t referenceRays) {
+  std::cout << "\n" << name << ": " << disks.points.size() << " disks\n";
+
+  double time;
+  const auto reference =
+      calculateFlux(disks, sticking, referenceRays,
+                    psSourceSamplingType::PSEUDO_RANDOM, time);
+  std::cout << "Reference with " << referenceRays << " rays per point in "
+            << time << "s\n";
+
+  const unsigned repetitions = 3;
+  std::cout << std::setw(12) << "rays/point" << std::setw(16) << "error random"
+            << std::setw(12) << "time [s]" << std::setw(16) << "error quasi"
+            << std::setw(12) << "time [s]" << "\n";
+  for (size_t raysPerPoint = 16; raysPerPoint <= referenceRays / 4;
+       raysPerPoint *= 2) {
+    std::cout << std::setw(12) << raysPerPoint;
+    for (const auto sampling : {psSourceSamplingType::PSEUDO_RANDOM,
+                                psSourceSamplingType::QUASI_RANDOM}) {
+      NumericType error = 0.;
+      double totalTime = 0.;
+      for (unsigned i = 0; i < repetitions; ++i) {
+        const auto flux =
+            calculateFlux(disks, sticking, raysPerPoint, sampling, time);
+        error += relativeError(flux, reference);
+        totalTime += time;
+      }
+      std::cout << std::setw(16) << error / repetitions << std::setw(12)
+                << totalTime / repetitions;
+    }
+    std::cout << "\n";
+  }
+}
+
+int main(int argc, char *argv[]) {
+  psLogger::setLogLevel(psLogLevel::WARNING);
+
+  NumericType sticking = 0.1;
+  if (argc > 1)
+    sticking = std::atof(argv[1]);
+
+  size_t referenceRays = 4096;
+  if (argc > 2) {
+    int tmp = std::atoi(argv[2]);
+    if (tmp > 0)
+      referenceRays = static_cast<size_t>(tmp);
+  }
+
+  {
+    auto trench = psSmartPointer<psDomain<NumericType, D>>::New();
+    psMakeTrench<NumericType, D>(trench, 0.2 /* grid delta */,
+                                 5. /* x extent */, 5. /* y extent */,
+                                 1.5 /* trench width */,
+                                 3. /* trench depth */)
+        .apply();
+    runConvergence("Trench", extractDisks(trench), sticking, referenceRays);
+  }
+
+  {
+    auto hole = psSmartPointer<psDomain<NumericType, D>>::New();
+    psMakeHole<NumericType, D>(hole, 0.2 /* grid delta */, 5. /* x extent */,
+                               5. /* y extent */, 0.75 /* hole radius */,
+                               3. /* hole depth */)
+        .apply();
+    runConvergence("Hole", extractDisks(hole), sticking, referenceRays);
+  }
+}
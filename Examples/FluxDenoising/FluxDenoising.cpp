@@ -0,0 +1,177 @@
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <lsToDiskMesh.hpp>
+
+#include <rayTrace.hpp>
+
+#include <SimpleDeposition.hpp>
+#include <psFluxDenoiser.hpp>
+#include <psMakeHole.hpp>
+#include <psMakeTrench.hpp>
+
+// Calibration of the flux denoiser. For an increasing number of rays per
+// point, the flux on a trench and a hole is calculated several times and
+// compared to a reference flux with a large number of rays per point. The
+// bias (error of the mean flux) and the noise (standard deviation between
+// the repetitions) are reported relative to the mean reference flux for the
+// raw flux, the flux smoothed with rayTrace::smoothFlux and the denoised flux.
+//
+// Usage: FluxDenoising [stickingProbability] [referenceRaysPerPoint]
+//                      [repetitions]
+
+using NumericType = double;
+constexpr int D = 3;
+
+struct SurfaceDisks {
+  std::vector<std::array<NumericType, 3>> points;
+  std::vector<std::array<NumericType, 3>> normals;
+  std::vector<NumericType> materialIds;
+  NumericType gridDelta;
+};
+
+SurfaceDisks extractDisks(psSmartPointer<psDomain<NumericType, D>> domain) {
+  auto mesh = psSmartPointer<lsMesh<NumericType>>::New();
+  lsToDiskMesh<NumericType, D> meshConverter(mesh);
+  for (auto ls : *domain->getLevelSets())
+    meshConverter.insertNextLevelSet(ls);
+  meshConverter.apply();
+
+  SurfaceDisks disks;
+  disks.points = mesh->getNodes();
+  disks.normals = *mesh->getCellData().getVectorData("Normals");
+  disks.materialIds = *mesh->getCellData().getScalarData("MaterialIds");
+  disks.gridDelta = domain->getGrid().getGridDelta();
+  return disks;
+}
+
+enum class FilterType { NONE, SMOOTH, DENOISE };
+
+std::vector<NumericType>
+calculateFlux(SurfaceDisks &disks, const NumericType sticking,
+              const size_t raysPerPoint, const FilterType filter,
+              const psFluxDenoiser<NumericType, D> &denoiser) {
+  std::unique_ptr<rayAbstractParticle<NumericType>> particle =
+      std::make_unique<SimpleDepositionParticle<NumericType, D>>(sticking, 1.);
+
+  rayTraceBoundary boundaryConds[D] = {rayTraceBoundary::REFLECTIVE,
+                                       rayTraceBoundary::REFLECTIVE,
+                                       rayTraceBoundary::REFLECTIVE};
+  rayTrace<NumericType, D> tracer;
+  tracer.setSourceDirection(rayTraceDirection::POS_Z);
+  tracer.setBoundaryConditions(boundaryConds);
+  tracer.setNumberOfRaysPerPoint(raysPerPoint);
+  tracer.setUseRandomSeeds(true);
+  tracer.setCalculateFlux(false);
+  tracer.setGeometry(disks.points, disks.normals, disks.gridDelta);
+  tracer.setMaterialIds(disks.materialIds);
+  tracer.setParticleType(particle);
+  tracer.apply();
+
+  auto flux = std::move(tracer.getLocalData().getVectorData(0));
+  tracer.normalizeFlux(flux);
+  if (filter == FilterType::SMOOTH)
+    tracer.smoothFlux(flux);
+  else if (filter == FilterType::DENOISE)
+    denoiser.apply(flux);
+  return flux;
+}
+
+void runCalibration(const std::string &name, SurfaceDisks disks,
+                    const NumericType sticking, const size_t referenceRays,
+                    const unsigned repetitions) {
+  std::cout << "\n" << name << ": " << disks.points.size() << " disks\n";
+
+  psFluxDenoiser<NumericType, D> denoiser;
+  denoiser.setGeometry(disks.points, disks.normals, disks.materialIds,
+                       disks.gridDelta);
+
+  const auto reference = calculateFlux(disks, sticking, referenceRays,
+                                       FilterType::NONE, denoiser);
+  NumericType referenceMean = 0.;
+  for (const auto f : reference)
+    referenceMean += f;
+  referenceMean /= reference.size();
+
+  std::cout << std::setw(12) << "rays/point" << std::setw(10) << "filter"
+            << std::setw(12) << "bias" << std::setw(12) << "noise" << "\n";
+  for (size_t raysPerPoint = 50; raysPerPoint <= referenceRays / 10;
+       raysPerPoint *= 2) {
+    for (const auto filter :
+         {FilterType::NONE, FilterType::SMOOTH, FilterType::DENOISE}) {
+      const auto numPoints = reference.size();
+      std::vector<NumericType> mean(numPoints, 0.);
+      std::vector<NumericType> meanSquared(numPoints, 0.);
+      for (unsigned r = 0; r < repetitions; ++r) {
+        const auto flux =
+            calculateFlux(disks, sticking, raysPerPoint, filter, denoiser);
+        for (size_t i = 0; i < numPoints; ++i) {
+          mean[i] += flux[i] / repetitions;
+          meanSquared[i] += flux[i] * flux[i] / repetitions;
+        }
+      }
+
+      NumericType bias = 0.;
+      NumericType variance = 0.;
+      for (size_t i = 0; i < numPoints; ++i) {
+        const auto diff = mean[i] - reference[i];
+        bias += diff * diff;
+        variance += std::max(meanSquared[i] - mean[i] * mean[i], 0.) *
+                    repetitions / (repetitions - 1);
+      }
+      bias = std::sqrt(bias / numPoints) / referenceMean;
+      const auto noise = std::sqrt(variance / numPoints) / referenceMean;
+
+      const char *filterName[] = {"none", "smooth", "denoise"};
+      std::cout << std::setw(12) << raysPerPoint << std::setw(10)
+                << filterName[static_cast<int>(filter)] << std::setw(12)
+                << bias << std::setw(12) << noise << "\n";
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  psLogger::setLogLevel(psLogLevel::WARNING);
+
+  NumericType sticking = 0.1;
+  if (argc > 1)
+    sticking = std::atof(argv[1]);
+
+  size_t referenceRays = 10000;
+  if (argc > 2) {
+    int tmp = std::atoi(argv[2]);
+    if (tmp > 0)
+      referenceRays = static_cast<size_t>(tmp);
+  }
+
+  unsigned repetitions = 5;
+  if (argc > 3) {
+    int tmp = std::atoi(argv[3]);
+    if (tmp > 1)
+      repetitions = static_cast<unsigned>(tmp);
+  }
+
+  {
+    auto trench = psSmartPointer<psDomain<NumericType, D>>::New();
+    psMakeTrench<NumericType, D>(trench, 0.2 /* grid delta */,
+                                 5. /* x extent */, 5. /* y extent */,
+                                 1.5 /* trench width */,
+                                 3. /* trench depth */)
+        .apply();
+    runCalibration("Trench", extractDisks(trench), sticking, referenceRays,
+                   repetitions);
+  }
+
+  {
+    auto hole = psSmartPointer<psDomain<NumericType, D>>::New();
+    psMakeHole<NumericType, D>(hole, 0.2 /* grid delta */, 5. /* x extent */,
+                               5. /* y extent */, 0.75 /* hole radius */,
+                               3. /* hole depth */)
+        .apply();
+    runCalibration("Hole", extractDisks(hole), sticking, referenceRays,
+                   repetitions);
+  }
+}
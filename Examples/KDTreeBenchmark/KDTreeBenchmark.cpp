@@ -1,4 +1,5 @@
 #include <array>
+#include <cmath>
 #include <iostream>
 #include <random>
 #include <vector>
@@ -7,6 +8,8 @@
 #include <omp.h>
 #endif
 
+#include <psImplicitKDTree.hpp>
+#include <psIncrementalKDTree.hpp>
 #include <psKDTree.hpp>
 #include <psSmartPointer.hpp>
 
@@ -43,6 +46,92 @@ std::vector<std::vector<T>> generatePoints(unsigned N, unsigned D) {
   return data;
 }
 
+// Points on a sphere, like the points of a surface mesh, and query points
+// close to the surface. Points and queries need different seeds, otherwise
+// each query lies on the same ray as the point with the same index.
+template <class T>
+std::vector<std::vector<T>> generateSurfacePoints(unsigned N, T offset,
+                                                  unsigned seed) {
+  std::default_random_engine engine(seed);
+  std::normal_distribution<T> direction{0., 1.};
+  std::uniform_real_distribution<T> distance{-offset, offset};
+  std::vector<std::vector<T>> data(N);
+  for (auto &point : data) {
+    point = {direction(engine), direction(engine), direction(engine)};
+    const T radius = 10. + distance(engine);
+    const T norm = std::sqrt(point[0] * point[0] + point[1] * point[1] +
+                             point[2] * point[2]);
+    for (auto &coordinate : point)
+      coordinate *= radius / norm;
+  }
+  return data;
+}
+
+// Query time and accuracy of the approximate search for different epsilon
+// and of the kNN search for different limits of visited nodes
+template <class T>
+void approximateSearch(const std::vector<std::vector<T>> &points,
+                       const std::vector<std::vector<T>> &queries) {
+  psKDTree<T> tree(points);
+  tree.build();
+
+  std::vector<T> exactDistances(queries.size());
+  for (std::size_t i = 0; i < queries.size(); ++i)
+    exactDistances[i] = tree.findNearest(queries[i])->second;
+
+  for (const T epsilon : {0., 0.1, 0.5, 1., 2.}) {
+    tree.setEpsilon(epsilon);
+    std::vector<T> distances(queries.size());
+    auto startTime = getTime();
+    for (std::size_t i = 0; i < queries.size(); ++i)
+      distances[i] = tree.findNearest(queries[i])->second;
+    auto endTime = getTime();
+
+    std::size_t exact = 0;
+    T maxRatio = 1.;
+    for (std::size_t i = 0; i < queries.size(); ++i) {
+      exact += distances[i] == exactDistances[i];
+      if (exactDistances[i] > 0)
+        maxRatio = std::max(maxRatio, distances[i] / exactDistances[i]);
+    }
+    std::cout << "  epsilon " << epsilon << ": " << endTime - startTime
+              << "s, " << 100. * static_cast<double>(exact) /
+                     static_cast<double>(queries.size())
+              << "% exact, maximum distance ratio " << maxRatio << "\n";
+  }
+  tree.setEpsilon(0.);
+
+  static constexpr int k = 8;
+  std::vector<std::vector<std::pair<std::size_t, T>>> exactNeighbors;
+  for (const auto &query : queries)
+    exactNeighbors.push_back(tree.findKNearest(query, k).value());
+
+  std::vector<std::pair<std::size_t, T>> neighbors;
+  for (const std::size_t maxVisitedNodes :
+       {std::size_t{1000}, std::size_t{200}, std::size_t{100},
+        std::size_t{50}}) {
+    tree.setMaxVisitedNodes(maxVisitedNodes);
+    std::size_t found = 0;
+    auto startTime = getTime();
+    for (const auto &query : queries)
+      tree.findKNearest(query, k, neighbors);
+    auto endTime = getTime();
+
+    // recall: fraction of the exact neighbors which were found
+    for (std::size_t i = 0; i < queries.size(); ++i) {
+      tree.findKNearest(queries[i], k, neighbors);
+      for (const auto &neighbor : neighbors)
+        for (const auto &exactNeighbor : exactNeighbors[i])
+          found += neighbor.first == exactNeighbor.first;
+    }
+    std::cout << "  " << k << " nearest, at most " << maxVisitedNodes
+              << " visited nodes: " << endTime - startTime << "s, recall "
+              << 100. * static_cast<double>(found) /
+                     static_cast<double>(k * queries.size())
+              << "%\n";
+  }
+}
+
 int main(int argc, char *argv[]) {
   using NumericType = double;
   static constexpr int D = 3;
@@ -102,5 +191,176 @@ int main(int argc, char *argv[]) {
 
     std::cout << M << " nearest neighbor queries completed in "
               << (endTime - startTime) / repetitions << "s\n";
+
+    // Batch Nearest Neighbors
+    std::cout << "Finding Nearest Neighbors in one batch...\n";
+    std::vector<std::size_t> indices;
+    std::vector<NumericType> distances;
+    startTime = getTime();
+    for (unsigned i = 0; i < repetitions; ++i) {
+      tree->findNearestBatch(testPoints, indices, distances);
+    }
+    endTime = getTime();
+
+    std::cout << M << " batched nearest neighbor queries completed in "
+              << (endTime - startTime) / repetitions << "s\n";
+
+    // K Nearest Neighbors
+    static constexpr int k = 8;
+    std::cout << "Finding " << k << " Nearest Neighbors...\n";
+    startTime = getTime();
+    for (unsigned i = 0; i < repetitions; ++i) {
+      for (const auto &pt : testPoints)
+        [[maybe_unused]] auto result = tree->findKNearest(pt, k);
+    }
+    endTime = getTime();
+
+    std::cout << M << " k-nearest neighbor queries completed in "
+              << (endTime - startTime) / repetitions << "s\n";
+
+    std::cout << "Finding " << k << " Nearest Neighbors in one batch...\n";
+    startTime = getTime();
+    for (unsigned i = 0; i < repetitions; ++i) {
+      tree->findKNearestBatch(testPoints, k, indices, distances);
+    }
+    endTime = getTime();
+
+    std::cout << M << " batched k-nearest neighbor queries completed in "
+              << (endTime - startTime) / repetitions << "s\n";
+
+    // Radius Search, the sphere holds about k of the points in the cube with
+    // an edge length of 20 on average
+    const NumericType radius =
+        std::cbrt(3. * k * 8000. / (4. * 3.14159265 * static_cast<double>(N)));
+    std::cout << "Finding Neighbors within radius " << radius << "...\n";
+    startTime = getTime();
+    for (unsigned i = 0; i < repetitions; ++i) {
+      for (const auto &pt : testPoints)
+        [[maybe_unused]] auto result =
+            tree->findNearestWithinRadius(pt, radius);
+    }
+    endTime = getTime();
+
+    std::cout << M << " radius queries completed in "
+              << (endTime - startTime) / repetitions << "s\n";
+
+    std::cout << "Finding Neighbors within radius " << radius
+              << " in one batch...\n";
+    std::vector<std::size_t> offsets;
+    startTime = getTime();
+    for (unsigned i = 0; i < repetitions; ++i) {
+      tree->findNearestWithinRadiusBatch(testPoints, radius, offsets, indices,
+                                         distances);
+    }
+    endTime = getTime();
+
+    std::cout << M << " batched radius queries completed in "
+              << (endTime - startTime) / repetitions << "s ("
+              << indices.size() << " neighbors)\n";
+  }
+
+  {
+    std::cout << "\nGrowing Implicit Tree...\n";
+    psImplicitKDTree<NumericType, D> tree;
+    auto startTime = getTime();
+    for (unsigned i = 0; i < repetitions; ++i) {
+      tree.setPoints(points);
+      tree.build();
+    }
+    auto endTime = getTime();
+    std::cout << "Implicit tree grew in " << (endTime - startTime) / repetitions
+              << "s\n";
+
+    std::vector<std::array<NumericType, D>> testArrays(M);
+    for (unsigned i = 0; i < M; ++i)
+      std::copy_n(testPoints[i].begin(), D, testArrays[i].begin());
+
+    // Nearest Neighbors
+    std::cout << "Finding Nearest Neighbors...\n";
+    startTime = getTime();
+    for (unsigned i = 0; i < repetitions; ++i) {
+      for (const auto &pt : testArrays)
+        [[maybe_unused]] auto result = tree.findNearest(pt);
+    }
+    endTime = getTime();
+
+    std::cout << M << " nearest neighbor queries completed in "
+              << (endTime - startTime) / repetitions << "s\n";
+
+    // K Nearest Neighbors
+    static constexpr int k = 8;
+    std::cout << "Finding " << k << " Nearest Neighbors...\n";
+    std::vector<std::pair<std::size_t, NumericType>> neighbors;
+    startTime = getTime();
+    for (unsigned i = 0; i < repetitions; ++i) {
+      for (const auto &pt : testArrays)
+        tree.findKNearest(pt, k, neighbors);
+    }
+    endTime = getTime();
+
+    std::cout << M << " k-nearest neighbor queries completed in "
+              << (endTime - startTime) / repetitions << "s\n";
+  }
+
+  {
+    // Points which move slightly between updates, e.g. surface points
+    std::cout << "\nUpdating Trees after small displacements...\n";
+    std::vector<std::array<NumericType, D>> arrays(N);
+    for (unsigned i = 0; i < N; ++i)
+      std::copy_n(points[i].begin(), D, arrays[i].begin());
+
+    psIncrementalKDTree<NumericType, D> incrementalTree;
+    incrementalTree.setPoints(arrays);
+    psKDTree<NumericType, std::array<NumericType, D>> tree;
+
+    double rebuildTime = 0., updateTime = 0.;
+    std::default_random_engine engine;
+    std::uniform_real_distribution<NumericType> displacement{-1e-3, 1e-3};
+    for (unsigned i = 0; i < repetitions; ++i) {
+      for (auto &point : arrays)
+        for (auto &coordinate : point)
+          coordinate += displacement(engine);
+
+      auto startTime = getTime();
+      tree.setPoints(arrays);
+      tree.build();
+      rebuildTime += getTime() - startTime;
+
+      startTime = getTime();
+      incrementalTree.setPoints(arrays);
+      updateTime += getTime() - startTime;
+    }
+
+    std::cout << "Tree rebuilt in " << rebuildTime / repetitions << "s\n";
+    std::cout << "Incremental tree updated in " << updateTime / repetitions
+              << "s (" << incrementalTree.getNumberOfRebuilds()
+              << " full builds)\n";
+
+    std::vector<std::array<NumericType, D>> testArrays(M);
+    for (unsigned i = 0; i < M; ++i)
+      std::copy_n(testPoints[i].begin(), D, testArrays[i].begin());
+
+    auto startTime = getTime();
+    for (const auto &pt : testArrays)
+      [[maybe_unused]] auto result = incrementalTree.findNearest(pt);
+    auto endTime = getTime();
+    std::cout << M << " nearest neighbor queries of the incremental tree "
+              << "completed in " << endTime - startTime << "s\n";
+
+    static constexpr int k = 8;
+    std::vector<std::pair<std::size_t, NumericType>> neighbors;
+    startTime = getTime();
+    for (const auto &pt : testArrays)
+      incrementalTree.findKNearest(pt, k, neighbors);
+    endTime = getTime();
+    std::cout << M << " k-nearest neighbor queries of the incremental tree "
+              << "completed in " << endTime - startTime << "s\n";
   }
+
+  std::cout << "\nApproximate search, uniform points\n";
+  approximateSearch(points, testPoints);
+
+  std::cout << "Approximate search, surface points\n";
+  approximateSearch(generateSurfacePoints<NumericType>(N, 0., 1),
+                    generateSurfacePoints<NumericType>(M, 0.1, 2));
 }
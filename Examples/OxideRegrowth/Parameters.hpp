@@ -23,7 +23,7 @@ template <typename T> struct Parameters {
   // Process
   T targetEtchDepth = 200.;     // nm
   T diffusionCoefficient = 50.; // diffusion cofficient nm²/s
-  T sink = 0.01;                // sink strength
+  T sink = 0.01;                // sink rate at the top 1/s
   // convection velocity in the scallops towards the center nm/s
   T scallopVelocity = 5.;
   // convection velocity in the center towards the sink on the top nm/s
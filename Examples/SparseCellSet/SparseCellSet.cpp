@@ -0,0 +1,92 @@
+#include <iostream>
+
+#include <lsBooleanOperation.hpp>
+#include <lsMakeGeometry.hpp>
+
+#include <csDenseCellSet.hpp>
+#include <psMakeTrench.hpp>
+#include <psUtils.hpp>
+
+// Compares the cell count, memory and build time of a dense csDenseCellSet
+// with one in sparse mode (cells only close to the surface) for a trench with
+// a deep cell set below the surface. The trench is then etched deeper and the
+// cell sets are updated.
+//
+// Usage: SparseCellSet [gridDelta] [cellSetDepth] [bandThickness]
+
+using NumericType = double;
+constexpr int D = 3;
+
+void printCellSet(const std::string &name,
+                  psSmartPointer<csDenseCellSet<NumericType, D>> cellSet,
+                  const NumericType time) {
+  std::cout << name << "\n";
+  std::cout << "  Cells: " << cellSet->getNumberOfCells() << "\n";
+  if (cellSet->isSparse())
+    std::cout << "  Tiles: " << cellSet->getNumberOfTiles() << "\n";
+  std::cout << "  Time: " << time * 1e-9 << "s\n";
+  std::cout << "  Memory: " << cellSet->getMemorySize() / 1e6 << "MB\n";
+}
+
+int main(int argc, char *argv[]) {
+  NumericType gridDelta = 0.1;
+  if (argc > 1)
+    gridDelta = std::atof(argv[1]);
+
+  NumericType cellSetDepth = -10.;
+  if (argc > 2)
+    cellSetDepth = std::atof(argv[2]);
+
+  NumericType bandThickness = 5 * gridDelta;
+  if (argc > 3)
+    bandThickness = std::atof(argv[3]);
+
+  auto domain = psSmartPointer<psDomain<NumericType, D>>::New();
+  psMakeTrench<NumericType, D>(domain, gridDelta, 5., 5.,
+                               1. /* trench width */, 2. /* trench depth */)
+      .apply();
+
+  psUtils::Timer timer;
+  auto denseCellSet = psSmartPointer<csDenseCellSet<NumericType, D>>::New();
+  timer.start();
+  denseCellSet->fromLevelSets(domain->getLevelSets(), nullptr, cellSetDepth);
+  timer.finish();
+  printCellSet("Dense cell set", denseCellSet, timer.currentDuration);
+
+  auto sparseCellSet = psSmartPointer<csDenseCellSet<NumericType, D>>::New();
+  sparseCellSet->setSparseBandThickness(bandThickness);
+  timer.start();
+  sparseCellSet->fromLevelSets(domain->getLevelSets(), nullptr, cellSetDepth);
+  timer.finish();
+  printCellSet("Sparse cell set", sparseCellSet, timer.currentDuration);
+
+  // etch the trench bottom deeper
+  {
+    auto &levelSets = domain->getLevelSets();
+    auto box = psSmartPointer<lsDomain<NumericType, D>>::New(
+        levelSets->back()->getGrid());
+    NumericType minPoint[D] = {-0.5, -2.5, -3.};
+    NumericType maxPoint[D] = {0.5, 2.5, 0.5};
+    lsMakeGeometry<NumericType, D>(
+        box, lsSmartPointer<lsBox<NumericType, D>>::New(minPoint, maxPoint))
+        .apply();
+    for (auto &ls : *levelSets)
+      lsBooleanOperation<NumericType, D>(
+          ls, box, lsBooleanOperationEnum::RELATIVE_COMPLEMENT)
+          .apply();
+  }
+
+  timer.start();
+  denseCellSet->updateSurface();
+  timer.finish();
+  printCellSet("Dense cell set after etching", denseCellSet,
+               timer.currentDuration);
+
+  timer.start();
+  sparseCellSet->updateSurface();
+  timer.finish();
+  printCellSet("Sparse cell set after etching", sparseCellSet,
+               timer.currentDuration);
+
+  sparseCellSet->writeVTU("sparseCellSet.vtu");
+}
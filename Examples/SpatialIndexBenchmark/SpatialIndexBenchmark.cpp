@@ -0,0 +1,104 @@
+#include <iostream>
+#include <vector>
+
+#include <hrleSparseIterator.hpp>
+
+#include <psKDTree.hpp>
+#include <psMakeHole.hpp>
+#include <psSpatialHashGrid.hpp>
+#include <psToDiskMesh.hpp>
+#include <psUtils.hpp>
+
+// Compares psKDTree with psSpatialHashGrid for the lookup of the nearest
+// surface point (disk mesh node) of each level set point, as done by the
+// translation field and psSurfacePointValuesToLevelSet: build time and
+// query time for single and batch queries.
+//
+// Usage: SpatialIndexBenchmark [gridDelta]
+
+using NumericType = double;
+constexpr int D = 3;
+
+int main(int argc, char *argv[]) {
+  NumericType gridDelta = 0.02;
+  if (argc > 1)
+    gridDelta = std::atof(argv[1]);
+
+  auto domain = psSmartPointer<psDomain<NumericType, D>>::New();
+  psMakeHole<NumericType, D>(domain, gridDelta, 4., 4., 1. /* radius */,
+                             2. /* depth */)
+      .apply();
+
+  auto mesh = psSmartPointer<lsMesh<NumericType>>::New();
+  psToDiskMesh<NumericType, D>(domain, mesh).apply();
+  const auto &nodes = mesh->nodes;
+
+  // the level set points are the queries
+  auto levelSet = domain->getLevelSets()->back();
+  std::vector<std::array<NumericType, 3>> queries;
+  for (hrleConstSparseIterator<typename lsDomain<NumericType, D>::DomainType>
+           it(levelSet->getDomain());
+       !it.isFinished(); ++it) {
+    if (!it.isDefined())
+      continue;
+    std::array<NumericType, 3> coordinate{0., 0., 0.};
+    for (int i = 0; i < D; ++i)
+      coordinate[i] = it.getStartIndices()[i] * gridDelta;
+    queries.push_back(coordinate);
+  }
+  std::cout << "Surface points: " << nodes.size()
+            << ", level set points: " << queries.size() << "\n";
+
+  psUtils::Timer timer;
+  std::vector<std::size_t> treeIndices, gridIndices;
+  std::vector<NumericType> treeDistances, gridDistances;
+
+  {
+    std::cout << "psKDTree\n";
+    timer.start();
+    psKDTree<NumericType, std::array<NumericType, 3>> tree(nodes);
+    tree.build();
+    timer.finish();
+    std::cout << "  Build time: " << timer.currentDuration * 1e-9 << "s\n";
+
+    timer.start();
+    for (const auto &query : queries)
+      [[maybe_unused]] auto nearest = tree.findNearest(query);
+    timer.finish();
+    std::cout << "  Single queries: " << timer.currentDuration * 1e-9
+              << "s\n";
+
+    timer.start();
+    tree.findNearestBatch(queries, treeIndices, treeDistances);
+    timer.finish();
+    std::cout << "  Batch query: " << timer.currentDuration * 1e-9 << "s\n";
+  }
+
+  {
+    std::cout << "psSpatialHashGrid\n";
+    timer.start();
+    psSpatialHashGrid<NumericType, 3> grid(nodes, gridDelta);
+    timer.finish();
+    std::cout << "  Build time: " << timer.currentDuration * 1e-9 << "s\n";
+
+    timer.start();
+    for (const auto &query : queries)
+      [[maybe_unused]] auto nearest = grid.findNearest(query);
+    timer.finish();
+    std::cout << "  Single queries: " << timer.currentDuration * 1e-9
+              << "s\n";
+
+    timer.start();
+    grid.findNearestBatch(queries, gridIndices, gridDistances);
+    timer.finish();
+    std::cout << "  Batch query: " << timer.currentDuration * 1e-9 << "s\n";
+  }
+
+  // both searches are exact, only ties may be resolved differently
+  std::size_t mismatches = 0;
+  for (std::size_t i = 0; i < queries.size(); ++i) {
+    if (std::abs(treeDistances[i] - gridDistances[i]) > 1e-12 * gridDelta)
+      ++mismatches;
+  }
+  std::cout << "Mismatching distances: " << mismatches << "\n";
+}
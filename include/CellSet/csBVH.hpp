@@ -8,7 +8,7 @@ template <class T, int D> class csBVH {
 private:
   using BVPtrType = lsSmartPointer<csBoundingVolume<T, D>>;
   using BoundsType = csPair<std::array<T, D>>;
-  using CellIdsPtr = std::set<unsigned> *;
+  using CellIdsType = typename csBoundingVolume<T, D>::CellIdRange;
 
   unsigned numLayers = 1;
   BVPtrType BV = nullptr;
@@ -16,20 +16,35 @@ private:
 public:
   csBVH(const BoundsType &domainBounds, unsigned layers = 1)
       : numLayers(layers) {
-    BV = BVPtrType::New(domainBounds, numLayers - 1);
+    BV = BVPtrType::New(domainBounds, numLayers);
   }
 
   BVPtrType getTopBV() { return BV; }
 
   void getLowestBVBounds(const std::array<T, 3> &point) {
-    BV->getBoundingVolumeBounds(point);
+    BV->printBound(BV->getLeafIndex(point));
   }
 
-  CellIdsPtr getCellIds(const std::array<T, 3> &point) {
-    return BV->getCellIds(point);
+  // Cells which have at least one node in the leaf containing the point.
+  // The range is empty if the point is outside of the BVH.
+  CellIdsType getCellIds(const std::array<T, 3> &point) const {
+    return BV->getCellIds(BV->getLeafIndex(point));
+  }
+
+  template <size_t N>
+  bool buildCellIds(const std::vector<std::array<unsigned, N>> &cells,
+                    const std::vector<std::array<T, 3>> &nodes) {
+    return BV->build(cells, nodes);
+  }
+
+  // Update the cell indices after cells were removed from the cell set.
+  void remapCellIds(const std::vector<int> &newIndex) {
+    BV->remapCellIds(newIndex);
   }
 
   void clearCellIds() { BV->clear(); }
 
   size_t getTotalCellCount() { return BV->getTotalCellCounts(); }
-};
\ No newline at end of file
+
+  size_t getMemorySize() const { return BV->getMemorySize(); }
+};
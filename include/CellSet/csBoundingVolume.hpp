@@ -1,206 +1,232 @@
 #pragma once
 
-#include <set>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
 
 #include <csUtil.hpp>
 
-#include <lsSmartPointer.hpp>
-
+/**
+  Linear octree (quadtree in 2D) with a fixed number of layers stored in
+  contiguous arrays. The tree is complete, so a node is identified by its
+  Morton code: the child index at each layer is given by D bits of the code
+  and the parent of a node is its code shifted right by D bits. Only the
+  leaves store cells; their cell indices are kept in one buffer in compressed
+  row storage, indexed by the Morton code of the leaf.
+*/
 template <class T, int D> class csBoundingVolume {
 private:
-  using BVPtrType = lsSmartPointer<csBoundingVolume<T, D>>;
   using BoundsType = csPair<std::array<T, D>>;
-  using CellIdsPtr = std::set<unsigned> *;
-
-  static constexpr int numCells = 1 << D;
-  std::array<std::set<unsigned>, numCells> cellIds;
-  std::array<BoundsType, numCells> bounds;
-  std::array<BVPtrType, numCells> links;
-  int layer = -1;
-
-public:
-  csBoundingVolume() {}
-  csBoundingVolume(const BoundsType &outerBound, int thisLayer)
-      : layer(thisLayer) {
 
-    if constexpr (D == 3)
-      buildBounds3D(outerBound);
-    else
-      buildBounds2D(outerBound);
+  BoundsType bounds;
+  unsigned numLayers = 0;
+  unsigned leavesPerDim = 1;
+  std::array<T, D> leafExtent;
 
-    if (layer > 0) {
-      for (size_t i = 0; i < numCells; i++) {
-        links[i] = BVPtrType::New(bounds[i], layer - 1);
-      }
-    }
-  }
+  // cell indices of leaf i are cellIds[leafStart[i]] ... cellIds[leafStart[i
+  // + 1] - 1]
+  std::vector<unsigned> leafStart;
+  std::vector<unsigned> cellIds;
 
-  CellIdsPtr getCellIds(const std::array<T, 3> &point) {
-    auto vid = getVolumeIndex(point);
-    // assert(vid < numCells && "Point in invalid BV");
+public:
+  // Range of cell indices stored in one leaf
+  struct CellIdRange {
+    const unsigned *first = nullptr;
+    const unsigned *last = nullptr;
 
-    if (vid == numCells)
-      return nullptr;
+    const unsigned *begin() const { return first; }
+    const unsigned *end() const { return last; }
+    size_t size() const { return last - first; }
+    bool empty() const { return first == last; }
+  };
 
-    if (layer == 0) {
-      return &cellIds[vid];
-    }
+  csBoundingVolume() {}
 
-    return links[vid]->getCellIds(point);
+  csBoundingVolume(const BoundsType &passedBounds, unsigned passedNumLayers)
+      : bounds(passedBounds), numLayers(passedNumLayers) {
+    // 10 bits per dimension keep the Morton code in 32 bits
+    if (numLayers > 10)
+      numLayers = 10;
+    leavesPerDim = 1u << numLayers;
+    for (int i = 0; i < D; ++i)
+      leafExtent[i] = (bounds[1][i] - bounds[0][i]) / leavesPerDim;
+    leafStart.assign(getNumberOfLeaves() + 1, 0);
   }
 
-  void getBoundingVolumeBounds(const std::array<T, D> &point) {
-    auto vid = getVolumeIndex(point);
-    assert(vid < numCells && "Point in invalid BV");
-
-    if (layer == 0) {
-      printBound(vid);
-      return;
+  size_t getNumberOfLeaves() const { return size_t(1) << (D * numLayers); }
+
+  unsigned getNumberOfLayers() const { return numLayers; }
+
+  // Morton code of the leaf containing the point or the number of leaves if
+  // the point is outside of the bounds. The lower bound of a leaf is
+  // exclusive and the upper bound inclusive.
+  size_t getLeafIndex(const std::array<T, 3> &point) const {
+    std::array<unsigned, D> leafCoords;
+    for (int i = 0; i < D; ++i) {
+      const T relative = (point[i] - bounds[0][i]) / leafExtent[i];
+      const T c = std::ceil(relative) - 1;
+      if (!(c >= 0 && c < leavesPerDim))
+        return getNumberOfLeaves();
+      leafCoords[i] = static_cast<unsigned>(c);
     }
+    return mortonCode(leafCoords);
+  }
 
-    links[vid]->getBoundingVolumeBounds(point);
+  CellIdRange getCellIds(const size_t leafIdx) const {
+    if (leafIdx >= getNumberOfLeaves())
+      return CellIdRange{};
+    return CellIdRange{cellIds.data() + leafStart[leafIdx],
+                       cellIds.data() + leafStart[leafIdx + 1]};
   }
 
-  size_t getTotalCellCounts() {
-    size_t count = 0;
-    if (layer == 0) {
-      for (size_t i = 0; i < numCells; i++) {
-        count += cellIds[i].size();
-      }
-      return count;
-    } else {
-      for (size_t i = 0; i < numCells; i++) {
-        count += links[i]->getTotalCellCounts();
+  // Sort the cells into the leaves containing at least one of their nodes.
+  // Returns false if a node lies outside of the bounds.
+  template <size_t N>
+  bool build(const std::vector<std::array<unsigned, N>> &cells,
+             const std::vector<std::array<T, 3>> &nodes) {
+    const long numCells = cells.size();
+    const auto numLeaves = getNumberOfLeaves();
+    std::vector<std::array<unsigned, N>> cellLeaves(numCells);
+    leafStart.assign(numLeaves + 1, 0);
+    bool allInside = true;
+
+#pragma omp parallel for reduction(&& : allInside)
+    for (long cellIdx = 0; cellIdx < numCells; ++cellIdx) {
+      auto &leaves = cellLeaves[cellIdx];
+      for (size_t n = 0; n < N; ++n) {
+        leaves[n] = getLeafIndex(nodes[cells[cellIdx][n]]);
+        allInside = allInside && leaves[n] < numLeaves;
+        // count every leaf of a cell only once
+        bool duplicate = false;
+        for (size_t m = 0; m < n; ++m)
+          duplicate |= leaves[m] == leaves[n];
+        if (duplicate || leaves[n] >= numLeaves) {
+          leaves[n] = numLeaves;
+          continue;
+        }
+#pragma omp atomic
+        ++leafStart[leaves[n] + 1];
       }
     }
-    return count;
-  }
 
-  void clear() {
-    if (layer == 0) {
-      for (size_t i = 0; i < numCells; i++) {
-        cellIds[i].clear();
-      }
-    } else {
-      for (size_t i = 0; i < numCells; i++) {
-        links[i]->clear();
+    for (size_t i = 0; i < numLeaves; ++i)
+      leafStart[i + 1] += leafStart[i];
+    cellIds.resize(leafStart.back());
+
+    auto fillPosition = leafStart;
+#pragma omp parallel for
+    for (long cellIdx = 0; cellIdx < numCells; ++cellIdx) {
+      for (const auto leaf : cellLeaves[cellIdx]) {
+        if (leaf >= numLeaves)
+          continue;
+        unsigned pos;
+#pragma omp atomic capture
+        pos = fillPosition[leaf]++;
+        cellIds[pos] = cellIdx;
       }
     }
-  }
 
-  BVPtrType getLink(const std::array<T, 3> &point) {
-    auto vid = getVolumeIndex(point);
-    return getLink(vid);
-  }
+    // sort the cells in each leaf to be independent of the thread schedule
+#pragma omp parallel for schedule(dynamic, 256)
+    for (long leaf = 0; leaf < static_cast<long>(numLeaves); ++leaf)
+      std::sort(cellIds.begin() + leafStart[leaf],
+                cellIds.begin() + leafStart[leaf + 1]);
 
-  BVPtrType getLink(size_t vid) { return links[vid]; }
+    return allInside;
+  }
 
-  size_t getVolumeIndex(const std::array<T, 3> &point) {
-    size_t vid = numCells;
-    for (size_t idx = 0; idx < numCells; idx++) {
-      if (insideVolume(point, idx)) {
-        vid = idx;
-        break;
+  // Replace every cell index by its new index and drop the cells with a
+  // negative new index. The new indices have to preserve the order of the
+  // cells, so that the leaves stay sorted.
+  void remapCellIds(const std::vector<int> &newIndex) {
+    const auto numLeaves = getNumberOfLeaves();
+    unsigned numberOfKept = 0;
+    unsigned leafBegin = 0;
+    for (size_t leaf = 0; leaf < numLeaves; ++leaf) {
+      const auto leafEnd = leafStart[leaf + 1];
+      for (auto i = leafBegin; i < leafEnd; ++i) {
+        const int cellId = newIndex[cellIds[i]];
+        if (cellId >= 0)
+          cellIds[numberOfKept++] = cellId;
       }
+      leafBegin = leafEnd;
+      leafStart[leaf + 1] = numberOfKept;
     }
-    return vid;
+    cellIds.resize(numberOfKept);
   }
 
-  bool insideVolume(const std::array<T, 3> &p, const size_t idx) const {
-    if constexpr (D == 3) {
-      return p[0] > bounds[idx][0][0] && p[0] <= bounds[idx][1][0] &&
-             p[1] > bounds[idx][0][1] && p[1] <= bounds[idx][1][1] &&
-             p[2] > bounds[idx][0][2] && p[2] <= bounds[idx][1][2];
-    } else {
-      return p[0] > bounds[idx][0][0] && p[0] <= bounds[idx][1][0] &&
-             p[1] > bounds[idx][0][1] && p[1] <= bounds[idx][1][1];
-    }
+  void clear() {
+    std::fill(leafStart.begin(), leafStart.end(), 0);
+    cellIds.clear();
   }
 
-  void printBound(size_t vid) {
+  size_t getTotalCellCounts() const { return cellIds.size(); }
+
+  // Memory used by the leaf arrays in bytes
+  size_t getMemorySize() const {
+    return (leafStart.capacity() + cellIds.capacity()) * sizeof(unsigned);
+  }
+
+  void printBound(const size_t leafIdx) const {
+    std::array<unsigned, D> leafCoords = mortonDecode(leafIdx);
     std::cout << "Bounding volume span: [";
     for (int i = 0; i < D; i++)
-      std::cout << bounds[vid][0][i] << ", ";
+      std::cout << bounds[0][i] + leafCoords[i] * leafExtent[i] << ", ";
     std::cout << "] - [";
     for (int i = 0; i < D; i++)
-      std::cout << bounds[vid][1][i] << ", ";
+      std::cout << bounds[0][i] + (leafCoords[i] + 1) * leafExtent[i] << ", ";
     std::cout << "]\n";
   }
 
 private:
-  void buildBounds2D(const BoundsType &outerBound) {
-    auto xExt = (outerBound[1][0] - outerBound[0][0]) / 2.;
-    auto yExt = (outerBound[1][1] - outerBound[0][1]) / 2.;
-
-    const auto BVH1 =
-        csPair<csPair<T>>{outerBound[0][0], outerBound[0][1],
-                          outerBound[0][0] + xExt, outerBound[0][1] + yExt};
-    const auto BVH2 =
-        csPair<csPair<T>>{outerBound[0][0] + xExt, outerBound[0][1],
-                          outerBound[0][0] + 2 * xExt, outerBound[0][1] + yExt};
-    const auto BVH3 = csPair<csPair<T>>{
-        outerBound[0][0] + xExt,
-        outerBound[0][1] + yExt,
-        outerBound[0][0] + 2 * xExt,
-        outerBound[0][1] + 2 * yExt,
-    };
-    const auto BVH4 = csPair<csPair<T>>{
-        outerBound[0][0],
-        outerBound[0][1] + yExt,
-        outerBound[0][0] + xExt,
-        outerBound[0][1] + 2 * yExt,
-    };
-
-    bounds =
-        std::array<csPair<std::array<T, D>>, numCells>{BVH1, BVH2, BVH3, BVH4};
+  // interleave the bits of the leaf coordinates
+  static size_t mortonCode(const std::array<unsigned, D> &leafCoords) {
+    size_t code = 0;
+    for (int i = 0; i < D; ++i)
+      code |= spreadBits(leafCoords[i]) << i;
+    return code;
   }
 
-  void buildBounds3D(const BoundsType &outerBound) {
-    auto xExt = (outerBound[1][0] - outerBound[0][0]) / T(2);
-    auto yExt = (outerBound[1][1] - outerBound[0][1]) / T(2);
-    auto zExt = (outerBound[1][2] - outerBound[0][2]) / T(2);
-
-    const auto BVH1 =
-        csPair<csTriple<T>>{outerBound[0][0],        outerBound[0][1],
-                            outerBound[0][2],        outerBound[0][0] + xExt,
-                            outerBound[0][1] + yExt, outerBound[0][2] + zExt};
-    const auto BVH2 = csPair<csTriple<T>>{
-        outerBound[0][0] + xExt, outerBound[0][1],
-        outerBound[0][2],        outerBound[0][0] + 2 * xExt,
-        outerBound[0][1] + yExt, outerBound[0][2] + zExt};
-    const auto BVH3 = csPair<csTriple<T>>{outerBound[0][0] + xExt,
-                                          outerBound[0][1] + yExt,
-                                          outerBound[0][2],
-                                          outerBound[0][0] + 2 * xExt,
-                                          outerBound[0][1] + 2 * yExt,
-                                          outerBound[0][2] + zExt};
-    const auto BVH4 = csPair<csTriple<T>>{outerBound[0][0],
-                                          outerBound[0][1] + yExt,
-                                          outerBound[0][2],
-                                          outerBound[0][0] + xExt,
-                                          outerBound[0][1] + 2 * yExt,
-                                          outerBound[0][2] + zExt};
-
-    // top
-    const auto BVH5 = csPair<csTriple<T>>{
-        outerBound[0][0],        outerBound[0][1],
-        outerBound[0][2] + zExt, outerBound[0][0] + xExt,
-        outerBound[0][1] + yExt, outerBound[0][2] + 2 * zExt};
-    const auto BVH6 = csPair<csTriple<T>>{
-        outerBound[0][0] + xExt, outerBound[0][1],
-        outerBound[0][2] + zExt, outerBound[0][0] + 2 * xExt,
-        outerBound[0][1] + yExt, outerBound[0][2] + 2 * zExt};
-    const auto BVH7 = csPair<csTriple<T>>{
-        outerBound[0][0] + xExt,     outerBound[0][1] + yExt,
-        outerBound[0][2] + zExt,     outerBound[0][0] + 2 * xExt,
-        outerBound[0][1] + 2 * yExt, outerBound[0][2] + 2 * zExt};
-    const auto BVH8 = csPair<csTriple<T>>{outerBound[0][0],
-                                          outerBound[0][1] + yExt,
-                                          outerBound[0][2] + zExt,
-                                          outerBound[0][0] + xExt,
-                                          outerBound[0][1] + 2 * yExt,
-                                          outerBound[0][2] + 2 * zExt};
-    bounds = std::array<csPair<std::array<T, D>>, numCells>{
-        BVH1, BVH2, BVH3, BVH4, BVH5, BVH6, BVH7, BVH8};
+  static std::array<unsigned, D> mortonDecode(size_t code) {
+    std::array<unsigned, D> leafCoords;
+    for (int i = 0; i < D; ++i)
+      leafCoords[i] = compactBits(code >> i);
+    return leafCoords;
+  }
+
+  // insert D - 1 zero bits between the lower 10 bits of x
+  static size_t spreadBits(size_t x) {
+    if constexpr (D == 3) {
+      x &= 0x3ff;
+      x = (x | (x << 16)) & 0x30000ff;
+      x = (x | (x << 8)) & 0x300f00f;
+      x = (x | (x << 4)) & 0x30c30c3;
+      x = (x | (x << 2)) & 0x9249249;
+    } else {
+      x &= 0x3ff;
+      x = (x | (x << 8)) & 0x00ff00ff;
+      x = (x | (x << 4)) & 0x0f0f0f0f;
+      x = (x | (x << 2)) & 0x33333333;
+      x = (x | (x << 1)) & 0x55555555;
+    }
+    return x;
+  }
+
+  static unsigned compactBits(size_t x) {
+    if constexpr (D == 3) {
+      x &= 0x9249249;
+      x = (x | (x >> 2)) & 0x30c30c3;
+      x = (x | (x >> 4)) & 0x300f00f;
+      x = (x | (x >> 8)) & 0x30000ff;
+      x = (x | (x >> 16)) & 0x3ff;
+    } else {
+      x &= 0x55555555;
+      x = (x | (x >> 1)) & 0x33333333;
+      x = (x | (x >> 2)) & 0x0f0f0f0f;
+      x = (x | (x >> 4)) & 0x00ff00ff;
+      x = (x | (x >> 8)) & 0x3ff;
+    }
+    return static_cast<unsigned>(x);
   }
 };
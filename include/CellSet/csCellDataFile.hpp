@@ -0,0 +1,253 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define CS_CELL_DATA_USE_MMAP
+#endif
+
+#include <csUtil.hpp>
+#include <psLogger.hpp>
+
+/**
+  Binary columnar file format for the scalar data of a cell set. The file
+  starts with a header holding the format version, the number of cells, the
+  grid delta, the extent of the cell grid and the data labels, followed by
+  one raw array per label. All arrays start at 64 byte aligned offsets, so
+  an opened file is memory mapped and the data is read without parsing or
+  copying.
+
+  Layout: magic "CSDATA\0\0", uint32 version, uint32 endianness check,
+  uint32 value size, uint32 number of arrays, uint64 number of cells,
+  float64 grid delta, float64[3] minimum and maximum extent, per label a
+  uint32 length and the characters, padding, arrays.
+*/
+template <class T> class csCellDataFile {
+  static constexpr char magic[8] = {'C', 'S', 'D', 'A', 'T', 'A', 0, 0};
+  static constexpr uint32_t version = 1;
+  static constexpr uint32_t endiannessCheck = 0x01020304;
+  static constexpr size_t alignment = 64;
+
+  std::string fileName;
+  uint64_t numberOfCells = 0;
+  double gridDelta = 0.;
+  csTriple<double> minimumExtent = {0., 0., 0.};
+  csTriple<double> maximumExtent = {0., 0., 0.};
+  std::vector<std::string> labels;
+  std::vector<const T *> arrays;
+
+  // mapped file or, without mmap support, the file read into memory
+  const char *fileData = nullptr;
+  size_t fileSize = 0;
+  std::unique_ptr<char[]> buffer;
+
+public:
+  csCellDataFile() {}
+
+  ~csCellDataFile() { close(); }
+
+  csCellDataFile(const csCellDataFile &) = delete;
+  csCellDataFile &operator=(const csCellDataFile &) = delete;
+
+  // Write the arrays, each of length numberOfCells, with their labels.
+  static bool write(const std::string &fileName, const uint64_t numberOfCells,
+                    const double gridDelta,
+                    const csTriple<double> &minimumExtent,
+                    const csTriple<double> &maximumExtent,
+                    const std::vector<std::string> &labels,
+                    const std::vector<const std::vector<T> *> &arrays) {
+    std::ofstream file(fileName, std::ios::binary);
+    if (!file.is_open()) {
+      psLogger::getInstance()
+          .addWarning("Could not open file " + fileName)
+          .print();
+      return false;
+    }
+
+    const uint32_t valueSize = sizeof(T);
+    const uint32_t numberOfArrays = arrays.size();
+    file.write(magic, sizeof(magic));
+    writeValue(file, version);
+    writeValue(file, endiannessCheck);
+    writeValue(file, valueSize);
+    writeValue(file, numberOfArrays);
+    writeValue(file, numberOfCells);
+    writeValue(file, gridDelta);
+    for (int i = 0; i < 3; ++i)
+      writeValue(file, minimumExtent[i]);
+    for (int i = 0; i < 3; ++i)
+      writeValue(file, maximumExtent[i]);
+    for (const auto &label : labels) {
+      const uint32_t length = label.size();
+      writeValue(file, length);
+      file.write(label.data(), length);
+    }
+
+    for (const auto array : arrays) {
+      pad(file);
+      file.write(reinterpret_cast<const char *>(array->data()),
+                 numberOfCells * sizeof(T));
+    }
+
+    return file.good();
+  }
+
+  // Check whether the file starts with the binary format identifier
+  static bool isBinary(const std::string &fileName) {
+    std::ifstream file(fileName, std::ios::binary);
+    char fileMagic[sizeof(magic)] = {};
+    file.read(fileMagic, sizeof(fileMagic));
+    return file.good() && std::memcmp(fileMagic, magic, sizeof(magic)) == 0;
+  }
+
+  // Map the file into memory and read the header. The data arrays stay valid
+  // until the file is closed.
+  bool open(const std::string &passedFileName) {
+    close();
+    fileName = passedFileName;
+    if (!mapFile())
+      return false;
+
+    size_t offset = 0;
+    char fileMagic[sizeof(magic)];
+    uint32_t fileVersion = 0, fileEndianness = 0, valueSize = 0,
+             numberOfArrays = 0;
+    bool valid = readValue(offset, fileMagic) &&
+                 std::memcmp(fileMagic, magic, sizeof(magic)) == 0 &&
+                 readValue(offset, fileVersion) &&
+                 readValue(offset, fileEndianness) &&
+                 readValue(offset, valueSize) &&
+                 readValue(offset, numberOfArrays) &&
+                 readValue(offset, numberOfCells) &&
+                 readValue(offset, gridDelta) &&
+                 readValue(offset, minimumExtent) &&
+                 readValue(offset, maximumExtent);
+    if (!valid || fileVersion != version ||
+        fileEndianness != endiannessCheck || valueSize != sizeof(T)) {
+      psLogger::getInstance()
+          .addWarning("Incompatible cell set data file " + fileName)
+          .print();
+      close();
+      return false;
+    }
+
+    for (uint32_t i = 0; i < numberOfArrays && valid; ++i) {
+      uint32_t length = 0;
+      valid = readValue(offset, length) && offset + length <= fileSize;
+      if (valid) {
+        labels.emplace_back(fileData + offset, length);
+        offset += length;
+      }
+    }
+
+    for (uint32_t i = 0; i < numberOfArrays && valid; ++i) {
+      offset = (offset + alignment - 1) / alignment * alignment;
+      // compare the number of cells, the size of the array can overflow for
+      // a corrupt header
+      valid = offset <= fileSize &&
+              numberOfCells <= (fileSize - offset) / sizeof(T);
+      if (valid) {
+        arrays.push_back(reinterpret_cast<const T *>(fileData + offset));
+        offset += numberOfCells * sizeof(T);
+      }
+    }
+
+    if (!valid) {
+      psLogger::getInstance()
+          .addWarning("Truncated cell set data file " + fileName)
+          .print();
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void close() {
+#ifdef CS_CELL_DATA_USE_MMAP
+    if (fileData && !buffer)
+      munmap(const_cast<char *>(fileData), fileSize);
+#endif
+    buffer.reset();
+    fileData = nullptr;
+    fileSize = 0;
+    numberOfCells = 0;
+    labels.clear();
+    arrays.clear();
+  }
+
+  uint64_t getNumberOfCells() const { return numberOfCells; }
+
+  double getGridDelta() const { return gridDelta; }
+
+  const csTriple<double> &getMinimumExtent() const { return minimumExtent; }
+
+  const csTriple<double> &getMaximumExtent() const { return maximumExtent; }
+
+  const std::vector<std::string> &getLabels() const { return labels; }
+
+  // Values of the array with the given index, not copied from the file
+  const T *getData(const unsigned arrayIdx) const { return arrays[arrayIdx]; }
+
+private:
+  template <class V> static void writeValue(std::ofstream &file, const V &v) {
+    file.write(reinterpret_cast<const char *>(&v), sizeof(V));
+  }
+
+  static void pad(std::ofstream &file) {
+    const size_t position = file.tellp();
+    const size_t padding = (alignment - position % alignment) % alignment;
+    const char zeros[alignment] = {};
+    file.write(zeros, padding);
+  }
+
+  template <class V> bool readValue(size_t &offset, V &v) const {
+    if (offset + sizeof(V) > fileSize)
+      return false;
+    std::memcpy(&v, fileData + offset, sizeof(V));
+    offset += sizeof(V);
+    return true;
+  }
+
+  bool mapFile() {
+#ifdef CS_CELL_DATA_USE_MMAP
+    const int fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd >= 0) {
+      struct stat fileStat;
+      void *mapped = MAP_FAILED;
+      if (fstat(fd, &fileStat) == 0 && fileStat.st_size > 0) {
+        fileSize = fileStat.st_size;
+        mapped = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+      }
+      ::close(fd);
+      if (mapped != MAP_FAILED) {
+        fileData = static_cast<const char *>(mapped);
+        return true;
+      }
+    }
+#endif
+    // read the whole file into memory instead
+    std::ifstream file(fileName, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+      psLogger::getInstance()
+          .addWarning("Could not open file " + fileName)
+          .print();
+      fileSize = 0;
+      return false;
+    }
+    fileSize = file.tellg();
+    buffer.reset(new char[fileSize]);
+    file.seekg(0);
+    file.read(buffer.get(), fileSize);
+    fileData = buffer.get();
+    return file.good();
+  }
+};
@@ -2,9 +2,11 @@
 #define DENSE_CELL_SET
 
 #include <csBVH.hpp>
+#include <csCellDataFile.hpp>
 #include <csTracePath.hpp>
 #include <csUtil.hpp>
 
+#include <hrleSparseIterator.hpp>
 #include <lsDomain.hpp>
 #include <lsMakeGeometry.hpp>
 #include <lsMesh.hpp>
@@ -18,9 +20,22 @@
 #include <psSmartPointer.hpp>
 #include <psVTKWriter.hpp>
 
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <numeric>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <omp.h>
+
 /**
   This class represents a cell-based voxel implementation of a volume. The
   depth of the cell set in z-direction can be specified.
+
+  In sparse mode (see setSparseBandThickness) only the cells close to the
+  surface are allocated, in tiles of 8^D cells, so that the memory scales with
+  the region reached by the surface instead of the full volume.
 */
 template <class T, int D> class csDenseCellSet {
 private:
@@ -44,6 +59,33 @@ private:
   const T eps = 1e-4;
   hrleVectorType<hrleIndexType, D> minIndex, maxIndex;
 
+  // Dense map from the integer coordinates of a cell (coordinates of its
+  // minimum corner divided by the grid delta) to the cell index, -1 where
+  // there is no cell. The BVH can still be selected for the lookup.
+  bool useBVH = false;
+  std::vector<int> cellIndexMap;
+  std::array<int, D> indexMapMin = {};
+  std::array<int, D> indexMapExtent = {};
+
+  // cells in the narrow band of the level sets at the last material update
+  std::vector<unsigned> materialBandCells;
+  bool materialBandValid = false;
+  // false once cells were appended, which are not in the order of the grid
+  bool cellsInGridOrder = true;
+
+  // Sparse mode: the cells are allocated in tiles of 8^D cells, which are
+  // addressed through a hash map instead of the dense index map. Each tile
+  // maps the position in the tile to the cell index, -1 where there is no
+  // cell.
+  static constexpr int tileBits = 3;
+  static constexpr int tileWidth = 1 << tileBits;
+  static constexpr int tileSize = 1 << (tileBits * D);
+  T sparseBandThickness = 0.;
+  std::unordered_map<std::uint64_t, unsigned> tileIndices;
+  std::vector<std::array<int, tileSize>> tiles;
+  // value of each scalar data in newly allocated cells
+  std::unordered_map<std::string, T> initialValues;
+
 public:
   csDenseCellSet() {}
 
@@ -70,28 +112,22 @@ public:
     gridDelta = surface->getGrid().getGridDelta();
 
     depth = passedDepth;
-    std::vector<psSmartPointer<lsDomain<T, D>>> levelSetsInOrder;
-    auto plane = psSmartPointer<lsDomain<T, D>>::New(surface->getGrid());
-    {
-      T origin[D] = {0.};
-      T normal[D] = {0.};
-      origin[D - 1] = depth;
-      normal[D - 1] = 1.;
-      lsMakeGeometry<T, D>(plane,
-                           psSmartPointer<lsPlane<T, D>>::New(origin, normal))
-          .apply();
-    }
-    if (!cellSetAboveSurface)
-      levelSetsInOrder.push_back(plane);
-    for (auto ls : *levelSets)
-      levelSetsInOrder.push_back(ls);
-    if (cellSetAboveSurface) {
-      levelSetsInOrder.push_back(plane);
-    }
+    const auto levelSetsInOrder = getLevelSetsInOrder();
 
     calculateMinMaxIndex(levelSetsInOrder);
-    lsToVoxelMesh<T, D>(levelSetsInOrder, cellGrid).apply();
-    // lsToVoxelMesh also saves the extent in the cell grid
+    if (isSparse()) {
+      // the cells are added tile by tile in allocateBandTiles
+      cellGrid->clear();
+      for (int i = 0; i < 3; ++i) {
+        cellGrid->minimumExtent[i] = i < D ? minIndex[i] * gridDelta : 0.;
+        cellGrid->maximumExtent[i] = i < D ? maxIndex[i] * gridDelta : 0.;
+      }
+      cellGrid->getCellData().insertNextScalarData(std::vector<T>(),
+                                                   "Material");
+    } else {
+      lsToVoxelMesh<T, D>(levelSetsInOrder, cellGrid).apply();
+      // lsToVoxelMesh also saves the extent in the cell grid
+    }
 
 #ifndef NDEBUG
     int db_ls = 0;
@@ -104,12 +140,16 @@ public:
     psVTKWriter<T>(cellGrid, "cellSet_debug_init.vtu").apply();
 #endif
 
-    if (!cellSetAboveSurface || materialMap)
+    if (!isSparse() && (!cellSetAboveSurface || materialMap))
       adjustMaterialIds();
 
     // create filling fractions as default scalar cell data
     numberOfCells = cellGrid->template getElements<(1 << D)>().size();
+    materialBandValid = false;
+    cellsInGridOrder = !isSparse();
     std::vector<T> fillingFractionsTemp(numberOfCells, 0.);
+    initialValues.clear();
+    initialValues["fillingFraction"] = 0.;
 
     cellGrid->getCellData().insertNextScalarData(
         std::move(fillingFractionsTemp), "fillingFraction");
@@ -133,8 +173,12 @@ public:
       minExtent /= 2;
     }
 
-    BVH = psSmartPointer<csBVH<T, D>>::New(getBoundingBox(), BVHlayers);
-    buildBVH();
+    tileIndices.clear();
+    tiles.clear();
+    if (isSparse())
+      allocateBandTiles(levelSetsInOrder);
+    else
+      buildCellLookup();
   }
 
   csPair<std::array<T, D>> getBoundingBox() const {
@@ -148,6 +192,7 @@ public:
   }
 
   std::vector<T> *addScalarData(std::string name, T initValue) {
+    initialValues[name] = initValue;
     std::vector<T> newData(numberOfCells, initValue);
     cellGrid->getCellData().insertNextScalarData(std::move(newData), name);
     fillingFractions = cellGrid->getCellData().getScalarData("fillingFraction");
@@ -157,6 +202,7 @@ public:
   gridType getCellGrid() { return cellGrid; }
 
   T getDepth() const { return depth; }
+  materialMapType getMaterialMap() const { return materialMap; }
 
   T getGridDelta() const { return gridDelta; }
 
@@ -184,7 +230,142 @@ public:
     return getFillingFractions()->at(idx);
   }
 
-  int getIndex(const std::array<T, 3> &point) { return findIndex(point); }
+  int getIndex(const std::array<T, 3> &point) const { return findIndex(point); }
+
+  // Returns the index of the cell with the given integer coordinates or -1 if
+  // there is no such cell.
+  int getIndex(const std::array<int, D> &cellCoordinates) const {
+    if (isSparse()) {
+      auto it = tileIndices.find(getTileKey(cellCoordinates));
+      if (it == tileIndices.end())
+        return -1;
+      return tiles[it->second][getPositionInTile(cellCoordinates)];
+    }
+    if (useBVH && cellIndexMap.empty()) {
+      csTriple<T> center = {0., 0., 0.};
+      for (int i = 0; i < D; ++i)
+        center[i] = (cellCoordinates[i] + T(0.5)) * gridDelta;
+      return findIndex(center);
+    }
+    const auto linearIdx = getIndexMapPosition(cellCoordinates);
+    return linearIdx < 0 ? -1 : cellIndexMap[linearIdx];
+  }
+
+  // Integer coordinates of a cell: coordinates of its minimum corner divided
+  // by the grid delta
+  std::array<int, D> getCellCoordinates(const unsigned long cellIdx) const {
+    const auto &minNode =
+        cellGrid->getNodes()[cellGrid->template getElements<(1 << D)>()
+                                 [cellIdx][0]];
+    std::array<int, D> coordinates;
+    for (int i = 0; i < D; ++i)
+      coordinates[i] = static_cast<int>(std::round(minNode[i] / gridDelta));
+    return coordinates;
+  }
+
+  csTriple<T> getCellCenter(const unsigned long cellIdx) const {
+    const auto coordinates = getCellCoordinates(cellIdx);
+    csTriple<T> center = {0., 0., 0.};
+    for (int i = 0; i < D; ++i)
+      center[i] = (coordinates[i] + T(0.5)) * gridDelta;
+    return center;
+  }
+
+  // Use the BVH instead of the dense index map for locating the cell which
+  // contains a point.
+  void setUseBVH(const bool passedUseBVH) {
+    if (passedUseBVH != useBVH) {
+      useBVH = passedUseBVH;
+      if (cellGrid && numberOfCells > 0)
+        buildCellLookup();
+    }
+  }
+
+  // Number of entries in the dense index map
+  size_t getIndexMapSize() const { return cellIndexMap.size(); }
+
+  // BVH used for the cell lookup, nullptr if the index map is used
+  psSmartPointer<csBVH<T, D>> getBVH() const { return BVH; }
+
+  // Only allocate the cells within the given distance (in each direction) of
+  // the surface. The cells are allocated in tiles of 8^D cells when the
+  // surface first comes this close to a tile, in fromLevelSets and
+  // updateSurface, and are kept afterwards. The memory therefore scales with
+  // the region swept by the band instead of the full volume between the depth
+  // plane and the surface. Cells further away do not exist, so volume
+  // particles leaving the band are terminated. The thickness should cover the
+  // range of the volume particles. Zero allocates all cells (default). Has to
+  // be set before fromLevelSets.
+  void setSparseBandThickness(const T passedThickness) {
+    sparseBandThickness = std::max(passedThickness, T(0));
+  }
+
+  bool isSparse() const { return sparseBandThickness > 0.; }
+
+  // Number of allocated tiles of 8^D cells in sparse mode
+  size_t getNumberOfTiles() const { return tiles.size(); }
+
+  // Memory used by the cells, their data and the cell lookup in bytes
+  size_t getMemorySize() const {
+    // approximate size of a hash map node: key, value and next pointer
+    const size_t tileIndexSize =
+        sizeof(std::uint64_t) + sizeof(unsigned) + sizeof(void *);
+    size_t size =
+        cellGrid->getNodes().capacity() * sizeof(std::array<T, 3>) +
+        cellGrid->template getElements<(1 << D)>().capacity() *
+            sizeof(std::array<unsigned, (1 << D)>) +
+        cellNeighbors.capacity() * sizeof(std::array<int, 2 * D>) +
+        cellIndexMap.capacity() * sizeof(int) +
+        tiles.capacity() * sizeof(std::array<int, tileSize>) +
+        tileIndices.size() * tileIndexSize;
+    if (BVH)
+      size += BVH->getMemorySize();
+    auto &cellData = cellGrid->getCellData();
+    for (unsigned i = 0; i < cellData.getScalarDataSize(); ++i)
+      size += cellData.getScalarData(i)->capacity() * sizeof(T);
+    return size;
+  }
+
+  // Add cells at the given integer coordinates. Cells which already exist or
+  // which are outside of the grid or the level sets are skipped. The existing
+  // cells keep their index and data, the new cells get the initial value of
+  // each scalar data. For a cell set below the surface, the depth plane is
+  // moved down to the lowest new cell.
+  void addCells(std::vector<std::array<int, D>> cells) {
+    if (cells.empty())
+      return;
+
+    if (!cellSetAboveSurface) {
+      int lowest = std::numeric_limits<int>::max();
+      for (const auto &coordinates : cells)
+        lowest = std::min(lowest, coordinates[D - 1]);
+      if (lowest * gridDelta < depth) {
+        depth = lowest * gridDelta;
+        calculateMinMaxIndex(getLevelSetsInOrder());
+        cellGrid->minimumExtent[D - 1] = minIndex[D - 1] * gridDelta;
+      }
+    }
+
+    std::sort(cells.begin(), cells.end(),
+              [](const std::array<int, D> &a, const std::array<int, D> &b) {
+                return getKey(a) < getKey(b);
+              });
+    cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+    cells.erase(std::remove_if(cells.begin(), cells.end(),
+                               [this](const std::array<int, D> &coordinates) {
+                                 for (int i = 0; i < D; ++i) {
+                                   if (coordinates[i] < minIndex[i] ||
+                                       coordinates[i] + 1 > maxIndex[i])
+                                     return true;
+                                 }
+                                 return getIndex(coordinates) >= 0;
+                               }),
+                cells.end());
+
+    appendCells(cells, findMaterials(getLevelSetsInOrder(), cells));
+    if (!isSparse())
+      buildCellLookup();
+  }
 
   std::vector<T> *getScalarData(std::string name) {
     return cellGrid->getCellData().getScalarData(name);
@@ -244,21 +425,41 @@ public:
     psVTKWriter<T>(cellGrid, fileName).apply();
   }
 
-  // Save cell set data in simple text format
-  void writeCellSetData(std::string fileName) const {
-    auto numScalarData = cellGrid->getCellData().getScalarDataSize();
+  // Save the cell set data. The binary format (see csCellDataFile) stores the
+  // raw data arrays and can be read without parsing. The text format writes
+  // one comma separated row per cell and is meant for debugging.
+  void writeCellSetData(std::string fileName, const bool binary = true) const {
+    auto &cellData = cellGrid->getCellData();
+    auto numScalarData = cellData.getScalarDataSize();
+
+    if (binary) {
+      std::vector<std::string> labels;
+      std::vector<const std::vector<T> *> arrays;
+      for (unsigned i = 0; i < numScalarData; i++) {
+        labels.push_back(cellData.getScalarDataLabel(i));
+        arrays.push_back(cellData.getScalarData(i));
+      }
+      csTriple<double> minimumExtent, maximumExtent;
+      for (int i = 0; i < 3; i++) {
+        minimumExtent[i] = cellGrid->minimumExtent[i];
+        maximumExtent[i] = cellGrid->maximumExtent[i];
+      }
+      csCellDataFile<T>::write(fileName, numberOfCells, gridDelta,
+                               minimumExtent, maximumExtent, labels, arrays);
+      return;
+    }
 
     std::ofstream file(fileName);
     file << numberOfCells << "\n";
     for (int i = 0; i < numScalarData; i++) {
-      auto label = cellGrid->getCellData().getScalarDataLabel(i);
+      auto label = cellData.getScalarDataLabel(i);
       file << label << ",";
     }
     file << "\n";
 
     for (size_t j = 0; j < numberOfCells; j++) {
       for (int i = 0; i < numScalarData; i++) {
-        file << cellGrid->getCellData().getScalarData(i)->at(j) << ",";
+        file << cellData.getScalarData(i)->at(j) << ",";
       }
       file << "\n";
     }
@@ -266,8 +467,14 @@ public:
     file.close();
   }
 
-  // Read cell set data from text
+  // Read cell set data written with writeCellSetData. The format is detected
+  // from the file.
   void readCellSetData(std::string fileName) {
+    if (csCellDataFile<T>::isBinary(fileName)) {
+      readBinaryCellSetData(fileName);
+      return;
+    }
+
     std::ifstream file(fileName);
     std::string line;
 
@@ -331,94 +538,64 @@ public:
   // the level sets, the cell set is made out of, have changed. This does not
   // work if the surface of the volume has changed. In this case, call the
   // funciton update surface first.
-  void updateMaterials() {
-    auto materialIds = getScalarData("Material");
-
-    // create overlay material
-    std::vector<psSmartPointer<lsDomain<T, D>>> levelSetsInOrder;
-    auto plane = psSmartPointer<lsDomain<T, D>>::New(surface->getGrid());
-    {
-      T origin[D] = {0.};
-      T normal[D] = {0.};
-      origin[D - 1] = depth;
-      normal[D - 1] = 1.;
-      lsMakeGeometry<T, D>(plane,
-                           psSmartPointer<lsPlane<T, D>>::New(origin, normal))
-          .apply();
+  // If onlyNarrowBand is set, only the cells touching the narrow band of one
+  // of the level sets, now or at the previous update, are recomputed. This is
+  // only correct if no interface moved by more than one grid cell since the
+  // previous update, e.g. after a single advection step.
+  void updateMaterials(const bool onlyNarrowBand = false) {
+    const auto levelSetsInOrder = getLevelSetsInOrder();
+
+    auto bandCells = findNarrowBandCells(levelSetsInOrder);
+    if (onlyNarrowBand && materialBandValid) {
+      // cells which left the narrow band since the previous update
+      std::vector<unsigned> cells;
+      cells.reserve(bandCells.size() + materialBandCells.size());
+      std::set_union(bandCells.begin(), bandCells.end(),
+                     materialBandCells.begin(), materialBandCells.end(),
+                     std::back_inserter(cells));
+      if (!cellsInGridOrder)
+        sortByPosition(cells);
+      computeMaterials(levelSetsInOrder, cells.size(),
+                       [&cells](size_t i) { return cells[i]; });
+    } else if (!cellsInGridOrder) {
+      std::vector<unsigned> cells(numberOfCells);
+      std::iota(cells.begin(), cells.end(), 0);
+      sortByPosition(cells);
+      computeMaterials(levelSetsInOrder, cells.size(),
+                       [&cells](size_t i) { return cells[i]; });
+    } else {
+      computeMaterials(levelSetsInOrder, numberOfCells,
+                       [](size_t i) { return i; });
     }
-    if (!cellSetAboveSurface)
-      levelSetsInOrder.push_back(plane);
-    for (auto ls : *levelSets)
-      levelSetsInOrder.push_back(ls);
-    if (cellSetAboveSurface)
-      levelSetsInOrder.push_back(plane);
-
-    // set up iterators for all materials
-    std::vector<hrleConstDenseCellIterator<typename lsDomain<T, D>::DomainType>>
-        iterators;
-    for (auto it = levelSetsInOrder.begin(); it != levelSetsInOrder.end();
-         ++it) {
-      iterators.push_back(
-          hrleConstDenseCellIterator<typename lsDomain<T, D>::DomainType>(
-              (*it)->getDomain(), minIndex));
-    }
-
-    // move iterator for lowest material id and then adjust others if they are
-    // needed
-    const materialMapType matMapPtr = materialMap;
-    unsigned cellIdx = 0;
-    for (; iterators.front().getIndices() < maxIndex;
-         iterators.front().next()) {
-      // go over all materials
-      for (unsigned materialId = 0; materialId < levelSetsInOrder.size();
-           ++materialId) {
-
-        auto &cellIt = iterators[materialId];
-        cellIt.goToIndicesSequential(iterators.front().getIndices());
-
-        // find out whether the centre of the box is inside
-        T centerValue = 0.;
-        for (int i = 0; i < (1 << D); ++i) {
-          centerValue += cellIt.getCorner(i).getValue();
-        }
-
-        if (centerValue <= 0.) {
-          bool isVoxel;
-          // check if voxel is in bounds
-          for (unsigned i = 0; i < (1 << D); ++i) {
-            hrleVectorType<hrleIndexType, D> index;
-            isVoxel = true;
-            for (unsigned j = 0; j < D; ++j) {
-              index[j] =
-                  cellIt.getIndices(j) + cellIt.getCorner(i).getOffset()[j];
-              if (index[j] > maxIndex[j]) {
-                isVoxel = false;
-                break;
-              }
-            }
-          }
-
-          if (isVoxel) {
-            if (matMapPtr) {
-              auto material = matMapPtr->getMaterialAtIdx(materialId);
-              materialIds->at(cellIdx++) = static_cast<int>(material);
-            } else {
-              materialIds->at(cellIdx++) = materialId;
-            }
-          }
-
-          // jump out of material for loop
-          break;
-        }
-      }
-    }
-    assert(cellIdx == numberOfCells &&
-           "Cell set changed in `updateMaterials()'");
+    materialBandCells = std::move(bandCells);
+    materialBandValid = true;
   }
 
   // Updates the surface of the cell set. The new surface should be below the
   // old surface as this function can only remove cells from the cell set.
+  // In sparse mode, the tiles which the band around the new surface reaches
+  // for the first time are allocated.
   void updateSurface() {
+    if (isSparse()) {
+      // cells whose centre is no longer inside the top level set
+      std::vector<bool> removedCells(numberOfCells, false);
+      if (!cellSetAboveSurface) {
+        std::vector<unsigned> cells(numberOfCells);
+        std::iota(cells.begin(), cells.end(), 0);
+        sortByPosition(cells);
+        std::vector<std::array<int, D>> coordinates(numberOfCells);
+        for (size_t i = 0; i < numberOfCells; ++i)
+          coordinates[i] = getCellCoordinates(cells[i]);
+        const auto materials = findMaterials({levelSets->back()}, coordinates);
+        for (size_t i = 0; i < numberOfCells; ++i)
+          removedCells[cells[i]] = materials[i] < 0;
+      }
+      surface->deepCopy(levelSets->back());
+      removeCells(removedCells);
+      allocateBandTiles(getLevelSetsInOrder());
+      return;
+    }
+
     auto updateCellGrid = psSmartPointer<lsMesh<T>>::New();
 
     lsToVoxelMesh<T, D> voxelConverter(updateCellGrid);
@@ -439,28 +616,92 @@ public:
     voxelConverter.apply();
 
     auto cutMatIds = updateCellGrid->getCellData().getScalarData("Material");
-    auto &hexas = cellGrid->template getElements<(1 << D)>();
+    const auto &cutElems = updateCellGrid->template getElements<(1 << D)>();
+    const auto &cutNodes = updateCellGrid->getNodes();
+
+    // the cells are matched by their coordinates, since cells of the cut grid
+    // may already have been removed from the cell set
+    std::vector<bool> removedCells(numberOfCells, false);
+    for (size_t elIdx = 0; elIdx < cutElems.size(); elIdx++) {
+      if (cutMatIds->at(elIdx) != 2)
+        continue;
+      std::array<int, D> coordinates;
+      for (int i = 0; i < D; ++i)
+        coordinates[i] = static_cast<int>(
+            std::round(cutNodes[cutElems[elIdx][0]][i] / gridDelta));
+      const int cellIdx = getIndex(coordinates);
+      if (cellIdx >= 0)
+        removedCells[cellIdx] = true;
+    }
+    surface->deepCopy(levelSets->back());
 
-    const auto nCutCells =
-        updateCellGrid->template getElements<(1 << D)>().size();
+    removeCells(removedCells);
+  }
 
-    auto numScalarData = cellGrid->getCellData().getScalarDataSize();
+  // Removes all cells for which the flag is set. The remaining cells keep
+  // their order. The cell lookup and the neighborhood are updated from the
+  // mapping of the old to the new cell indices instead of being rebuilt.
+  void removeCells(const std::vector<bool> &removedCells) {
+    // new index of each cell or -1 if it is removed
+    std::vector<int> newIndex(numberOfCells, -1);
+    int numberOfKeptCells = 0;
+    for (size_t cellIdx = 0; cellIdx < numberOfCells; cellIdx++) {
+      if (cellIdx >= removedCells.size() || !removedCells[cellIdx])
+        newIndex[cellIdx] = numberOfKeptCells++;
+    }
+    if (static_cast<size_t>(numberOfKeptCells) == numberOfCells)
+      return;
 
-    for (int elIdx = nCutCells - 1; elIdx >= 0; elIdx--) {
-      if (cutMatIds->at(elIdx) == 2) {
-        for (int i = 0; i < numScalarData; i++) {
-          auto data = cellGrid->getCellData().getScalarData(i);
-          data->erase(data->begin() + elIdx);
+    // the index map is patched before the cells are moved, since the map
+    // positions are calculated from the cell coordinates
+    if (!cellIndexMap.empty()) {
+#pragma omp parallel for
+      for (long cellIdx = 0; cellIdx < static_cast<long>(numberOfCells);
+           ++cellIdx) {
+        cellIndexMap[getIndexMapPosition(getCellCoordinates(cellIdx))] =
+            newIndex[cellIdx];
+      }
+    } else if (isSparse()) {
+#pragma omp parallel for
+      for (long cellIdx = 0; cellIdx < static_cast<long>(numberOfCells);
+           ++cellIdx) {
+        const auto coordinates = getCellCoordinates(cellIdx);
+        tiles[tileIndices.at(getTileKey(coordinates))]
+             [getPositionInTile(coordinates)] = newIndex[cellIdx];
+      }
+    }
+
+    // stable compaction of all cell arrays in a single pass
+    auto &hexas = cellGrid->template getElements<(1 << D)>();
+    compactCellData(hexas, newIndex);
+    auto &cellData = cellGrid->getCellData();
+    for (unsigned i = 0; i < cellData.getScalarDataSize(); i++) {
+      compactCellData(*cellData.getScalarData(i), newIndex);
+    }
+
+    if (!cellNeighbors.empty()) {
+      compactCellData(cellNeighbors, newIndex);
+#pragma omp parallel for
+      for (long cellIdx = 0; cellIdx < numberOfKeptCells; ++cellIdx) {
+        for (auto &neighbor : cellNeighbors[cellIdx]) {
+          if (neighbor >= 0)
+            neighbor = newIndex[neighbor];
         }
-        hexas.erase(hexas.begin() + elIdx);
       }
     }
-    numberOfCells = hexas.size();
-    surface->deepCopy(levelSets->back());
 
-    buildBVH();
-  }
+    if (BVH)
+      BVH->remapCellIds(newIndex);
+
+    size_t numberOfBandCells = 0;
+    for (const auto cellIdx : materialBandCells) {
+      if (newIndex[cellIdx] >= 0)
+        materialBandCells[numberOfBandCells++] = newIndex[cellIdx];
+    }
+    materialBandCells.resize(numberOfBandCells);
 
+    numberOfCells = numberOfKeptCells;
+  }
   // Merge a trace path to the cell set.
   void mergePath(csTracePath<T> &path, T factor = 1.) {
     auto ff = getFillingFractions();
@@ -478,78 +719,574 @@ public:
     }
   }
 
+  // Find the face neighbors of all cells. The neighbors are looked up in the
+  // dense index map from the integer cell coordinates. If the neighborhood
+  // was built, it is kept up to date when cells are removed.
   void buildNeighborhood() {
-    const auto &cells = cellGrid->template getElements<(1 << D)>();
+    if (cellIndexMap.empty())
+      buildIndexMap();
+    cellNeighbors.resize(numberOfCells);
+
+#pragma omp parallel for
+    for (long cellIdx = 0; cellIdx < static_cast<long>(numberOfCells);
+         ++cellIdx) {
+      auto coordinates = getCellCoordinates(cellIdx);
+      for (int i = 0; i < D; ++i) {
+        --coordinates[i];
+        cellNeighbors[cellIdx][i * 2] = getIndex(coordinates);
+        coordinates[i] += 2;
+        cellNeighbors[cellIdx][i * 2 + 1] = getIndex(coordinates);
+        --coordinates[i];
+      }
+    }
+  }
+
+  const std::array<int, 2 * D> &getNeighbors(unsigned long cellIdx) const {
+    assert(cellIdx < numberOfCells && "Cell idx out of bounds");
+    return cellNeighbors[cellIdx];
+  }
+
+  bool hasNeighborhood() const {
+    return cellNeighbors.size() == numberOfCells && numberOfCells > 0;
+  }
+
+  // Rebuild the structure used to locate cells. This has to be called if
+  // cells were added or removed.
+  void buildCellLookup() {
+    if (useBVH) {
+      BVH = psSmartPointer<csBVH<T, D>>::New(getBoundingBox(), BVHlayers);
+      buildBVH();
+      // the index map is still needed for the neighborhood
+      if (cellNeighbors.empty())
+        std::vector<int>().swap(cellIndexMap);
+      else
+        buildIndexMap();
+    } else {
+      BVH = nullptr;
+      buildIndexMap();
+    }
+    if (!cellNeighbors.empty())
+      buildNeighborhood();
+  }
+
+private:
+  int findIndex(const csTriple<T> &point) const {
+    if (!useBVH)
+      return findIndexInMap(point);
+
+    const auto &elems = cellGrid->template getElements<(1 << D)>();
     const auto &nodes = cellGrid->getNodes();
-    unsigned const numNodes = nodes.size();
-    unsigned const numCells = cells.size();
-    cellNeighbors.resize(numCells);
+    int idx = -1;
+
+    for (const auto cellId : BVH->getCellIds(point)) {
+      if (isInsideVoxel(point, nodes[elems[cellId][0]])) {
+        idx = cellId;
+        break;
+      }
+    }
+    return idx;
+  }
+
+  int findIndexInMap(const csTriple<T> &point) const {
+    std::array<int, D> coordinates;
+    for (int i = 0; i < D; ++i)
+      coordinates[i] = static_cast<int>(std::floor(point[i] / gridDelta));
+    int idx = getIndex(coordinates);
+    if (idx >= 0)
+      return idx;
+
+    // Points on the lower face of a cell also belong to the cell below. On an
+    // edge or corner, the cells across each face are tried separately before
+    // the diagonal ones.
+    std::array<int, D> faceAxes;
+    int numFaces = 0;
+    for (int i = 0; i < D; ++i) {
+      if (point[i] - coordinates[i] * gridDelta <= gridDelta * 1e-6)
+        faceAxes[numFaces++] = i;
+    }
+    for (int size = 1; size <= numFaces; ++size) {
+      for (unsigned subset = 1; subset < (1u << numFaces); ++subset) {
+        auto neighbor = coordinates;
+        int subsetSize = 0;
+        for (int j = 0; j < numFaces; ++j) {
+          if (subset & (1u << j)) {
+            --neighbor[faceAxes[j]];
+            ++subsetSize;
+          }
+        }
+        if (subsetSize != size)
+          continue;
+        idx = getIndex(neighbor);
+        if (idx >= 0)
+          return idx;
+      }
+    }
+    return -1;
+  }
 
-    std::vector<std::vector<unsigned>> nodeCellConnections(numNodes);
+  long getIndexMapPosition(const std::array<int, D> &cellCoordinates) const {
+    long linearIdx = 0;
+    for (int i = D - 1; i >= 0; --i) {
+      const int c = cellCoordinates[i] - indexMapMin[i];
+      if (c < 0 || c >= indexMapExtent[i])
+        return -1;
+      linearIdx = linearIdx * indexMapExtent[i] + c;
+    }
+    return linearIdx;
+  }
 
-    // for each node, store which cells are connected with the node
-    for (unsigned cellIdx = 0; cellIdx < numCells; cellIdx++) {
-      for (unsigned cellNodeIdx = 0; cellNodeIdx < (1 << D); cellNodeIdx++) {
-        nodeCellConnections[cells[cellIdx][cellNodeIdx]].push_back(cellIdx);
+  void buildIndexMap() {
+    // the tiles are updated whenever cells are added or removed
+    if (isSparse())
+      return;
+
+    std::array<int, D> indexMapMax;
+    for (int i = 0; i < D; ++i) {
+      indexMapMin[i] = std::numeric_limits<int>::max();
+      indexMapMax[i] = std::numeric_limits<int>::lowest();
+    }
+    for (size_t cellIdx = 0; cellIdx < numberOfCells; ++cellIdx) {
+      const auto coordinates = getCellCoordinates(cellIdx);
+      for (int i = 0; i < D; ++i) {
+        indexMapMin[i] = std::min(indexMapMin[i], coordinates[i]);
+        indexMapMax[i] = std::max(indexMapMax[i], coordinates[i]);
       }
     }
 
+    size_t mapSize = numberOfCells > 0 ? 1 : 0;
+    for (int i = 0; i < D; ++i) {
+      indexMapExtent[i] =
+          numberOfCells > 0 ? indexMapMax[i] - indexMapMin[i] + 1 : 0;
+      mapSize *= indexMapExtent[i];
+    }
+    cellIndexMap.assign(mapSize, -1);
+
 #pragma omp parallel for
-    for (unsigned cellIdx = 0; cellIdx < numCells; cellIdx++) {
-      auto coord = nodes[cells[cellIdx][0]];
-      for (int i = 0; i < D; i++) {
-        coord[i] += gridDelta / 2.;
-        cellNeighbors[cellIdx][i] = -1;
-        cellNeighbors[cellIdx][i + D] = -1;
+    for (long cellIdx = 0; cellIdx < static_cast<long>(numberOfCells);
+         ++cellIdx) {
+      cellIndexMap[getIndexMapPosition(getCellCoordinates(cellIdx))] =
+          cellIdx;
+    }
+  }
+
+  // Allocate the tiles within the band thickness of the defined points of the
+  // surface which are not allocated yet and add their cells.
+  void allocateBandTiles(
+      const std::vector<psSmartPointer<lsDomain<T, D>>> &levelSetsInOrder) {
+    const int bandWidth =
+        static_cast<int>(std::ceil(sparseBandThickness / gridDelta));
+
+    // all cells of the new tiles, which are inside the grid
+    std::unordered_set<std::uint64_t> newTiles;
+    std::vector<std::array<int, D>> candidates;
+    for (hrleConstSparseIterator<typename lsDomain<T, D>::DomainType> it(
+             levelSets->back()->getDomain());
+         !it.isFinished(); it.next()) {
+      if (!it.isDefined())
+        continue;
+
+      std::array<int, D> firstTile, lastTile;
+      bool outside = false;
+      for (int i = 0; i < D; ++i) {
+        const int first =
+            std::max<int>(it.getStartIndices(i) - bandWidth, minIndex[i]);
+        const int last =
+            std::min<int>(it.getStartIndices(i) + bandWidth, maxIndex[i] - 1);
+        outside |= first > last;
+        firstTile[i] = first >> tileBits; // rounds down
+        lastTile[i] = last >> tileBits;
+      }
+      if (outside)
+        continue;
+
+      auto tile = firstTile;
+      while (true) {
+        const auto key = getKey(tile);
+        if (tileIndices.find(key) == tileIndices.end() &&
+            newTiles.insert(key).second)
+          addTileCells(tile, candidates);
+
+        int i = 0;
+        for (; i < D; ++i) {
+          if (++tile[i] <= lastTile[i])
+            break;
+          tile[i] = firstTile[i];
+        }
+        if (i == D)
+          break;
+      }
+    }
+
+    std::sort(candidates.begin(), candidates.end(),
+              [](const std::array<int, D> &a, const std::array<int, D> &b) {
+                return getKey(a) < getKey(b);
+              });
+    const auto materials = findMaterials(levelSetsInOrder, candidates);
+    appendCells(candidates, materials);
+    buildCellLookup();
+  }
+
+  // Cells of a tile which lie inside the grid
+  void addTileCells(const std::array<int, D> &tile,
+                    std::vector<std::array<int, D>> &cells) const {
+    for (int position = 0; position < tileSize; ++position) {
+      std::array<int, D> coordinates;
+      bool inside = true;
+      for (int i = 0; i < D; ++i) {
+        coordinates[i] = (tile[i] << tileBits) +
+                         ((position >> (i * tileBits)) & (tileWidth - 1));
+        inside &= coordinates[i] >= minIndex[i] &&
+                  coordinates[i] + 1 <= maxIndex[i];
       }
+      if (inside)
+        cells.push_back(coordinates);
+    }
+  }
 
-      for (unsigned cellNodeIdx = 0; cellNodeIdx < (1 << D); cellNodeIdx++) {
-        auto &cellsAtNode = nodeCellConnections[cells[cellIdx][cellNodeIdx]];
+  // Add the cells with a material (index of the level set, -1 for none) to
+  // the cell grid, the cell data and, in sparse mode, the tiles. Nodes shared
+  // with other cells are reused. In dense mode, the cell lookup has to be
+  // rebuilt afterwards.
+  void appendCells(const std::vector<std::array<int, D>> &cells,
+                   const std::vector<int> &materials) {
+    const size_t numberOfNewCells =
+        std::count_if(materials.begin(), materials.end(),
+                      [](const int material) { return material >= 0; });
+    auto &elements = cellGrid->template getElements<(1 << D)>();
+    auto &nodes = cellGrid->getNodes();
+    auto &cellData = cellGrid->getCellData();
+    elements.reserve(numberOfCells + numberOfNewCells);
+
+    std::vector<std::vector<T> *> data;
+    std::vector<T> values;
+    for (unsigned i = 0; i < cellData.getScalarDataSize(); ++i) {
+      data.push_back(cellData.getScalarData(i));
+      data.back()->reserve(numberOfCells + numberOfNewCells);
+      auto it = initialValues.find(cellData.getScalarDataLabel(i));
+      values.push_back(it == initialValues.end() ? T(0) : it->second);
+    }
+    const auto materialIds = getScalarData("Material");
+    // nodes created in this call, the new cells are not in the dense lookup
+    std::unordered_map<std::uint64_t, unsigned> newNodes;
+
+    for (size_t c = 0; c < cells.size(); ++c) {
+      if (materials[c] < 0)
+        continue;
+
+      std::array<unsigned, (1 << D)> element;
+      for (int position = 0; position < (1 << D); ++position) {
+        std::array<int, D> node = cells[c];
+        const int corner = getElementCorner(position);
+        for (int i = 0; i < D; ++i)
+          node[i] += (corner >> i) & 1;
+        element[position] = findOrInsertNode(node, elements, nodes, newNodes);
+      }
+      elements.push_back(element);
 
-        for (const auto &neighborCell : cellsAtNode) {
-          if (neighborCell != cellIdx) {
+      for (size_t i = 0; i < data.size(); ++i)
+        data[i]->push_back(values[i]);
+      materialIds->back() = getMaterialId(materials[c]);
 
-            auto neighborCoord = nodes[cells[neighborCell][0]];
-            for (int i = 0; i < D; i++)
-              neighborCoord[i] += gridDelta / 2.;
+      if (!isSparse()) {
+        ++numberOfCells;
+        continue;
+      }
+      auto inserted =
+          tileIndices.insert({getTileKey(cells[c]), unsigned(tiles.size())});
+      if (inserted.second) {
+        tiles.emplace_back();
+        tiles.back().fill(-1);
+      }
+      tiles[inserted.first->second][getPositionInTile(cells[c])] =
+          numberOfCells++;
+    }
+    nodes.shrink_to_fit();
+    materialBandValid = false;
+    cellsInGridOrder &= numberOfNewCells == 0;
+  }
 
-            if (csUtil::distance(coord, neighborCoord) < gridDelta + eps) {
+  // Index of the node at the given integer coordinates, taken from one of the
+  // existing cells which have it as a corner, or a new node
+  unsigned findOrInsertNode(
+      const std::array<int, D> &node,
+      const std::vector<std::array<unsigned, (1 << D)>> &elements,
+      std::vector<std::array<T, 3>> &nodes,
+      std::unordered_map<std::uint64_t, unsigned> &newNodes) const {
+    const auto newNode = newNodes.find(getKey(node));
+    if (newNode != newNodes.end())
+      return newNode->second;
+
+    for (int corner = 0; corner < (1 << D); ++corner) {
+      std::array<int, D> coordinates = node;
+      for (int i = 0; i < D; ++i)
+        coordinates[i] -= (corner >> i) & 1;
+      const int cellIdx = getIndex(coordinates);
+      if (cellIdx < 0)
+        continue;
+      for (int position = 0; position < (1 << D); ++position) {
+        if (getElementCorner(position) == corner)
+          return elements[cellIdx][position];
+      }
+    }
 
-              for (int i = 0; i < D; i++) {
-                if (coord[i] - neighborCoord[i] > gridDelta / 2.) {
-                  cellNeighbors[cellIdx][i * 2] = neighborCell;
-                } else if (coord[i] - neighborCoord[i] < -gridDelta / 2.) {
-                  cellNeighbors[cellIdx][i * 2 + 1] = neighborCell;
-                }
-              }
-            }
+    std::array<T, 3> position = {0., 0., 0.};
+    for (int i = 0; i < D; ++i)
+      position[i] = node[i] * gridDelta;
+    nodes.push_back(position);
+    newNodes.emplace(getKey(node), nodes.size() - 1);
+    return nodes.size() - 1;
+  }
+
+  // Corner of the cell (bit i set for the upper side in direction i) at each
+  // position of the element, in the same order as lsToVoxelMesh
+  static int getElementCorner(const int position) {
+    if constexpr (D == 3) {
+      constexpr int corners[8] = {0, 1, 3, 2, 4, 5, 7, 6};
+      return corners[position];
+    } else {
+      constexpr int corners[4] = {0, 2, 3, 1};
+      return corners[position];
+    }
+  }
+
+  // Material ID of a cell inside the given level set, as assigned by
+  // adjustMaterialIds
+  T getMaterialId(int levelSetIdx) const {
+    if (!materialMap)
+      return levelSetIdx;
+    if (!cellSetAboveSurface && levelSetIdx > 0)
+      levelSetIdx -= 1;
+    return static_cast<int>(materialMap->getMaterialAtIdx(levelSetIdx));
+  }
+
+  // Index of the first level set which contains the centre of each cell, -1
+  // if there is none. The cells have to be sorted by position (see getKey),
+  // each thread handles a contiguous range of them with its own iterators.
+  std::vector<int> findMaterials(
+      const std::vector<psSmartPointer<lsDomain<T, D>>> &levelSetsInOrder,
+      const std::vector<std::array<int, D>> &cells) const {
+    using iteratorType =
+        hrleConstDenseCellIterator<typename lsDomain<T, D>::DomainType>;
+    std::vector<int> materials(cells.size(), -1);
+
+#pragma omp parallel
+    {
+      const size_t numThreads = omp_get_num_threads();
+      const size_t threadID = omp_get_thread_num();
+      const size_t begin = cells.size() * threadID / numThreads;
+      const size_t end = cells.size() * (threadID + 1) / numThreads;
+
+      std::vector<iteratorType> iterators;
+      hrleVectorType<hrleIndexType, D> indices;
+      for (size_t c = begin; c < end; ++c) {
+        for (int i = 0; i < D; ++i)
+          indices[i] = cells[c][i];
+
+        if (iterators.empty()) {
+          iterators.reserve(levelSetsInOrder.size());
+          for (const auto &ls : levelSetsInOrder)
+            iterators.emplace_back(ls->getDomain(), indices);
+        }
+
+        for (unsigned materialId = 0; materialId < levelSetsInOrder.size();
+             ++materialId) {
+          auto &cellIt = iterators[materialId];
+          cellIt.goToIndicesSequential(indices);
+
+          T centerValue = 0.;
+          for (int corner = 0; corner < (1 << D); ++corner)
+            centerValue += cellIt.getCorner(corner).getValue();
+          if (centerValue <= 0.) {
+            materials[c] = materialId;
+            break;
           }
         }
       }
     }
+    return materials;
   }
 
-  const std::array<int, 2 * D> &getNeighbors(unsigned long cellIdx) {
-    assert(cellIdx < numberOfCells && "Cell idx out of bounds");
-    return cellNeighbors[cellIdx];
+  // Sort cell indices by the position of the cells in the grid
+  void sortByPosition(std::vector<unsigned> &cells) const {
+    std::vector<std::pair<std::uint64_t, unsigned>> keys(cells.size());
+#pragma omp parallel for
+    for (long i = 0; i < static_cast<long>(cells.size()); ++i)
+      keys[i] = {getKey(getCellCoordinates(cells[i])), cells[i]};
+    std::sort(keys.begin(), keys.end());
+    for (size_t i = 0; i < cells.size(); ++i)
+      cells[i] = keys[i].second;
   }
 
-private:
-  int findIndex(const csTriple<T> &point) {
-    const auto &elems = cellGrid->template getElements<(1 << D)>();
-    const auto &nodes = cellGrid->getNodes();
-    int idx = -1;
+  // 21 bits per coordinate, offset to be positive. The keys are ordered like
+  // the grid iterators, with the last direction varying slowest.
+  static std::uint64_t getKey(const std::array<int, D> &coordinates) {
+    std::uint64_t key = 0;
+    for (int i = D - 1; i >= 0; --i)
+      key = (key << 21) | ((coordinates[i] + (1 << 20)) & 0x1fffff);
+    return key;
+  }
 
-    auto cellIds = BVH->getCellIds(point);
-    if (!cellIds)
-      return idx;
-    for (const auto cellId : *cellIds) {
-      if (isInsideVoxel(point, nodes[elems[cellId][0]])) {
-        idx = cellId;
-        break;
+  static std::uint64_t getTileKey(const std::array<int, D> &coordinates) {
+    std::array<int, D> tile;
+    for (int i = 0; i < D; ++i)
+      tile[i] = coordinates[i] >> tileBits; // rounds down
+    return getKey(tile);
+  }
+
+  static int getPositionInTile(const std::array<int, D> &coordinates) {
+    int position = 0;
+    for (int i = D - 1; i >= 0; --i)
+      position = (position << tileBits) | (coordinates[i] & (tileWidth - 1));
+    return position;
+  }
+
+  // Moves the entries of all kept cells to their new index.
+  template <class DataType>
+  static void compactCellData(std::vector<DataType> &data,
+                              const std::vector<int> &newIndex) {
+    const auto size = std::min(data.size(), newIndex.size());
+    size_t numberOfKept = 0;
+    for (size_t i = 0; i < size; ++i) {
+      if (newIndex[i] >= 0)
+        data[newIndex[i]] = std::move(data[i]);
+      numberOfKept += newIndex[i] >= 0;
+    }
+    data.resize(numberOfKept);
+  }
+
+  std::vector<psSmartPointer<lsDomain<T, D>>> getLevelSetsInOrder() const {
+    std::vector<psSmartPointer<lsDomain<T, D>>> levelSetsInOrder;
+    auto plane = psSmartPointer<lsDomain<T, D>>::New(surface->getGrid());
+    {
+      T origin[D] = {0.};
+      T normal[D] = {0.};
+      origin[D - 1] = depth;
+      normal[D - 1] = 1.;
+      lsMakeGeometry<T, D>(plane,
+                           psSmartPointer<lsPlane<T, D>>::New(origin, normal))
+          .apply();
+    }
+    if (!cellSetAboveSurface)
+      levelSetsInOrder.push_back(plane);
+    for (auto ls : *levelSets)
+      levelSetsInOrder.push_back(ls);
+    if (cellSetAboveSurface)
+      levelSetsInOrder.push_back(plane);
+    return levelSetsInOrder;
+  }
+
+  // Sorted indices of all cells with a corner on a defined point of one of
+  // the level sets. The plane bounding the cell set does not move and is
+  // skipped.
+  std::vector<unsigned> findNarrowBandCells(
+      const std::vector<psSmartPointer<lsDomain<T, D>>> &levelSetsInOrder) {
+    std::vector<char> inBand(numberOfCells, 0);
+    const size_t first = cellSetAboveSurface ? 0 : 1;
+    const size_t last = levelSetsInOrder.size() - (cellSetAboveSurface ? 1 : 0);
+    for (size_t l = first; l < last; ++l) {
+      for (hrleConstSparseIterator<typename lsDomain<T, D>::DomainType> it(
+               levelSetsInOrder[l]->getDomain());
+           !it.isFinished(); it.next()) {
+        if (!it.isDefined())
+          continue;
+        // all cells which have this point as a corner
+        for (unsigned corner = 0; corner < (1 << D); ++corner) {
+          std::array<int, D> coordinates;
+          for (int i = 0; i < D; ++i)
+            coordinates[i] = it.getStartIndices(i) - ((corner >> i) & 1);
+          const int cellIdx = getIndex(coordinates);
+          if (cellIdx >= 0)
+            inBand[cellIdx] = 1;
+        }
       }
     }
-    return idx;
+
+    std::vector<unsigned> bandCells;
+    for (unsigned cellIdx = 0; cellIdx < numberOfCells; ++cellIdx) {
+      if (inBand[cellIdx])
+        bandCells.push_back(cellIdx);
+    }
+    return bandCells;
+  }
+
+  // Compute the material IDs of the cells getCell(0), ..., getCell(count - 1)
+  // in parallel. The cells have to be sorted, each thread handles a
+  // contiguous range of them, i.e. a slab of the grid, with its own
+  // iterators, which only move forward.
+  template <class CellFunction>
+  void computeMaterials(
+      const std::vector<psSmartPointer<lsDomain<T, D>>> &levelSetsInOrder,
+      const size_t count, CellFunction getCell) {
+    using iteratorType =
+        hrleConstDenseCellIterator<typename lsDomain<T, D>::DomainType>;
+    auto materialIds = getScalarData("Material");
+    const materialMapType matMapPtr = materialMap;
+
+#pragma omp parallel
+    {
+      const size_t numThreads = omp_get_num_threads();
+      const size_t threadID = omp_get_thread_num();
+      const size_t begin = count * threadID / numThreads;
+      const size_t end = count * (threadID + 1) / numThreads;
+
+      std::vector<iteratorType> iterators;
+      hrleVectorType<hrleIndexType, D> indices;
+      for (size_t i = begin; i < end; ++i) {
+        const unsigned cellIdx = getCell(i);
+        const auto coordinates = getCellCoordinates(cellIdx);
+        for (int j = 0; j < D; ++j)
+          indices[j] = coordinates[j];
+
+        if (iterators.empty()) {
+          iterators.reserve(levelSetsInOrder.size());
+          for (const auto &ls : levelSetsInOrder)
+            iterators.emplace_back(ls->getDomain(), indices);
+        }
+
+        // the material is the first one which contains the cell centre
+        for (unsigned materialId = 0; materialId < levelSetsInOrder.size();
+             ++materialId) {
+          auto &cellIt = iterators[materialId];
+          cellIt.goToIndicesSequential(indices);
+
+          T centerValue = 0.;
+          for (int c = 0; c < (1 << D); ++c) {
+            centerValue += cellIt.getCorner(c).getValue();
+          }
+
+          if (centerValue <= 0.) {
+            if (matMapPtr) {
+              auto material = matMapPtr->getMaterialAtIdx(materialId);
+              materialIds->at(cellIdx) = static_cast<int>(material);
+            } else {
+              materialIds->at(cellIdx) = materialId;
+            }
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  void readBinaryCellSetData(const std::string &fileName) {
+    csCellDataFile<T> file;
+    if (!file.open(fileName))
+      return;
+
+    if (file.getNumberOfCells() != numberOfCells ||
+        std::abs(file.getGridDelta() - gridDelta) > eps * gridDelta) {
+      psLogger::getInstance().addWarning("Incompatible cell set data.").print();
+      return;
+    }
+
+    const auto &labels = file.getLabels();
+    for (unsigned i = 0; i < labels.size(); i++) {
+      auto dataP = getScalarData(labels[i]);
+      if (dataP == nullptr)
+        dataP = addScalarData(labels[i], 0.);
+      std::copy(file.getData(i), file.getData(i) + numberOfCells,
+                dataP->begin());
+    }
   }
 
   void adjustMaterialIds() {
@@ -591,7 +1328,8 @@ private:
     return idx;
   }
 
-  bool isInsideVoxel(const csTriple<T> &point, const csTriple<T> &cellMin) {
+  bool isInsideVoxel(const csTriple<T> &point,
+                     const csTriple<T> &cellMin) const {
     if constexpr (D == 3)
       return point[0] >= cellMin[0] && point[0] <= (cellMin[0] + gridDelta) &&
              point[1] >= cellMin[1] && point[1] <= (cellMin[1] + gridDelta) &&
@@ -604,17 +1342,8 @@ private:
   void buildBVH() {
     auto &elems = cellGrid->template getElements<(1 << D)>();
     auto &nodes = cellGrid->getNodes();
-    BVH->clearCellIds();
-
-    for (size_t elemIdx = 0; elemIdx < elems.size(); elemIdx++) {
-      for (size_t n = 0; n < (1 << D); n++) {
-        auto &node = nodes[elems[elemIdx][n]];
-        auto cell = BVH->getCellIds(node);
-        if (cell == nullptr) {
-          psLogger::getInstance().addError("BVH building error.").print();
-        }
-        cell->insert(elemIdx);
-      }
+    if (!BVH->buildCellIds(elems, nodes)) {
+      psLogger::getInstance().addError("BVH building error.").print();
     }
   }
 
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <omp.h>
+
+// Strategy used to accumulate the deposited flux of all threads in the cells
+// THREAD_GRID: one full-size grid per thread, reduced in parallel
+// SPARSE_TILES: per-thread tiles of cells, allocated on the first deposit
+// ATOMIC: atomic adds directly into the cell data, no additional memory
+// AUTO: THREAD_GRID if all thread grids fit into the memory limit,
+// SPARSE_TILES if at least the tile tables and one copy of all cells fit,
+// otherwise ATOMIC
+enum class csAccumulationType : unsigned {
+  AUTO = 0,
+  THREAD_GRID = 1,
+  SPARSE_TILES = 2,
+  ATOMIC = 3
+};
+
+/**
+  Accumulates values deposited by multiple threads in the cells of a cell set
+  and adds them, divided by a normalization factor, to the cell data. Each
+  thread deposits with its thread ID, the deposits are only visible in the
+  cell data after reduce() was called outside of the parallel region. The
+  reduction runs in parallel over cells (THREAD_GRID) or tiles
+  (SPARSE_TILES), so no thread has to wait for the others to merge.
+*/
+template <class T> class csFluxAccumulator {
+  static constexpr size_t tileSize = 1024;
+
+  csAccumulationType type = csAccumulationType::THREAD_GRID;
+  std::vector<T> *cellData = nullptr;
+  const T factor = 1.;
+  const size_t numberOfCells = 0;
+  const size_t numberOfTiles = 0;
+  const int numberOfThreads = 1;
+
+  std::vector<std::vector<T>> threadGrids;
+  std::vector<std::vector<std::unique_ptr<T[]>>> threadTiles;
+
+public:
+  // Default memory limit for the thread grids in AUTO mode (bytes)
+  static constexpr size_t defaultMemoryLimit = size_t(1) << 30;
+
+  csFluxAccumulator(std::vector<T> *passedCellData, const T passedFactor,
+                    const int passedNumberOfThreads,
+                    const csAccumulationType passedType =
+                        csAccumulationType::AUTO,
+                    const size_t memoryLimit = defaultMemoryLimit)
+      : cellData(passedCellData), factor(passedFactor),
+        numberOfCells(passedCellData->size()),
+        numberOfTiles((numberOfCells + tileSize - 1) / tileSize),
+        numberOfThreads(std::max(passedNumberOfThreads, 1)) {
+    type = passedType == csAccumulationType::AUTO
+               ? selectType(numberOfCells, numberOfThreads, memoryLimit)
+               : passedType;
+
+    if (type == csAccumulationType::THREAD_GRID) {
+      // the grids are allocated by the threads in init()
+      threadGrids.resize(numberOfThreads);
+    } else if (type == csAccumulationType::SPARSE_TILES) {
+      threadTiles.resize(numberOfThreads);
+      for (auto &tiles : threadTiles)
+        tiles.resize(numberOfTiles);
+    }
+  }
+
+  static csAccumulationType selectType(const size_t numberOfCells,
+                                       const int numberOfThreads,
+                                       const size_t memoryLimit) {
+    const size_t threads = static_cast<size_t>(numberOfThreads);
+    const size_t gridMemory = numberOfCells * threads * sizeof(T);
+    if (gridMemory <= memoryLimit)
+      return csAccumulationType::THREAD_GRID;
+
+    // the tiles need at least the tile tables of all threads and, if the
+    // threads deposit in different parts of the cell set, about one copy of
+    // all cells
+    const size_t numberOfTiles = (numberOfCells + tileSize - 1) / tileSize;
+    const size_t tileMemory =
+        numberOfTiles * threads * sizeof(std::unique_ptr<T[]>) +
+        numberOfTiles * tileSize * sizeof(T);
+    return tileMemory <= memoryLimit ? csAccumulationType::SPARSE_TILES
+                                     : csAccumulationType::ATOMIC;
+  }
+
+  csAccumulationType getType() const { return type; }
+
+  // Allocate the thread-local memory. Has to be called by each thread inside
+  // the parallel region, so that the memory is local to the thread.
+  void init(const int threadID) {
+    if (type == csAccumulationType::THREAD_GRID)
+      threadGrids[threadID].assign(numberOfCells, 0.);
+  }
+
+  void add(const int threadID, const int cellIdx, const T value) {
+    switch (type) {
+    case csAccumulationType::THREAD_GRID:
+      threadGrids[threadID][cellIdx] += value;
+      break;
+    case csAccumulationType::SPARSE_TILES: {
+      auto &tile = threadTiles[threadID][cellIdx / tileSize];
+      if (!tile) {
+        tile.reset(new T[tileSize]);
+        std::fill(tile.get(), tile.get() + tileSize, T(0));
+      }
+      tile[cellIdx % tileSize] += value;
+      break;
+    }
+    default: {
+      auto &cell = (*cellData)[cellIdx];
+#pragma omp atomic
+      cell += value / factor;
+    }
+    }
+  }
+
+  // Add the accumulated values to the cell data and free the thread-local
+  // memory. Has to be called outside of a parallel region.
+  void reduce() {
+    if (type == csAccumulationType::THREAD_GRID) {
+#pragma omp parallel for
+      for (long i = 0; i < static_cast<long>(numberOfCells); ++i) {
+        T sum = 0.;
+        for (const auto &grid : threadGrids) {
+          if (!grid.empty())
+            sum += grid[i];
+        }
+        (*cellData)[i] += sum / factor;
+      }
+      threadGrids.clear();
+    } else if (type == csAccumulationType::SPARSE_TILES) {
+#pragma omp parallel for schedule(dynamic)
+      for (long tileIdx = 0; tileIdx < static_cast<long>(numberOfTiles);
+           ++tileIdx) {
+        const size_t begin = tileIdx * tileSize;
+        const size_t end = std::min(begin + tileSize, numberOfCells);
+        for (auto &tiles : threadTiles) {
+          auto &tile = tiles[tileIdx];
+          if (!tile)
+            continue;
+          for (size_t i = begin; i < end; ++i)
+            (*cellData)[i] += tile[i - begin] / factor;
+          tile.reset();
+        }
+      }
+      threadTiles.clear();
+    }
+  }
+
+  // Memory currently allocated for the thread-local accumulation (bytes)
+  size_t getMemorySize() const {
+    size_t size = 0;
+    for (const auto &grid : threadGrids)
+      size += grid.capacity() * sizeof(T);
+    for (const auto &tiles : threadTiles) {
+      size += tiles.capacity() * sizeof(std::unique_ptr<T[]>);
+      for (const auto &tile : tiles)
+        size += tile ? tileSize * sizeof(T) : 0;
+    }
+    return size;
+  }
+};
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <csCellDataFile.hpp>
+#include <csDenseCellSet.hpp>
+
+#include <cstdint>
+#include <numeric>
+#include <string>
+#include <unordered_map>
+
+/**
+  Keeps a dense cell set (below the surface) restricted to a window of a
+  given thickness below the current surface. The window is measured per
+  column of cells from the topmost cell of the column. When the surface
+  descends, the depth plane of the cell set follows it and only the new
+  layers are added at the bottom, the data of all existing cells is kept.
+  Cells which fall out of the window are removed and their data can be
+  archived in files (see csCellDataFile), so the number of cells is bounded
+  by the surface area times the thickness, independent of the etch depth.
+*/
+template <class T, int D> class csSlidingWindow {
+  psSmartPointer<csDenseCellSet<T, D>> cellSet = nullptr;
+  T thickness = 0.;
+  std::string archivePrefix;
+  unsigned numberOfArchives = 0;
+  size_t numberOfRetiredCells = 0;
+
+public:
+  csSlidingWindow(psSmartPointer<csDenseCellSet<T, D>> passedCellSet,
+                  const T passedThickness)
+      : cellSet(passedCellSet), thickness(passedThickness) {}
+
+  // Retired cells are written to <prefix>_<n>.csd with their data and their
+  // cell centers. No data is archived if the prefix is empty.
+  void setArchivePrefix(const std::string &passedArchivePrefix) {
+    archivePrefix = passedArchivePrefix;
+  }
+
+  void setThickness(const T passedThickness) { thickness = passedThickness; }
+
+  size_t getNumberOfRetiredCells() const { return numberOfRetiredCells; }
+
+  // Update the cell set after the surface has moved. Replaces the call to
+  // updateSurface of the cell set.
+  void apply() {
+    if (cellSet->getCellSetPosition()) {
+      psLogger::getInstance()
+          .addWarning("csSlidingWindow: the cell set has to be below the "
+                      "surface.")
+          .print();
+      return;
+    }
+
+    cellSet->updateSurface();
+    if (cellSet->getNumberOfCells() == 0) {
+      psLogger::getInstance()
+          .addWarning("csSlidingWindow: the surface moved below the window. "
+                      "Increase the thickness or update more often.")
+          .print();
+      return;
+    }
+
+    const T gridDelta = cellSet->getGridDelta();
+    const int windowLayers =
+        std::max(static_cast<int>(std::round(thickness / gridDelta)), 1);
+
+    // adding cells at the bottom does not change the column tops
+    const auto columnTops = findColumnTops();
+    const auto previousIndex = extendColumns(columnTops, windowLayers);
+    retireCells(columnTops, windowLayers, previousIndex);
+  }
+
+private:
+  static std::uint64_t getColumnKey(const std::array<int, D> &coordinates) {
+    std::uint64_t key = 0;
+    for (int i = 0; i < D - 1; ++i)
+      key = (key << 32) | static_cast<std::uint32_t>(coordinates[i]);
+    return key;
+  }
+
+  // Vertical cell coordinate of the topmost cell in each column
+  std::unordered_map<std::uint64_t, int> findColumnTops() const {
+    std::unordered_map<std::uint64_t, int> columnTops;
+    for (unsigned cellIdx = 0; cellIdx < cellSet->getNumberOfCells();
+         ++cellIdx) {
+      const auto coordinates = cellSet->getCellCoordinates(cellIdx);
+      auto it =
+          columnTops.emplace(getColumnKey(coordinates), coordinates[D - 1]);
+      it.first->second = std::max(it.first->second, coordinates[D - 1]);
+    }
+    return columnTops;
+  }
+
+  // Add the cells between the bottom of the window and the lowest cell of
+  // each column. Only these cells are allocated, the existing cells keep
+  // their index and data. Returns the old index of each cell, -1 for the new
+  // cells.
+  std::vector<int>
+  extendColumns(const std::unordered_map<std::uint64_t, int> &columnTops,
+                const int windowLayers) {
+    const auto numberOfOldCells = cellSet->getNumberOfCells();
+    std::unordered_map<std::uint64_t, std::array<int, D>> columnBottoms;
+    for (unsigned cellIdx = 0; cellIdx < numberOfOldCells; ++cellIdx) {
+      const auto coordinates = cellSet->getCellCoordinates(cellIdx);
+      auto it = columnBottoms.emplace(getColumnKey(coordinates), coordinates);
+      if (coordinates[D - 1] < it.first->second[D - 1])
+        it.first->second = coordinates;
+    }
+
+    std::vector<std::array<int, D>> newCells;
+    for (const auto &column : columnBottoms) {
+      auto coordinates = column.second;
+      for (coordinates[D - 1] = columnTops.at(column.first) + 1 - windowLayers;
+           coordinates[D - 1] < column.second[D - 1]; ++coordinates[D - 1])
+        newCells.push_back(coordinates);
+    }
+    cellSet->addCells(std::move(newCells));
+
+    std::vector<int> previousIndex(cellSet->getNumberOfCells(), -1);
+    std::iota(previousIndex.begin(), previousIndex.begin() + numberOfOldCells,
+              0);
+    return previousIndex;
+  }
+
+  // Remove all cells below the window of their column. Cells which existed
+  // before are archived.
+  void retireCells(const std::unordered_map<std::uint64_t, int> &columnTops,
+                   const int windowLayers,
+                   const std::vector<int> &previousIndex) {
+    const auto numberOfCells = cellSet->getNumberOfCells();
+    std::vector<bool> retired(numberOfCells, false);
+    std::vector<unsigned> archivedCells;
+    for (unsigned cellIdx = 0; cellIdx < numberOfCells; ++cellIdx) {
+      const auto coordinates = cellSet->getCellCoordinates(cellIdx);
+      const int top = columnTops.at(getColumnKey(coordinates));
+      if (coordinates[D - 1] > top - windowLayers)
+        continue;
+      retired[cellIdx] = true;
+      if (previousIndex.empty() || previousIndex[cellIdx] >= 0)
+        archivedCells.push_back(cellIdx);
+    }
+
+    if (!archivePrefix.empty() && !archivedCells.empty())
+      archive(archivedCells);
+    numberOfRetiredCells += archivedCells.size();
+
+    cellSet->removeCells(retired);
+  }
+
+  void archive(const std::vector<unsigned> &cells) {
+    auto &cellData = cellSet->getCellGrid()->getCellData();
+    std::vector<std::string> labels;
+    std::vector<std::vector<T>> data;
+    for (unsigned i = 0; i < cellData.getScalarDataSize(); ++i) {
+      labels.push_back(cellData.getScalarDataLabel(i));
+      const auto &values = *cellData.getScalarData(i);
+      data.emplace_back();
+      for (const auto cellIdx : cells)
+        data.back().push_back(values[cellIdx]);
+    }
+
+    const char *centerLabels[] = {"centerX", "centerY", "centerZ"};
+    for (int j = 0; j < D; ++j) {
+      labels.push_back(centerLabels[j]);
+      data.emplace_back();
+      for (const auto cellIdx : cells)
+        data.back().push_back(cellSet->getCellCenter(cellIdx)[j]);
+    }
+
+    std::vector<const std::vector<T> *> arrays;
+    for (const auto &values : data)
+      arrays.push_back(&values);
+
+    const auto cellGrid = cellSet->getCellGrid();
+    csTriple<double> minimumExtent, maximumExtent;
+    for (int i = 0; i < 3; ++i) {
+      minimumExtent[i] = cellGrid->minimumExtent[i];
+      maximumExtent[i] = cellGrid->maximumExtent[i];
+    }
+    csCellDataFile<T>::write(archivePrefix + "_" +
+                                 std::to_string(numberOfArchives++) + ".csd",
+                             cells.size(), cellSet->getGridDelta(),
+                             minimumExtent, maximumExtent, labels, arrays);
+  }
+};
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/**
+  Vector with a fixed inline capacity of N elements. Only the elements beyond
+  N are stored on the heap, and the heap memory is kept when the vector is
+  cleared, so a vector that is reused does not allocate after it reached its
+  maximum size once. The number of heap allocations is counted to check that
+  a hot loop is allocation-free.
+*/
+template <class T, std::size_t N> class csSmallVector {
+  std::array<T, N> inlineElements;
+  std::vector<T> heapElements;
+  size_t numElements = 0;
+  size_t numAllocations = 0;
+
+public:
+  void push_back(const T &element) { emplace_back(element); }
+
+  void push_back(T &&element) { emplace_back(std::move(element)); }
+
+  template <class... Args> T &emplace_back(Args &&...args) {
+    if (numElements < N) {
+      inlineElements[numElements] = T{std::forward<Args>(args)...};
+      return inlineElements[numElements++];
+    }
+    if (heapElements.size() == heapElements.capacity())
+      ++numAllocations;
+    ++numElements;
+    heapElements.push_back(T{std::forward<Args>(args)...});
+    return heapElements.back();
+  }
+
+  void pop_back() {
+    assert(numElements > 0 && "pop_back on empty vector");
+    if (numElements-- > N)
+      heapElements.pop_back();
+  }
+
+  T &back() { return (*this)[numElements - 1]; }
+
+  const T &back() const { return (*this)[numElements - 1]; }
+
+  T &operator[](const size_t idx) {
+    return idx < N ? inlineElements[idx] : heapElements[idx - N];
+  }
+
+  const T &operator[](const size_t idx) const {
+    return idx < N ? inlineElements[idx] : heapElements[idx - N];
+  }
+
+  size_t size() const { return numElements; }
+
+  bool empty() const { return numElements == 0; }
+
+  void clear() {
+    heapElements.clear();
+    numElements = 0;
+  }
+
+  static constexpr size_t inlineCapacity() { return N; }
+
+  // Number of heap allocations since construction
+  size_t getNumberOfAllocations() const { return numAllocations; }
+};
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <csDenseCellSet.hpp>
+
+/**
+  Stencil operations on the face neighbors of the cells in a cell set. The
+  neighbors are read from the neighbor table of the cell set, which is built
+  on first use. Masks select the cells which take part in an operation, e.g.
+  all cells of one material. All operations run in parallel over the cells.
+*/
+template <class T, int D> class csStencil {
+  using cellSetType = csDenseCellSet<T, D>;
+
+public:
+  // Call op(cellIdx, neighbors) for all cells, where neighbors are the
+  // indices of the face neighbors (-x, x, -y, y, -z, z), -1 if there is no
+  // neighbor.
+  template <class OperationType>
+  static void apply(cellSetType &cellSet, OperationType &&op) {
+    if (!cellSet.hasNeighborhood())
+      cellSet.buildNeighborhood();
+
+    const long numberOfCells = cellSet.getNumberOfCells();
+#pragma omp parallel for
+    for (long cellIdx = 0; cellIdx < numberOfCells; ++cellIdx) {
+      op(cellIdx, cellSet.getNeighbors(cellIdx));
+    }
+  }
+
+  // Mean over each cell and those of its face neighbors for which the mask
+  // is set.
+  static std::vector<T> average(cellSetType &cellSet,
+                                const std::vector<T> &data,
+                                const std::vector<char> &neighborMask) {
+    std::vector<T> result(data.size());
+    apply(cellSet, [&](const long cellIdx,
+                       const std::array<int, 2 * D> &neighbors) {
+      T sum = data[cellIdx];
+      int count = 1;
+      for (const auto n : neighbors) {
+        const bool valid = n >= 0 && neighborMask[n];
+        sum += valid ? data[n] : T(0);
+        count += valid;
+      }
+      result[cellIdx] = sum / static_cast<T>(count);
+    });
+    return result;
+  }
+
+  // Mask of all cells for which the predicate on the material ID is true
+  template <class PredicateType>
+  static std::vector<char> materialMask(cellSetType &cellSet,
+                                        PredicateType &&predicate) {
+    const auto materialIds = cellSet.getScalarData("Material");
+    std::vector<char> mask(materialIds->size());
+#pragma omp parallel for
+    for (long i = 0; i < static_cast<long>(mask.size()); ++i) {
+      mask[i] = predicate(static_cast<int>(materialIds->at(i)));
+    }
+    return mask;
+  }
+};
@@ -3,6 +3,7 @@
 #include <embree3/rtcore.h>
 
 #include <csDenseCellSet.hpp>
+#include <csStencil.hpp>
 #include <csTracingKernel.hpp>
 #include <csTracingParticle.hpp>
 
@@ -13,24 +14,38 @@
 #include <raySourceRandom.hpp>
 #include <rayUtil.hpp>
 
+#include <psQuasiRandomSource.hpp>
+
 template <class T, int D> class csTracing {
 private:
   lsSmartPointer<csDenseCellSet<T, D>> cellSet = nullptr;
   std::unique_ptr<csAbstractParticle<T>> mParticle = nullptr;
 
-  RTCDevice mDevice;
+  RTCDevice &mDevice;
   rayGeometry<T, D> mGeometry;
+  std::unique_ptr<rayBoundary<T, D>> mBoundary = nullptr;
+  RTCScene mScene = nullptr;
+  unsigned mGeometryID = RTC_INVALID_GEOMETRY_ID;
+  unsigned mBoundaryID = RTC_INVALID_GEOMETRY_ID;
+  // defined points of the level sets at the last geometry update and bounding
+  // box of the boundary, used to skip rebuilding geometries which did not
+  // change
+  std::vector<std::vector<hrleIndexType>> mLevelSetIndices;
+  std::vector<std::vector<T>> mLevelSetValues;
+  rayPair<rayTriple<T>> mBoundaryBox;
   size_t mNumberOfRaysPerPoint = 0;
   size_t mNumberOfRaysFixed = 1000;
   T mGridDelta = 0;
   rayTraceBoundary mBoundaryConds[D] = {};
   rayTraceDirection mSourceDirection = rayTraceDirection::POS_Z;
   bool mUseRandomSeeds = true;
+  psSourceSamplingType mSourceSampling = psSourceSamplingType::PSEUDO_RANDOM;
+  csAccumulationType mAccumulation = csAccumulationType::AUTO;
   size_t mRunNumber = 0;
   int excludeMaterialId = -1;
 
 public:
-  csTracing() : mDevice(rtcNewDevice("hugepages=1")) {
+  csTracing() : mDevice(csUtil::getSharedDevice()) {
     // TODO: currently only periodic boundary conditions are implemented in
     // csTracingKernel
     for (int i = 0; i < D; i++)
@@ -38,33 +53,54 @@ public:
   }
 
   ~csTracing() {
-    mGeometry.releaseGeometry();
-    rtcReleaseDevice(mDevice);
+    if (mScene)
+      rtcReleaseScene(mScene);
+    if (mBoundary)
+      mBoundary->releaseGeometry();
+    if (mGeometryID != RTC_INVALID_GEOMETRY_ID)
+      mGeometry.releaseGeometry();
   }
 
   void apply() {
-    createGeometry();
+    if (!mScene)
+      mScene = rtcNewScene(mDevice);
+    bool sceneChanged = updateGeometry();
     initMemoryFlags();
     auto boundingBox = mGeometry.getBoundingBox();
     rayInternal::adjustBoundingBox<T, D>(
         boundingBox, mSourceDirection, mGridDelta * rayInternal::DiskFactor<D>);
     auto traceSettings = rayInternal::getTraceSettings(mSourceDirection);
+    sceneChanged |= updateBoundary(boundingBox, traceSettings);
+
+    if (sceneChanged) {
+      // high quality BVHs take too long to build for large geometries, which
+      // change in every time step
+      rtcSetSceneBuildQuality(mScene, mGeometry.getNumPoints() > 1000000
+                                          ? RTC_BUILD_QUALITY_MEDIUM
+                                          : RTC_BUILD_QUALITY_HIGH);
+      rtcCommitScene(mScene);
+    }
 
-    auto boundary =
-        rayBoundary<T, D>(mDevice, boundingBox, mBoundaryConds, traceSettings);
-
-    auto raySource = raySourceRandom<T, D>(
-        boundingBox, mParticle->getSourceDistributionPower(), traceSettings,
-        mGeometry.getNumPoints());
+    std::unique_ptr<raySource<T, D>> raySource;
+    if (mSourceSampling == psSourceSamplingType::QUASI_RANDOM) {
+      raySource = std::make_unique<psQuasiRandomSource<T, D>>(
+          boundingBox, mParticle->getSourceDistributionPower(), traceSettings,
+          mGeometry.getNumPoints(),
+          mUseRandomSeeds ? std::random_device{}() : mRunNumber);
+    } else {
+      raySource = std::make_unique<raySourceRandom<T, D>>(
+          boundingBox, mParticle->getSourceDistributionPower(), traceSettings,
+          mGeometry.getNumPoints());
+    }
 
     auto tracer = csTracingKernel<T, D>(
-        mDevice, mGeometry, boundary, raySource, mParticle,
-        mNumberOfRaysPerPoint, mNumberOfRaysFixed, mUseRandomSeeds,
-        mRunNumber++, cellSet, excludeMaterialId - 1);
+        mDevice, mScene, mGeometryID, mBoundaryID, mGeometry, *mBoundary,
+        *raySource, mParticle, mNumberOfRaysPerPoint, mNumberOfRaysFixed,
+        mUseRandomSeeds, mRunNumber++, cellSet, excludeMaterialId - 1,
+        mAccumulation);
     tracer.apply();
 
     averageNeighborhood();
-    boundary.releaseGeometry();
   }
 
   void setCellSet(lsSmartPointer<csDenseCellSet<T, D>> passedCellSet) {
@@ -90,123 +126,145 @@ public:
 
   void setExcludeMaterialId(int passedId) { excludeMaterialId = passedId; }
 
+  // Set how the ray origins and directions are sampled on the source plane.
+  // Quasi-random sampling reaches the same noise level with fewer rays.
+  void setSourceSampling(const psSourceSamplingType passedSampling) {
+    mSourceSampling = passedSampling;
+  }
+
+  // Set how the flux deposited by the threads is accumulated in the cell set.
+  // By default, one grid per thread is used if all grids fit into 1 GB,
+  // sparse tiles if the tiles are expected to fit and atomic adds otherwise.
+  void setAccumulationType(const csAccumulationType passedAccumulation) {
+    mAccumulation = passedAccumulation;
+  }
+
   lsSmartPointer<csDenseCellSet<T, D>> getCellSet() const { return cellSet; }
 
+  // Average the filling fractions over each cell and its face neighbors.
+  // Cells with negative filling fractions and cells of the excluded material
+  // are not included.
   void averageNeighborhood() {
     auto data = cellSet->getFillingFractions();
     auto materialIds = cellSet->getScalarData("Material");
-    const auto &elems = cellSet->getElements();
-    const auto &nodes = cellSet->getNodes();
-    std::vector<T> average(data->size(), 0.);
 
+    std::vector<char> valid(data->size());
 #pragma omp parallel for
-    for (size_t i = 0; i < data->size(); i++) {
-      if (data->at(i) < 0) {
-        average[i] = -1.;
-        continue;
-      }
-      if (materialIds->at(i) == excludeMaterialId)
-        continue;
-
-      int numNeighbors = 1;
-      average[i] += data->at(i);
-
-      for (int d = 0; d < D; d++) {
-        auto mid = calcMidPoint(nodes[elems[i][0]]);
-        mid[d] -= mGridDelta;
-        auto elemId = cellSet->getIndex(mid);
-        if (elemId >= 0) {
-          if (data->at(elemId) >= 0 &&
-              materialIds->at(elemId) != excludeMaterialId) {
-            average[i] += data->at(elemId);
-            numNeighbors++;
-          }
-        }
-
-        mid[d] += 2 * mGridDelta;
-        elemId = cellSet->getIndex(mid);
-        if (elemId >= 0) {
-          if (data->at(elemId) >= 0 &&
-              materialIds->at(elemId) != excludeMaterialId) {
-            average[i] += data->at(elemId);
-            numNeighbors++;
-          }
-        }
-      }
-      average[i] /= static_cast<T>(numNeighbors);
+    for (long i = 0; i < static_cast<long>(data->size()); i++) {
+      valid[i] = data->at(i) >= 0 && materialIds->at(i) != excludeMaterialId;
     }
 
+    const auto average = csStencil<T, D>::average(*cellSet, *data, valid);
+
 #pragma omp parallel for
-    for (size_t i = 0; i < data->size(); i++) {
-      data->at(i) = average[i];
+    for (long i = 0; i < static_cast<long>(data->size()); i++) {
+      if (data->at(i) < 0)
+        data->at(i) = -1.;
+      else if (materialIds->at(i) == excludeMaterialId)
+        data->at(i) = 0.;
+      else
+        data->at(i) = average[i];
     }
   }
 
+  // Average the filling fractions of the cells of one material over each
+  // cell and its face neighbors of the same material. The filling fractions
+  // of all other cells are set to zero.
   void averageNeighborhoodSingleMaterial(int materialId) {
     auto data = cellSet->getFillingFractions();
     auto materialIds = cellSet->getScalarData("Material");
-    const auto &elems = cellSet->getElements();
-    const auto &nodes = cellSet->getNodes();
-    std::vector<T> average(data->size(), 0.);
 
+    std::vector<char> valid(data->size());
 #pragma omp parallel for
-    for (size_t i = 0; i < data->size(); i++) {
-      if (materialIds->at(i) != materialId)
-        continue;
-
-      int numNeighbors = 1;
-      average[i] += data->at(i);
-      for (int d = 0; d < D; d++) {
-        auto mid = calcMidPoint(nodes[elems[i][0]]);
-        mid[d] -= mGridDelta;
-        auto elemId = cellSet->getIndex(mid);
-        if (elemId >= 0) {
-          if (data->at(elemId) >= 0 && materialIds->at(elemId) == materialId) {
-            average[i] += data->at(elemId);
-            numNeighbors++;
-          }
-        }
-
-        mid[d] += 2 * mGridDelta;
-        elemId = cellSet->getIndex(mid);
-        if (elemId >= 0) {
-          if (data->at(elemId) >= 0 && materialIds->at(elemId) == materialId) {
-            average[i] += data->at(elemId);
-            numNeighbors++;
-          }
-        }
-      }
-      average[i] /= static_cast<T>(numNeighbors);
+    for (long i = 0; i < static_cast<long>(data->size()); i++) {
+      valid[i] = data->at(i) >= 0 && materialIds->at(i) == materialId;
     }
 
+    const auto average = csStencil<T, D>::average(*cellSet, *data, valid);
+
 #pragma omp parallel for
-    for (size_t i = 0; i < data->size(); i++) {
-      data->at(i) = average[i];
+    for (long i = 0; i < static_cast<long>(data->size()); i++) {
+      data->at(i) = materialIds->at(i) == materialId ? average[i] : 0.;
     }
   }
 
 private:
-  void createGeometry() {
+  // Create the disk geometry from the level sets. The geometry is only
+  // rebuilt if the level sets changed since the last call. Returns true if the
+  // scene has to be committed.
+  bool updateGeometry() {
     auto levelSets = cellSet->getLevelSets();
+    const T gridDelta = levelSets->back()->getGrid().getGridDelta();
+    if (!levelSetsChanged(*levelSets) && gridDelta == mGridDelta &&
+        mGeometryID != RTC_INVALID_GEOMETRY_ID)
+      return false;
+
     auto diskMesh = lsSmartPointer<lsMesh<T>>::New();
     lsToDiskMesh<T, D> converter(diskMesh);
     for (auto ls : *levelSets) {
       converter.insertNextLevelSet(ls);
     }
     converter.apply();
-    auto points = diskMesh->getNodes();
-    auto normals = *diskMesh->getCellData().getVectorData("Normals");
-    auto materialIds = *diskMesh->getCellData().getScalarData("MaterialIds");
-    mGridDelta = levelSets->back()->getGrid().getGridDelta();
+    auto &points = diskMesh->getNodes();
+    auto &normals = *diskMesh->getCellData().getVectorData("Normals");
+    auto &materialIds = *diskMesh->getCellData().getScalarData("MaterialIds");
+    mGridDelta = gridDelta;
+
+    if (mGeometryID != RTC_INVALID_GEOMETRY_ID) {
+      rtcDetachGeometry(mScene, mGeometryID);
+      mGeometry.releaseGeometry();
+    }
     mGeometry.initGeometry(mDevice, points, normals,
                            mGridDelta * rayInternal::DiskFactor<D>);
     mGeometry.setMaterialIds(materialIds);
+    mGeometryID = rtcAttachGeometry(mScene, mGeometry.getRTCGeometry());
+    return true;
+  }
+
+  // The boundary is only rebuilt if the bounding box changed. Returns true if
+  // the scene has to be committed.
+  bool updateBoundary(rayPair<rayTriple<T>> &boundingBox,
+                      std::array<int, 5> &traceSettings) {
+    if (mBoundary && boundingBox == mBoundaryBox)
+      return false;
+
+    if (mBoundary) {
+      rtcDetachGeometry(mScene, mBoundaryID);
+      mBoundary->releaseGeometry();
+    }
+    mBoundary = std::make_unique<rayBoundary<T, D>>(
+        mDevice, boundingBox, mBoundaryConds, traceSettings);
+    mBoundaryID = rtcAttachGeometry(mScene, mBoundary->getRTCGeometry());
+    mBoundaryBox = boundingBox;
+    return true;
   }
 
-  inline csTriple<T> calcMidPoint(const csTriple<T> &minNode) {
-    return csTriple<T>{minNode[0] + mGridDelta / T(2),
-                       minNode[1] + mGridDelta / T(2),
-                       minNode[2] + mGridDelta / T(2)};
+  // Compare the defined points of the level sets exactly with those of the
+  // last call and store them for the next one.
+  bool levelSetsChanged(
+      const std::vector<lsSmartPointer<lsDomain<T, D>>> &levelSets) {
+    bool changed = levelSets.size() != mLevelSetIndices.size();
+    mLevelSetIndices.resize(levelSets.size());
+    mLevelSetValues.resize(levelSets.size());
+    for (size_t l = 0; l < levelSets.size(); ++l) {
+      std::vector<hrleIndexType> indices;
+      std::vector<T> values;
+      indices.reserve(D * levelSets[l]->getNumberOfPoints());
+      values.reserve(levelSets[l]->getNumberOfPoints());
+      for (hrleConstSparseIterator<typename lsDomain<T, D>::DomainType> it(
+               levelSets[l]->getDomain());
+           !it.isFinished(); it.next()) {
+        if (!it.isDefined())
+          continue;
+        for (int i = 0; i < D; ++i)
+          indices.push_back(it.getStartIndices(i));
+        values.push_back(it.getValue());
+      }
+      changed |= indices != mLevelSetIndices[l] || values != mLevelSetValues[l];
+      mLevelSetIndices[l] = std::move(indices);
+      mLevelSetValues[l] = std::move(values);
+    }
+    return changed;
   }
 
   void initMemoryFlags() {
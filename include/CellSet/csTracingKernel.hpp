@@ -9,52 +9,58 @@
 #include <rayUtil.hpp>
 
 #include <csDenseCellSet.hpp>
-#include <csTracePath.hpp>
+#include <csFluxAccumulator.hpp>
 #include <csTracingParticle.hpp>
+#include <csVoxelTraversal.hpp>
 
 template <typename T, int D> class csTracingKernel {
 public:
-  csTracingKernel(RTCDevice &pDevice, rayGeometry<T, D> &pRTCGeometry,
+  csTracingKernel(RTCDevice &pDevice, RTCScene &pScene,
+                  const unsigned pGeometryID, const unsigned pBoundaryID,
+                  rayGeometry<T, D> &pRTCGeometry,
                   rayBoundary<T, D> &pRTCBoundary, raySource<T, D> &pSource,
                   std::unique_ptr<csAbstractParticle<T>> &pParticle,
                   const size_t pNumOfRayPerPoint, const size_t pNumOfRayFixed,
                   const bool pUseRandomSeed, const size_t pRunNumber,
                   lsSmartPointer<csDenseCellSet<T, D>> passedCellSet,
-                  int passedExclude)
-      : mDevice(pDevice), mGeometry(pRTCGeometry), mBoundary(pRTCBoundary),
+                  int passedExclude,
+                  csAccumulationType passedAccumulation =
+                      csAccumulationType::AUTO)
+      : mDevice(pDevice), mScene(pScene), mGeometryID(pGeometryID),
+        mBoundaryID(pBoundaryID), mGeometry(pRTCGeometry),
+        mBoundary(pRTCBoundary),
         mSource(pSource), mParticle(pParticle->clone()),
         mNumRays(pNumOfRayFixed == 0
                      ? pSource.getNumPoints() * pNumOfRayPerPoint
                      : pNumOfRayFixed),
         mUseRandomSeeds(pUseRandomSeed), mRunNumber(pRunNumber),
         cellSet(passedCellSet), excludeMaterial(passedExclude),
-        mGridDelta(cellSet->getGridDelta()) {
+        mGridDelta(cellSet->getGridDelta()),
+        accumulationType(passedAccumulation) {
     assert(rtcGetDeviceProperty(mDevice, RTC_DEVICE_PROPERTY_VERSION) >=
                30601 &&
            "Error: The minimum version of Embree is 3.6.1");
   }
 
   void apply() {
-    auto rtcScene = rtcNewScene(mDevice);
-    rtcSetSceneFlags(rtcScene, RTC_SCENE_FLAG_NONE);
-    auto bbquality = RTC_BUILD_QUALITY_HIGH;
-    rtcSetSceneBuildQuality(rtcScene, bbquality);
-    auto rtcGeometry = mGeometry.getRTCGeometry();
-    auto rtcBoundary = mBoundary.getRTCGeometry();
-
-    auto boundaryID = rtcAttachGeometry(rtcScene, rtcBoundary);
-    auto geometryID = rtcAttachGeometry(rtcScene, rtcGeometry);
+    auto rtcScene = mScene;
+    const auto boundaryID = mBoundaryID;
+    const auto geometryID = mGeometryID;
     assert(rtcGetDeviceError(mDevice) == RTC_ERROR_NONE &&
            "Embree device error");
 
     const csPair<T> meanFreePath = mParticle->getMeanFreePath();
 
     auto myCellSet = cellSet;
-
-#pragma omp parallel shared(myCellSet)
+    csFluxAccumulator<T> accumulator(myCellSet->getFillingFractions(),
+                                     static_cast<T>(mNumRays),
+                                     omp_get_max_threads(), accumulationType);
+    const csVoxelTraversal<T, D> traversal(myCellSet);
+    size_t numStackAllocations = 0;
+
+#pragma omp parallel shared(myCellSet, accumulator)                           \
+    reduction(+ : numStackAllocations)
     {
-      rtcJoinCommitScene(rtcScene);
-
       alignas(128) auto rayHit =
           RTCRayHit{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 
@@ -86,10 +92,14 @@ public:
       // thread-local particle object
       auto particle = mParticle->clone();
 
-      // thread local path
-      csTracePath<T> path;
-      // if (!traceOnPath)
-      path.useGridData(myCellSet->getNumberOfCells());
+      // thread local flux accumulation
+      accumulator.init(threadID);
+
+      // thread-local volume particle stack and free path distribution, which
+      // are reused for all surface hits
+      csParticleStack<T> particleStack;
+      std::normal_distribution<T> normalDist{meanFreePath[0],
+                                             meanFreePath[1]};
 
       auto rtcContext = RTCIntersectContext{};
       rtcInitIntersectContext(&rtcContext);
@@ -170,10 +180,7 @@ public:
           if (mGeometry.getMaterialId(rayHit.hit.primID) != excludeMaterial) {
             // trace in cell set
             auto hitPoint = std::array<T, 3>{xx, yy, zz};
-            std::vector<csVolumeParticle<T>> particleStack;
-            std::normal_distribution<T> normalDist{meanFreePath[0],
-                                                   meanFreePath[1]};
-
+            particleStack.clear();
             particleStack.emplace_back(csVolumeParticle<T>{
                 hitPoint, rayDir, fillnDirection.first, 0., -1, 0});
 
@@ -186,14 +193,15 @@ public:
                 volumeParticle.distance = -1;
                 while (volumeParticle.distance < 0)
                   volumeParticle.distance = normalDist(RngState7);
-                auto travelDist = csUtil::multNew(volumeParticle.direction,
-                                                  volumeParticle.distance);
-                csUtil::add(volumeParticle.position, travelDist);
-
-                if (!checkBoundsPeriodic(volumeParticle.position))
-                  break;
 
-                auto newIdx = myCellSet->getIndex(volumeParticle.position);
+                // walk through all cells on the free path
+                auto newIdx = traversal.walk(
+                    volumeParticle, [&](const int cellIdx, const T length) {
+                      const T deposit =
+                          particle->pathDeposit(volumeParticle, length);
+                      if (deposit != 0.)
+                        accumulator.add(threadID, cellIdx, deposit);
+                    });
                 if (newIdx < 0)
                   break;
 
@@ -201,7 +209,7 @@ public:
                   volumeParticle.cellId = newIdx;
                   auto fill = particle->collision(volumeParticle, RngState7,
                                                   particleStack);
-                  path.addGridData(newIdx, fill);
+                  accumulator.add(threadID, newIdx, fill);
                 }
               }
             }
@@ -236,15 +244,18 @@ public:
           psUtils::printProgress(idx, mNumRays);
       } // end ray tracing for loop
 
-#pragma omp critical
-      myCellSet->mergePath(path, mNumRays);
+      numStackAllocations += particleStack.getNumberOfAllocations();
     } // end parallel section
 
+    psLogger::getInstance()
+        .addDebug("csTracingKernel: " + std::to_string(numStackAllocations) +
+                  " heap allocations of the volume particle stacks")
+        .print();
+
+    accumulator.reduce();
+
     if (psLogger::getLogLevel() >= 3)
       std::cout << std::endl;
-
-    rtcReleaseGeometry(rtcGeometry);
-    rtcReleaseGeometry(rtcBoundary);
   }
 
 private:
@@ -257,41 +268,12 @@ private:
            hitPoint[2] >= min[2] && hitPoint[2] <= max[2];
   }
 
-  bool checkBoundsPeriodic(csTriple<T> &hitPoint) const {
-    const auto &min = cellSet->getCellGrid()->minimumExtent;
-    const auto &max = cellSet->getCellGrid()->maximumExtent;
-
-    if constexpr (D == 3) {
-      if (hitPoint[2] < min[2] || hitPoint[2] > max[2])
-        return false;
-
-      if (hitPoint[0] < min[0]) {
-        hitPoint[0] = max[0] - mGridDelta / 2.;
-      } else if (hitPoint[0] > max[0]) {
-        hitPoint[0] = min[0] + mGridDelta / 2.;
-      }
-
-      if (hitPoint[1] < min[1]) {
-        hitPoint[1] = max[1] - mGridDelta / 2.;
-      } else if (hitPoint[1] > max[1]) {
-        hitPoint[1] = min[1] + mGridDelta / 2.;
-      }
-    } else {
-      if (hitPoint[1] < min[1] || hitPoint[1] > max[1])
-        return false;
-
-      if (hitPoint[0] < min[0]) {
-        hitPoint[0] = max[0] - mGridDelta / 2.;
-      } else if (hitPoint[0] > max[0]) {
-        hitPoint[0] = min[0] + mGridDelta / 2.;
-      }
-    }
-
-    return true;
-  }
-
 private:
   RTCDevice &mDevice;
+  // committed scene containing the geometry and the boundary
+  RTCScene &mScene;
+  const unsigned mGeometryID;
+  const unsigned mBoundaryID;
   rayGeometry<T, D> &mGeometry;
   rayBoundary<T, D> &mBoundary;
   raySource<T, D> &mSource;
@@ -302,4 +284,5 @@ private:
   lsSmartPointer<csDenseCellSet<T, D>> cellSet = nullptr;
   const T mGridDelta = 0.;
   const int excludeMaterial = -1;
+  const csAccumulationType accumulationType = csAccumulationType::AUTO;
 };
@@ -1,11 +1,17 @@
 #pragma once
 
+#include <csSmallVector.hpp>
 #include <csUtil.hpp>
 
 #include <rayRNG.hpp>
 #include <rayReflection.hpp>
 #include <rayUtil.hpp>
 
+// Stack of the secondary volume particles created in collisions. Up to 64
+// particles are stored without heap allocation.
+template <typename T>
+using csParticleStack = csSmallVector<csVolumeParticle<T>, 64>;
+
 template <typename T> class csAbstractParticle {
 public:
   virtual ~csAbstractParticle() = default;
@@ -19,7 +25,11 @@ public:
   virtual T getSourceDistributionPower() const = 0;
   virtual csPair<T> getMeanFreePath() const = 0;
   virtual T collision(csVolumeParticle<T> &particle, rayRNG &RNG,
-                      std::vector<csVolumeParticle<T>> &particleStack) = 0;
+                      csParticleStack<T> &particleStack) = 0;
+  // Deposit in a cell crossed by the particle, where length is the length of
+  // the free path inside the cell
+  virtual T pathDeposit(const csVolumeParticle<T> &particle,
+                        const T length) = 0;
 };
 
 template <typename Derived, typename T>
@@ -40,7 +50,11 @@ public:
   virtual csPair<T> getMeanFreePath() const override { return {1., 1.}; }
   virtual T
   collision(csVolumeParticle<T> &particle, rayRNG &RNG,
-            std::vector<csVolumeParticle<T>> &particleStack) override {
+            csParticleStack<T> &particleStack) override {
+    return 0.;
+  }
+  virtual T pathDeposit(const csVolumeParticle<T> &particle,
+                        const T length) override {
     return 0.;
   }
 
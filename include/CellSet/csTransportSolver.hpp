@@ -0,0 +1,284 @@
+#pragma once
+
+#include <csDenseCellSet.hpp>
+
+#include <cmath>
+#include <functional>
+#include <limits>
+
+#include <psLogger.hpp>
+
+/**
+  Implicit solver for the diffusion-convection equation
+  dc/dt = D * laplace(c) - div(v * c) on a subset of the cells of a dense cell
+  set, e.g. all gas cells. Diffusion couples each cell with its face
+  neighbors, convection uses upwind fluxes over the cell faces and there is
+  no flux across faces to cells outside of the subset, so the total amount is
+  conserved unless a sink is set. The backward Euler time steps are stable
+  and keep the concentrations positive for any step size. The linear system
+  of each step is solved with a Jacobi preconditioned BiCGSTAB method.
+*/
+template <class T, int D> class csTransportSolver {
+public:
+  using VelocityFieldType = std::function<csTriple<T>(const csTriple<T> &)>;
+  using SinkFieldType = std::function<T(const csTriple<T> &)>;
+
+private:
+  lsSmartPointer<csDenseCellSet<T, D>> cellSet = nullptr;
+  T diffusionCoefficient = 1.;
+  VelocityFieldType velocityField = nullptr;
+  SinkFieldType sinkField = nullptr;
+  T maxTimeStep = std::numeric_limits<T>::max();
+  T tolerance = 1e-8;
+  unsigned maxIterations = 1000;
+  unsigned numberOfIterations = 0;
+
+  // cell set indices of the cells in the subset
+  std::vector<unsigned> cells;
+  // system matrix in the local numbering of the subset, the off-diagonal
+  // entries are stored with the face neighbors (-1 if there is none)
+  std::vector<std::array<int, 2 * D>> neighbors;
+  std::vector<T> diagonal;
+  std::vector<std::array<T, 2 * D>> offDiagonal;
+
+public:
+  csTransportSolver(lsSmartPointer<csDenseCellSet<T, D>> passedCellSet)
+      : cellSet(passedCellSet) {}
+
+  void setDiffusionCoefficient(const T passedDiffusionCoefficient) {
+    diffusionCoefficient = passedDiffusionCoefficient;
+  }
+
+  // Velocity field of the convection, evaluated at the cell face centers
+  void setVelocityField(VelocityFieldType passedVelocityField) {
+    velocityField = passedVelocityField;
+  }
+
+  // Removal rate at the cell centers, the concentration of a cell decreases
+  // by rate * concentration per time. The removal is part of the implicit
+  // system, so it is stable for any step size.
+  void setSinkField(SinkFieldType passedSinkField) {
+    sinkField = passedSinkField;
+  }
+
+  // Maximum size of one implicit time step. By default the whole time is
+  // covered by a single step.
+  void setMaxTimeStep(const T passedMaxTimeStep) {
+    maxTimeStep = passedMaxTimeStep;
+  }
+
+  // Relative residual at which the linear solver stops
+  void setTolerance(const T passedTolerance) { tolerance = passedTolerance; }
+
+  void setMaxIterations(const unsigned passedMaxIterations) {
+    maxIterations = passedMaxIterations;
+  }
+
+  // Total number of linear solver iterations of the last call to apply
+  unsigned getNumberOfIterations() const { return numberOfIterations; }
+
+  // Advance the concentrations in data by the time. Only the cells for which
+  // the mask is set take part, the data of all other cells is not changed.
+  void apply(std::vector<T> &data, const std::vector<char> &mask,
+             const T time) {
+    numberOfIterations = 0;
+    if (time <= 0.)
+      return;
+
+    assembleSubset(mask);
+    const long numCells = cells.size();
+    if (numCells == 0)
+      return;
+
+    const int numSteps = static_cast<int>(std::ceil(time / maxTimeStep));
+    assembleMatrix(time / numSteps);
+
+    std::vector<T> rhs(numCells);
+    std::vector<T> solution(numCells);
+#pragma omp parallel for
+    for (long i = 0; i < numCells; ++i) {
+      solution[i] = data[cells[i]];
+    }
+
+    for (int step = 0; step < numSteps; ++step) {
+      std::swap(rhs, solution);
+      // previous solution as initial guess
+      solution = rhs;
+      numberOfIterations += solve(rhs, solution);
+    }
+
+#pragma omp parallel for
+    for (long i = 0; i < numCells; ++i) {
+      data[cells[i]] = solution[i];
+    }
+  }
+
+private:
+  void assembleSubset(const std::vector<char> &mask) {
+    if (!cellSet->hasNeighborhood())
+      cellSet->buildNeighborhood();
+
+    const auto numberOfCells = cellSet->getNumberOfCells();
+    std::vector<int> localIndex(numberOfCells, -1);
+    cells.clear();
+    for (unsigned cellIdx = 0; cellIdx < numberOfCells; ++cellIdx) {
+      if (mask[cellIdx]) {
+        localIndex[cellIdx] = cells.size();
+        cells.push_back(cellIdx);
+      }
+    }
+
+    neighbors.resize(cells.size());
+#pragma omp parallel for
+    for (long i = 0; i < static_cast<long>(cells.size()); ++i) {
+      const auto &cellNeighbors = cellSet->getNeighbors(cells[i]);
+      for (int k = 0; k < 2 * D; ++k) {
+        neighbors[i][k] =
+            cellNeighbors[k] < 0 ? -1 : localIndex[cellNeighbors[k]];
+      }
+    }
+  }
+
+  void assembleMatrix(const T timeStep) {
+    const long numCells = cells.size();
+    const T gridDelta = cellSet->getGridDelta();
+    const T diffusion =
+        timeStep * diffusionCoefficient / (gridDelta * gridDelta);
+    const T convection = timeStep / gridDelta;
+
+    diagonal.resize(numCells);
+    offDiagonal.resize(numCells);
+#pragma omp parallel for
+    for (long i = 0; i < numCells; ++i) {
+      const auto center = cellSet->getCellCenter(cells[i]);
+      diagonal[i] = 1.;
+      if (sinkField)
+        diagonal[i] += timeStep * sinkField(center);
+      for (int k = 0; k < 2 * D; ++k) {
+        offDiagonal[i][k] = 0.;
+        if (neighbors[i][k] < 0)
+          continue;
+
+        diagonal[i] += diffusion;
+        offDiagonal[i][k] -= diffusion;
+
+        if (velocityField) {
+          // velocity through the face in outward direction
+          const int direction = k / 2;
+          const T sign = k % 2 ? 1. : -1.;
+          auto faceCenter = center;
+          faceCenter[direction] += sign * gridDelta / 2.;
+          const T velocity = sign * velocityField(faceCenter)[direction];
+          // upwind: outflow takes the own value, inflow the neighbor value
+          diagonal[i] += convection * std::max(velocity, T(0));
+          offDiagonal[i][k] += convection * std::min(velocity, T(0));
+        }
+      }
+    }
+  }
+
+  void multiply(const std::vector<T> &x, std::vector<T> &result) const {
+#pragma omp parallel for
+    for (long i = 0; i < static_cast<long>(x.size()); ++i) {
+      T sum = diagonal[i] * x[i];
+      for (int k = 0; k < 2 * D; ++k) {
+        if (neighbors[i][k] >= 0)
+          sum += offDiagonal[i][k] * x[neighbors[i][k]];
+      }
+      result[i] = sum;
+    }
+  }
+
+  static T dot(const std::vector<T> &a, const std::vector<T> &b) {
+    T sum = 0.;
+#pragma omp parallel for reduction(+ : sum)
+    for (long i = 0; i < static_cast<long>(a.size()); ++i) {
+      sum += a[i] * b[i];
+    }
+    return sum;
+  }
+
+  // Solve the system with the Jacobi preconditioned BiCGSTAB method, x holds
+  // the initial guess. Returns the number of iterations.
+  unsigned solve(const std::vector<T> &b, std::vector<T> &x) const {
+    const long n = b.size();
+    std::vector<T> r(n), rHat(n), p(n, 0.), v(n, 0.), y(n), s(n), z(n),
+        t(n);
+
+    multiply(x, r);
+#pragma omp parallel for
+    for (long i = 0; i < n; ++i) {
+      r[i] = b[i] - r[i];
+      rHat[i] = r[i];
+    }
+
+    const T bb = dot(b, b);
+    const T threshold = tolerance * tolerance * bb;
+    if (dot(r, r) <= threshold)
+      return 0;
+
+    // the method breaks down if one of the scalar products vanishes, the
+    // solution reached so far is kept
+    auto breakdown = [&](const unsigned iteration) {
+      psLogger::getInstance()
+          .addWarning("csTransportSolver: linear solver broke down in "
+                      "iteration " +
+                      std::to_string(iteration) + " at relative residual " +
+                      std::to_string(std::sqrt(dot(r, r) / bb)) + ".")
+          .print();
+      return iteration;
+    };
+
+    T rho = 1., alpha = 1., omega = 1.;
+    for (unsigned iteration = 1; iteration <= maxIterations; ++iteration) {
+      const T rhoNew = dot(rHat, r);
+      if (rhoNew == 0.)
+        return breakdown(iteration);
+      const T beta = (rhoNew / rho) * (alpha / omega);
+      rho = rhoNew;
+
+#pragma omp parallel for
+      for (long i = 0; i < n; ++i) {
+        p[i] = r[i] + beta * (p[i] - omega * v[i]);
+        y[i] = p[i] / diagonal[i];
+      }
+      multiply(y, v);
+      const T rHatV = dot(rHat, v);
+      if (rHatV == 0.)
+        return breakdown(iteration);
+      alpha = rho / rHatV;
+
+#pragma omp parallel for
+      for (long i = 0; i < n; ++i) {
+        s[i] = r[i] - alpha * v[i];
+        z[i] = s[i] / diagonal[i];
+      }
+      if (dot(s, s) <= threshold) {
+#pragma omp parallel for
+        for (long i = 0; i < n; ++i)
+          x[i] += alpha * y[i];
+        return iteration;
+      }
+
+      multiply(z, t);
+      // the stabilizing step cannot reduce the residual if t vanishes
+      const T tt = dot(t, t);
+      omega = tt == 0. ? T(0) : dot(t, s) / tt;
+#pragma omp parallel for
+      for (long i = 0; i < n; ++i) {
+        x[i] += alpha * y[i] + omega * z[i];
+        r[i] = s[i] - omega * t[i];
+      }
+      if (dot(r, r) <= threshold)
+        return iteration;
+      if (omega == 0.)
+        return breakdown(iteration);
+    }
+
+    psLogger::getInstance()
+        .addWarning("csTransportSolver: linear solver did not converge in " +
+                    std::to_string(maxIterations) + " iterations.")
+        .print();
+    return maxIterations;
+  }
+};
@@ -9,6 +9,8 @@
 #include <omp.h>
 #include <vector>
 
+#include <embree3/rtcore.h>
+
 template <typename T> using csPair = std::array<T, 2>;
 
 template <typename T> using csTriple = std::array<T, 3>;
@@ -23,6 +25,16 @@ template <typename T> struct csVolumeParticle {
 };
 
 namespace csUtil {
+// Embree device shared by all tracers of the process, independent of their
+// numeric type and dimension
+inline RTCDevice &getSharedDevice() {
+  static struct SharedDevice {
+    RTCDevice device = rtcNewDevice("hugepages=1");
+    ~SharedDevice() { rtcReleaseDevice(device); }
+  } sharedDevice;
+  return sharedDevice.device;
+}
+
 template <typename T> void printTriple(const csTriple<T> &p) {
   std::cout << "[" << p[0] << ", " << p[1] << ", " << p[2] << "]\n";
 }
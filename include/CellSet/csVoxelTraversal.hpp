@@ -0,0 +1,120 @@
+#pragma once
+
+#include <csDenseCellSet.hpp>
+#include <csUtil.hpp>
+
+#include <limits>
+
+/**
+  Voxel traversal (Amanatides-Woo 3D-DDA) of volume particles through the
+  cells of a dense cell set. A particle is moved by its sampled free path and
+  all cells crossed on the way are visited in order, together with the length
+  of the path inside each cell. The current cell is tracked through its
+  integer coordinates, so each crossed cell costs one index map access
+  instead of a point lookup. The lateral boundaries are periodic, the
+  particle leaves the cell set through the top or bottom.
+*/
+template <class T, int D> class csVoxelTraversal {
+  lsSmartPointer<csDenseCellSet<T, D>> cellSet = nullptr;
+  const T gridDelta;
+  // range of the integer cell coordinates, the maximum is exclusive
+  std::array<int, D> minCoordinates;
+  std::array<int, D> maxCoordinates;
+
+public:
+  csVoxelTraversal(lsSmartPointer<csDenseCellSet<T, D>> passedCellSet)
+      : cellSet(passedCellSet), gridDelta(passedCellSet->getGridDelta()) {
+    const auto boundingBox = cellSet->getBoundingBox();
+    for (int i = 0; i < D; ++i) {
+      minCoordinates[i] =
+          static_cast<int>(std::round(boundingBox[0][i] / gridDelta));
+      maxCoordinates[i] =
+          static_cast<int>(std::round(boundingBox[1][i] / gridDelta));
+    }
+  }
+
+  // Move the particle along its direction by its distance and call
+  // visit(cellIdx, length) for every cell on the path. Cells of the path
+  // which do not exist (e.g. in a trench) are skipped. Returns the index of
+  // the cell at the end of the path or -1 if there is no cell at the end or
+  // the particle left the cell set in vertical direction.
+  template <class VisitorType>
+  int walk(csVolumeParticle<T> &particle, VisitorType &&visit) const {
+    auto &position = particle.position;
+    const auto &direction = particle.direction;
+    const T distance = particle.distance;
+
+    std::array<int, D> coordinates;
+    std::array<int, D> step;
+    std::array<T, D> tMax;
+    std::array<T, D> tDelta;
+    for (int i = 0; i < D; ++i) {
+      coordinates[i] = static_cast<int>(std::floor(position[i] / gridDelta));
+      if (direction[i] > 0) {
+        step[i] = 1;
+        tMax[i] = ((coordinates[i] + 1) * gridDelta - position[i]) /
+                  direction[i];
+        tDelta[i] = gridDelta / direction[i];
+      } else if (direction[i] < 0) {
+        step[i] = -1;
+        tMax[i] = (coordinates[i] * gridDelta - position[i]) / direction[i];
+        tDelta[i] = -gridDelta / direction[i];
+      } else {
+        step[i] = 0;
+        tMax[i] = std::numeric_limits<T>::max();
+        tDelta[i] = std::numeric_limits<T>::max();
+      }
+    }
+    if (!wrapCoordinates(coordinates))
+      return -1;
+
+    T t = 0.;
+    int cellIdx = cellSet->getIndex(coordinates);
+    while (true) {
+      int axis = 0;
+      for (int i = 1; i < D; ++i) {
+        if (tMax[i] < tMax[axis])
+          axis = i;
+      }
+
+      const T tNext = std::min(tMax[axis], distance);
+      if (cellIdx >= 0 && tNext > t)
+        visit(cellIdx, tNext - t);
+      if (tMax[axis] >= distance)
+        break;
+
+      t = tMax[axis];
+      tMax[axis] += tDelta[axis];
+      coordinates[axis] += step[axis];
+      if (!wrapCoordinates(coordinates))
+        return -1;
+      cellIdx = cellSet->getIndex(coordinates);
+    }
+
+    // move the particle and map it back into the periodic domain
+    for (int i = 0; i < 3; ++i)
+      position[i] += direction[i] * distance;
+    for (int i = 0; i < D - 1; ++i) {
+      const T minimum = minCoordinates[i] * gridDelta;
+      const T extent = (maxCoordinates[i] - minCoordinates[i]) * gridDelta;
+      position[i] -= std::floor((position[i] - minimum) / extent) * extent;
+    }
+
+    return cellIdx;
+  }
+
+private:
+  // Apply the periodic boundaries in the lateral directions. Returns false if
+  // the coordinates are outside in vertical direction.
+  bool wrapCoordinates(std::array<int, D> &coordinates) const {
+    for (int i = 0; i < D - 1; ++i) {
+      const int extent = maxCoordinates[i] - minCoordinates[i];
+      int c = (coordinates[i] - minCoordinates[i]) % extent;
+      if (c < 0)
+        c += extent;
+      coordinates[i] = minCoordinates[i] + c;
+    }
+    return coordinates[D - 1] >= minCoordinates[D - 1] &&
+           coordinates[D - 1] < maxCoordinates[D - 1];
+  }
+};
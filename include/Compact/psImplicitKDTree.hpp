@@ -0,0 +1,326 @@
+#ifndef PS_IMPLICIT_KDTREE_HPP
+#define PS_IMPLICIT_KDTREE_HPP
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include <psLogger.hpp>
+#include <psQueues.hpp>
+
+/**
+  kD-tree with the dimension fixed at compile time. The tree has no node
+  objects: the points are stored coordinate by coordinate (structure of
+  arrays) in tree order, so that the subtree of a node is a contiguous range
+  of points with the node in the middle. The children of the node of the
+  range [begin, end) are the ranges [begin, mid) and [mid + 1, end), the
+  splitting axis is the depth modulo D. Ranges of at most leafSize points
+  are not split further and scanned linearly. The tree is traversed with an
+  explicit stack instead of recursion.
+
+  The query interface matches the one of psKDTree.
+*/
+template <class NumericType, std::size_t D> class psImplicitKDTree {
+public:
+  using SizeType = std::size_t;
+  using PointType = std::array<NumericType, D>;
+
+private:
+  static constexpr SizeType leafSize = 8;
+  // Enough for any tree which fits into memory
+  static constexpr SizeType maxStackSize = 64;
+
+  struct StackEntry {
+    SizeType begin;
+    SizeType end;
+    SizeType depth;
+    // Lower bound of the squared distance to all points in the range
+    NumericType bound;
+  };
+
+  // Point coordinates and original indices in tree order
+  std::array<std::vector<NumericType>, D> coordinates;
+  std::vector<SizeType> indices;
+  std::array<NumericType, D> squaredScalingFactors;
+  bool built = false;
+
+public:
+  psImplicitKDTree() {}
+
+  template <class ValueType>
+  psImplicitKDTree(const std::vector<ValueType> &passedPoints) {
+    setPoints(passedPoints);
+  }
+
+  template <class ValueType>
+  void setPoints(const std::vector<ValueType> &passedPoints,
+                 const std::vector<NumericType> &passedScalingFactors = {}) {
+    built = false;
+    if (passedPoints.empty()) {
+      psLogger::getInstance()
+          .addWarning("psImplicitKDTree: the provided points vector is empty.")
+          .print();
+      return;
+    }
+
+    squaredScalingFactors.fill(1.);
+    if (!passedScalingFactors.empty()) {
+      assert(passedScalingFactors.size() == D &&
+             "The provided scaling factors have a different dimensionality "
+             "than the data.");
+      for (SizeType axis = 0; axis < D; ++axis)
+        squaredScalingFactors[axis] =
+            passedScalingFactors[axis] * passedScalingFactors[axis];
+    }
+
+    const auto numPoints = static_cast<long>(passedPoints.size());
+    for (auto &values : coordinates)
+      values.resize(passedPoints.size());
+    indices.resize(passedPoints.size());
+#pragma omp parallel for
+    for (long i = 0; i < numPoints; ++i) {
+      const auto pointIdx = static_cast<SizeType>(i);
+      for (SizeType axis = 0; axis < D; ++axis)
+        coordinates[axis][pointIdx] = passedPoints[pointIdx][axis];
+      indices[pointIdx] = pointIdx;
+    }
+  }
+
+  void build() {
+    if (indices.empty()) {
+      psLogger::getInstance()
+          .addWarning("psImplicitKDTree: No points provided!")
+          .print();
+      return;
+    }
+
+    const auto numPoints = static_cast<long>(indices.size());
+    if (built) {
+      // Restore the order of the input points
+      for (auto &values : coordinates) {
+        std::vector<NumericType> original(indices.size());
+#pragma omp parallel for
+        for (long i = 0; i < numPoints; ++i) {
+          const auto position = static_cast<SizeType>(i);
+          original[indices[position]] = values[position];
+        }
+        values.swap(original);
+      }
+    }
+
+    // Sort the original indices into tree order, then reorder the
+    // coordinates accordingly
+    std::iota(indices.begin(), indices.end(), SizeType(0));
+#pragma omp parallel
+    {
+#pragma omp single
+      build(0, indices.size(), 0);
+    }
+
+    for (auto &values : coordinates) {
+      std::vector<NumericType> sorted(indices.size());
+#pragma omp parallel for
+      for (long i = 0; i < numPoints; ++i) {
+        const auto position = static_cast<SizeType>(i);
+        sorted[position] = values[indices[position]];
+      }
+      values.swap(sorted);
+    }
+    built = true;
+  }
+
+  [[nodiscard]] SizeType size() const { return indices.size(); }
+
+  [[nodiscard]] std::optional<std::pair<SizeType, NumericType>>
+  findNearest(const PointType &x) const {
+    if (!built)
+      return {};
+
+    auto best = std::pair{std::numeric_limits<NumericType>::infinity(),
+                          SizeType(0)};
+    traverse(x, [&](const SizeType position, const NumericType distance) {
+      if (distance < best.first)
+        best = {distance, position};
+      return best.first;
+    });
+    return std::pair{indices[best.second], std::sqrt(best.first)};
+  }
+
+  [[nodiscard]] std::optional<std::vector<std::pair<SizeType, NumericType>>>
+  findKNearest(const PointType &x, const int k) const {
+    auto result = std::vector<std::pair<SizeType, NumericType>>();
+    if (!findKNearest(x, k, result))
+      return {};
+    return result;
+  }
+
+  // The k nearest neighbors sorted by distance are written to result.
+  // Repeated queries with the same result vector do not allocate memory.
+  bool
+  findKNearest(const PointType &x, const int k,
+               std::vector<std::pair<SizeType, NumericType>> &result) const {
+    result.clear();
+    if (!built)
+      return false;
+
+    auto queue = psBoundedPQueue<NumericType, SizeType>(
+        static_cast<SizeType>(std::max(k, 0)), getQueueStorage());
+    traverse(x, [&](const SizeType position, const NumericType distance) {
+      queue.enqueue({distance, position});
+      return queue.size() < queue.maxSize()
+                 ? std::numeric_limits<NumericType>::infinity()
+                 : queue.worst();
+    });
+    for (const auto &[squaredDistance, position] : queue.sortedItems())
+      result.emplace_back(indices[position], std::sqrt(squaredDistance));
+    return true;
+  }
+
+  [[nodiscard]] std::optional<std::vector<std::pair<SizeType, NumericType>>>
+  findNearestWithinRadius(const PointType &x, const NumericType radius) const {
+    auto result = std::vector<std::pair<SizeType, NumericType>>();
+    if (!findNearestWithinRadius(x, radius, result))
+      return {};
+    return result;
+  }
+
+  // All neighbors within the radius sorted by distance are written to result.
+  bool findNearestWithinRadius(
+      const PointType &x, const NumericType radius,
+      std::vector<std::pair<SizeType, NumericType>> &result) const {
+    result.clear();
+    if (!built)
+      return false;
+
+    const auto squaredRadius = radius * radius;
+    auto queue = psClampedPQueue<NumericType, SizeType>(squaredRadius,
+                                                        getQueueStorage());
+    traverse(x, [&](const SizeType position, const NumericType distance) {
+      queue.enqueue({distance, position});
+      // also visit ranges exactly at the radius
+      return std::nextafter(squaredRadius,
+                            std::numeric_limits<NumericType>::infinity());
+    });
+    for (const auto &[squaredDistance, position] : queue.sortedItems())
+      result.emplace_back(indices[position], std::sqrt(squaredDistance));
+    return true;
+  }
+
+private:
+  void build(const SizeType begin, const SizeType end, const SizeType depth) {
+    if (end - begin <= leafSize)
+      return;
+
+    const auto mid = begin + (end - begin) / 2;
+    const auto &values = coordinates[depth % D];
+    auto *treeIndices = indices.data();
+    std::nth_element(
+        treeIndices + begin, treeIndices + mid, treeIndices + end,
+        [&values](SizeType a, SizeType b) { return values[a] < values[b]; });
+
+#pragma omp task if (end - begin > 10000)
+    build(begin, mid, depth + 1);
+    build(mid + 1, end, depth + 1);
+#pragma omp taskwait
+  }
+
+  // Visit all points which can be closer than the current search radius.
+  // visit(position, squaredDistance) is called for each point and returns the
+  // squared search radius.
+  template <class VisitorType>
+  void traverse(const PointType &x, VisitorType &&visit) const {
+    std::array<StackEntry, maxStackSize> stack;
+    SizeType stackSize = 0;
+    stack[stackSize++] = {0, indices.size(), 0, 0.};
+    auto searchRadius = std::numeric_limits<NumericType>::infinity();
+
+    while (stackSize > 0) {
+      const auto entry = stack[--stackSize];
+      if (!(entry.bound < searchRadius))
+        continue;
+
+      if (entry.end - entry.begin <= leafSize) {
+        std::array<NumericType, leafSize> distances;
+        const auto numPoints = entry.end - entry.begin;
+        squaredDistances(x, entry.begin, numPoints, distances.data());
+        for (SizeType i = 0; i < numPoints; ++i) {
+          if (distances[i] < searchRadius)
+            searchRadius = visit(entry.begin + i, distances[i]);
+        }
+        continue;
+      }
+
+      const auto mid = entry.begin + (entry.end - entry.begin) / 2;
+      const auto axis = entry.depth % D;
+      const auto distance = squaredDistance(x, mid);
+      if (distance < searchRadius)
+        searchRadius = visit(mid, distance);
+
+      // Far side first, so that the near side is searched first
+      const auto difference = x[axis] - coordinates[axis][mid];
+      const auto planeDistance =
+          squaredScalingFactors[axis] * difference * difference;
+      const auto farBound = std::max(entry.bound, planeDistance);
+      const StackEntry left = {entry.begin, mid, entry.depth + 1,
+                               difference < 0 ? entry.bound : farBound};
+      const StackEntry right = {mid + 1, entry.end, entry.depth + 1,
+                                difference < 0 ? farBound : entry.bound};
+      if (difference < 0) {
+        stack[stackSize++] = right;
+        stack[stackSize++] = left;
+      } else {
+        stack[stackSize++] = left;
+        stack[stackSize++] = right;
+      }
+    }
+  }
+
+  [[nodiscard]] NumericType squaredDistance(const PointType &x,
+                                            const SizeType position) const {
+    return squaredDistance(x, position, std::make_index_sequence<D>{});
+  }
+
+  // Unrolled over the axes
+  template <SizeType... Axes>
+  [[nodiscard]] NumericType
+  squaredDistance(const PointType &x, const SizeType position,
+                  std::index_sequence<Axes...>) const {
+    return ((squaredScalingFactors[Axes] *
+             (x[Axes] - coordinates[Axes][position]) *
+             (x[Axes] - coordinates[Axes][position])) +
+            ...);
+  }
+
+  // Squared distances to consecutive points. The points are stored
+  // coordinate by coordinate, so the loop over the points vectorizes.
+  void squaredDistances(const PointType &x, const SizeType begin,
+                        const SizeType numPoints,
+                        NumericType *distances) const {
+    for (SizeType i = 0; i < numPoints; ++i)
+      distances[i] = 0.;
+    for (SizeType axis = 0; axis < D; ++axis) {
+      const auto *values = coordinates[axis].data() + begin;
+      const auto scaling = squaredScalingFactors[axis];
+      const auto coordinate = x[axis];
+#pragma omp simd
+      for (SizeType i = 0; i < numPoints; ++i) {
+        const auto difference = coordinate - values[i];
+        distances[i] += scaling * difference * difference;
+      }
+    }
+  }
+
+  // Storage of the queues of the kNN and radius queries, one per thread
+  static std::vector<std::pair<NumericType, SizeType>> &getQueueStorage() {
+    static thread_local std::vector<std::pair<NumericType, SizeType>> storage;
+    return storage;
+  }
+};
+
+#endif
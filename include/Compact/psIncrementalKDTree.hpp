@@ -0,0 +1,494 @@
+#ifndef PS_INCREMENTAL_KDTREE_HPP
+#define PS_INCREMENTAL_KDTREE_HPP
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include <psLogger.hpp>
+#include <psQueues.hpp>
+
+/**
+  Spatial index for points which move slowly or change in small batches,
+  e.g. the surface points between two time steps. The splitting planes of a
+  kD-tree are fixed at build time and the points are kept in buckets at the
+  leaves. Each node stores the bounding box of the points below it and the
+  queries prune by these boxes, so they stay exact when points move across
+  the splitting planes or the tree is unbalanced. Inserting, removing and
+  moving points only updates the affected buckets and boxes. A full rebuild
+  happens only when the tree quality degrades, i.e. when a bucket holds far
+  more points than intended or the number of points changed so much that
+  the depth of the tree does not fit anymore.
+
+  Points are identified by the index they were given in setPoints or the id
+  returned by insert.
+*/
+template <class NumericType, std::size_t D> class psIncrementalKDTree {
+public:
+  using SizeType = std::size_t;
+  using PointType = std::array<NumericType, D>;
+
+private:
+  // Intended number of points per bucket
+  static constexpr SizeType leafSize = 16;
+  // Rebuild if a bucket holds more than this many times the intended size
+  static constexpr SizeType maxLeafFactor = 8;
+  static constexpr SizeType invalid = std::numeric_limits<SizeType>::max();
+
+  struct Entry {
+    PointType point;
+    SizeType id;
+  };
+
+  struct Box {
+    PointType minimum;
+    PointType maximum;
+  };
+
+  int depth = 0;
+  // splitting coordinate of each inner node, the axis is the depth modulo D
+  std::vector<NumericType> splits;
+  // bounding boxes of all nodes, the leaves are stored last
+  std::vector<Box> boxes;
+  std::vector<std::vector<Entry>> buckets;
+  // bucket and position in the bucket of each point id
+  std::vector<std::pair<SizeType, SizeType>> locations;
+  SizeType numberOfPoints = 0;
+  SizeType numberOfRebuilds = 0;
+  // (1 + epsilon)^2 of the approximate search
+  NumericType pruningFactor = 1.;
+
+public:
+  psIncrementalKDTree() {}
+
+  // Replace all points. The ids of the points are their indices. The
+  // existing splitting planes are reused unless the tree quality degrades.
+  void setPoints(const std::vector<PointType> &passedPoints) {
+    if (passedPoints.empty()) {
+      psLogger::getInstance()
+          .addWarning(
+              "psIncrementalKDTree: the provided points vector is empty.")
+          .print();
+      return;
+    }
+
+    numberOfPoints = passedPoints.size();
+    if (buckets.empty()) {
+      build(passedPoints);
+      return;
+    }
+
+    const auto leaves = findLeaves(passedPoints);
+    if (!distribute(passedPoints, leaves))
+      build(passedPoints);
+  }
+
+  // Add points and return the id of the first one, the ids of the other
+  // points follow consecutively.
+  SizeType insert(const std::vector<PointType> &passedPoints) {
+    const SizeType firstId = locations.size();
+    if (passedPoints.empty())
+      return firstId;
+
+    if (buckets.empty()) {
+      numberOfPoints = passedPoints.size();
+      build(passedPoints);
+      return firstId;
+    }
+
+    const auto leaves = findLeaves(passedPoints);
+    for (SizeType i = 0; i < passedPoints.size(); ++i) {
+      locations.emplace_back(leaves[i], buckets[leaves[i]].size());
+      buckets[leaves[i]].push_back({passedPoints[i], firstId + i});
+      expandBox(leaves[i], passedPoints[i]);
+    }
+    numberOfPoints += passedPoints.size();
+
+    if (!checkQuality(leaves))
+      rebuild();
+    return firstId;
+  }
+
+  // Remove the points with the given ids
+  void remove(const std::vector<SizeType> &ids) {
+    std::vector<SizeType> leaves;
+    leaves.reserve(ids.size());
+    for (const auto id : ids) {
+      if (id >= locations.size() || locations[id].first == invalid)
+        continue;
+      leaves.push_back(locations[id].first);
+      removeEntry(id);
+      --numberOfPoints;
+    }
+    refit(leaves);
+
+    if (numberOfPoints > 0 && !checkQuality({}))
+      rebuild();
+  }
+
+  // Move the points with the given ids to new positions
+  void move(const std::vector<SizeType> &ids,
+            const std::vector<PointType> &positions) {
+    if (buckets.empty())
+      return;
+
+    const auto leaves = findLeaves(positions);
+    std::vector<SizeType> changedLeaves;
+    changedLeaves.reserve(ids.size());
+    for (SizeType i = 0; i < ids.size(); ++i) {
+      const auto id = ids[i];
+      if (id >= locations.size() || locations[id].first == invalid)
+        continue;
+
+      const auto [leaf, position] = locations[id];
+      changedLeaves.push_back(leaf);
+      if (leaf == leaves[i]) {
+        buckets[leaf][position].point = positions[i];
+      } else {
+        removeEntry(id);
+        locations[id] = {leaves[i], buckets[leaves[i]].size()};
+        buckets[leaves[i]].push_back({positions[i], id});
+        changedLeaves.push_back(leaves[i]);
+      }
+    }
+    refit(changedLeaves);
+
+    if (!checkQuality(changedLeaves))
+      rebuild();
+  }
+
+  // Approximate search: the distance of the neighbors found is at most
+  // (1 + epsilon) times the exact one. Zero gives the exact search.
+  void setEpsilon(const NumericType epsilon) {
+    pruningFactor = (1 + epsilon) * (1 + epsilon);
+  }
+
+  [[nodiscard]] SizeType size() const { return numberOfPoints; }
+
+  // Number of full rebuilds since construction
+  [[nodiscard]] SizeType getNumberOfRebuilds() const {
+    return numberOfRebuilds;
+  }
+
+  [[nodiscard]] std::optional<std::pair<SizeType, NumericType>>
+  findNearest(const PointType &x) const {
+    if (numberOfPoints == 0)
+      return {};
+
+    auto best = std::pair{std::numeric_limits<NumericType>::infinity(),
+                          SizeType(0)};
+    traverse(x, [&](const Entry &entry, const NumericType distance) {
+      if (distance < best.first)
+        best = {distance, entry.id};
+      return best.first;
+    });
+    return std::pair{best.second, std::sqrt(best.first)};
+  }
+
+  // The k nearest neighbors sorted by distance are written to result
+  bool
+  findKNearest(const PointType &x, const int k,
+               std::vector<std::pair<SizeType, NumericType>> &result) const {
+    result.clear();
+    if (numberOfPoints == 0)
+      return false;
+
+    const SizeType numNeighbors = k > 0 ? static_cast<SizeType>(k) : 0;
+    auto queue = psBoundedPQueue<NumericType, SizeType>(numNeighbors,
+                                                        getQueueStorage());
+    traverse(x, [&](const Entry &entry, const NumericType distance) {
+      queue.enqueue({distance, entry.id});
+      return queue.size() < queue.maxSize()
+                 ? std::numeric_limits<NumericType>::infinity()
+                 : queue.worst();
+    });
+    for (const auto &[squaredDistance, id] : queue.sortedItems())
+      result.emplace_back(id, std::sqrt(squaredDistance));
+    return true;
+  }
+
+private:
+  SizeType numberOfLeaves() const { return SizeType(1) << depth; }
+
+  SizeType firstLeafNode() const { return numberOfLeaves() - 1; }
+
+  // Depth at which the buckets hold about leafSize points
+  static int idealDepth(const SizeType numPoints) {
+    int result = 0;
+    while ((numPoints >> result) > leafSize)
+      ++result;
+    return result;
+  }
+
+  void rebuild() {
+    std::vector<PointType> points(locations.size());
+    std::vector<SizeType> ids;
+    ids.reserve(numberOfPoints);
+    for (const auto &bucket : buckets) {
+      for (const auto &entry : bucket) {
+        points[entry.id] = entry.point;
+        ids.push_back(entry.id);
+      }
+    }
+    build(points, ids);
+  }
+
+  void build(const std::vector<PointType> &points) {
+    std::vector<SizeType> ids(points.size());
+    std::iota(ids.begin(), ids.end(), SizeType(0));
+    build(points, ids);
+  }
+
+  // Place the splitting planes at the medians of the points with the ids
+  void build(const std::vector<PointType> &points,
+             std::vector<SizeType> ids) {
+    ++numberOfRebuilds;
+    depth = idealDepth(ids.size());
+    splits.assign(firstLeafNode(), 0.);
+#pragma omp parallel
+    {
+#pragma omp single
+      findSplits(points, ids, 0, ids.size(), 0, 0);
+    }
+
+    std::vector<SizeType> leaves(points.size(), invalid);
+#pragma omp parallel for
+    for (long i = 0; i < static_cast<long>(ids.size()); ++i)
+      leaves[ids[static_cast<SizeType>(i)]] =
+          findLeaf(points[ids[static_cast<SizeType>(i)]]);
+
+    buckets.assign(numberOfLeaves(), {});
+    locations.assign(points.size(), {invalid, 0});
+    for (const auto id : ids) {
+      locations[id] = {leaves[id], buckets[leaves[id]].size()};
+      buckets[leaves[id]].push_back({points[id], id});
+    }
+    refitAll();
+  }
+
+  void findSplits(const std::vector<PointType> &points,
+                  std::vector<SizeType> &ids, const SizeType begin,
+                  const SizeType end, const SizeType node, const int level) {
+    if (level == depth)
+      return;
+
+    const auto axis = static_cast<SizeType>(level) % D;
+
+    const auto mid = begin + (end - begin) / 2;
+    if (mid < end) {
+      std::nth_element(ids.data() + begin, ids.data() + mid,
+                       ids.data() + end, [&](SizeType a, SizeType b) {
+                         return points[a][axis] < points[b][axis];
+                       });
+      splits[node] = points[ids[mid]][axis];
+    } else {
+      splits[node] = 0.;
+    }
+
+#pragma omp task shared(points, ids) if (end - begin > 10000)
+    findSplits(points, ids, begin, mid, 2 * node + 1, level + 1);
+    findSplits(points, ids, mid, end, 2 * node + 2, level + 1);
+#pragma omp taskwait
+  }
+
+  SizeType findLeaf(const PointType &point) const {
+    SizeType node = 0;
+    for (int level = 0; level < depth; ++level) {
+      const auto axis = static_cast<SizeType>(level) % D;
+      node = point[axis] < splits[node] ? 2 * node + 1 : 2 * node + 2;
+    }
+    return node - firstLeafNode();
+  }
+
+  std::vector<SizeType> findLeaves(const std::vector<PointType> &points) const {
+    std::vector<SizeType> leaves(points.size());
+#pragma omp parallel for
+    for (long i = 0; i < static_cast<long>(points.size()); ++i)
+      leaves[static_cast<SizeType>(i)] =
+          findLeaf(points[static_cast<SizeType>(i)]);
+    return leaves;
+  }
+
+  // Put all points into the existing buckets. Returns false if the tree
+  // quality is too low, then nothing is changed.
+  bool distribute(const std::vector<PointType> &points,
+                  const std::vector<SizeType> &leaves) {
+    if (std::abs(idealDepth(points.size()) - depth) > 1)
+      return false;
+
+    std::vector<SizeType> counts(numberOfLeaves(), 0);
+    for (const auto leaf : leaves)
+      ++counts[leaf];
+    if (*std::max_element(counts.begin(), counts.end()) >
+        maxLeafFactor * leafSize)
+      return false;
+
+    for (SizeType leaf = 0; leaf < numberOfLeaves(); ++leaf) {
+      buckets[leaf].clear();
+      buckets[leaf].reserve(counts[leaf]);
+    }
+    locations.resize(points.size());
+    for (SizeType i = 0; i < points.size(); ++i) {
+      locations[i] = {leaves[i], buckets[leaves[i]].size()};
+      buckets[leaves[i]].push_back({points[i], i});
+    }
+    refitAll();
+    return true;
+  }
+
+  // Check the buckets which changed and the depth of the tree
+  bool checkQuality(const std::vector<SizeType> &changedLeaves) const {
+    if (std::abs(idealDepth(numberOfPoints) - depth) > 1)
+      return false;
+    for (const auto leaf : changedLeaves) {
+      if (buckets[leaf].size() > maxLeafFactor * leafSize)
+        return false;
+    }
+    return true;
+  }
+
+  void removeEntry(const SizeType id) {
+    const auto [leaf, position] = locations[id];
+    auto &bucket = buckets[leaf];
+    bucket[position] = bucket.back();
+    locations[bucket[position].id].second = position;
+    bucket.pop_back();
+    locations[id] = {invalid, 0};
+  }
+
+  static Box emptyBox() {
+    Box box;
+    box.minimum.fill(std::numeric_limits<NumericType>::infinity());
+    box.maximum.fill(-std::numeric_limits<NumericType>::infinity());
+    return box;
+  }
+
+  static void merge(Box &box, const Box &other) {
+    for (SizeType axis = 0; axis < D; ++axis) {
+      box.minimum[axis] = std::min(box.minimum[axis], other.minimum[axis]);
+      box.maximum[axis] = std::max(box.maximum[axis], other.maximum[axis]);
+    }
+  }
+
+  Box leafBox(const SizeType leaf) const {
+    auto box = emptyBox();
+    for (const auto &entry : buckets[leaf])
+      merge(box, {entry.point, entry.point});
+    return box;
+  }
+
+  void refitAll() {
+    boxes.resize(2 * numberOfLeaves() - 1);
+    const auto offset = firstLeafNode();
+#pragma omp parallel for
+    for (long i = 0; i < static_cast<long>(numberOfLeaves()); ++i) {
+      const auto leaf = static_cast<SizeType>(i);
+      boxes[offset + leaf] = leafBox(leaf);
+    }
+    for (auto node = offset; node-- > 0;) {
+      boxes[node] = boxes[2 * node + 1];
+      merge(boxes[node], boxes[2 * node + 2]);
+    }
+  }
+
+  // Recompute the boxes of the leaves and their ancestors
+  void refit(std::vector<SizeType> leaves) {
+    std::sort(leaves.begin(), leaves.end());
+    leaves.erase(std::unique(leaves.begin(), leaves.end()), leaves.end());
+    std::vector<SizeType> nodes;
+    nodes.reserve(leaves.size());
+    for (const auto leaf : leaves) {
+      boxes[firstLeafNode() + leaf] = leafBox(leaf);
+      nodes.push_back(firstLeafNode() + leaf);
+    }
+
+    // one level up at a time, so that each node is updated once
+    for (int level = 0; level < depth; ++level) {
+      for (auto &node : nodes)
+        node = (node - 1) / 2;
+      nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+      for (const auto node : nodes) {
+        boxes[node] = boxes[2 * node + 1];
+        merge(boxes[node], boxes[2 * node + 2]);
+      }
+    }
+  }
+
+  void expandBox(const SizeType leaf, const PointType &point) {
+    auto node = firstLeafNode() + leaf;
+    while (true) {
+      merge(boxes[node], {point, point});
+      if (node == 0)
+        break;
+      node = (node - 1) / 2;
+    }
+  }
+
+  static NumericType squaredDistance(const PointType &x, const Box &box) {
+    NumericType distance = 0.;
+    for (SizeType axis = 0; axis < D; ++axis) {
+      const auto difference =
+          std::max({box.minimum[axis] - x[axis], NumericType(0),
+                    x[axis] - box.maximum[axis]});
+      distance += difference * difference;
+    }
+    return distance;
+  }
+
+  static NumericType squaredDistance(const PointType &x, const PointType &y) {
+    NumericType distance = 0.;
+    for (SizeType axis = 0; axis < D; ++axis)
+      distance += (x[axis] - y[axis]) * (x[axis] - y[axis]);
+    return distance;
+  }
+
+  // Visit all points which can be closer than the current search radius.
+  // visit(entry, squaredDistance) returns the squared search radius.
+  template <class VisitorType>
+  void traverse(const PointType &x, VisitorType &&visit) const {
+    std::array<std::pair<SizeType, NumericType>, 64> stack;
+    SizeType stackSize = 0;
+    stack[stackSize++] = {0, squaredDistance(x, boxes[0])};
+    auto searchRadius = std::numeric_limits<NumericType>::infinity();
+
+    while (stackSize > 0) {
+      const auto [node, bound] = stack[--stackSize];
+      if (!(pruningFactor * bound < searchRadius))
+        continue;
+
+      if (node >= firstLeafNode()) {
+        for (const auto &entry : buckets[node - firstLeafNode()]) {
+          const auto distance = squaredDistance(x, entry.point);
+          if (distance < searchRadius)
+            searchRadius = visit(entry, distance);
+        }
+        continue;
+      }
+
+      // the closer child is searched first
+      const auto left = 2 * node + 1;
+      const auto right = 2 * node + 2;
+      const auto leftBound = squaredDistance(x, boxes[left]);
+      const auto rightBound = squaredDistance(x, boxes[right]);
+      if (leftBound < rightBound) {
+        stack[stackSize++] = {right, rightBound};
+        stack[stackSize++] = {left, leftBound};
+      } else {
+        stack[stackSize++] = {left, leftBound};
+        stack[stackSize++] = {right, rightBound};
+      }
+    }
+  }
+
+  static std::vector<std::pair<NumericType, SizeType>> &getQueueStorage() {
+    static thread_local std::vector<std::pair<NumericType, SizeType>> storage;
+    return storage;
+  }
+};
+
+#endif
@@ -29,9 +29,13 @@
 // ---------------------- END ORIGINAL COPYRIGHT NOTICE ----------------------//
 
 #include <algorithm>
+#include <array>
 #include <cassert>
+#include <cmath>
+#include <cstdint>
 #include <iostream>
 #include <iterator>
+#include <limits>
 #include <memory>
 #include <optional>
 #include <vector>
@@ -55,6 +59,10 @@ class psKDTree {
 
   Node *rootNode = nullptr;
 
+  // (1 + epsilon)^2 of the approximate search
+  NumericType pruningFactor = 1.;
+  SizeType maxVisitedNodes = std::numeric_limits<SizeType>::max();
+
 public:
   psKDTree() {}
 
@@ -114,6 +122,22 @@ public:
     }
   }
 
+  // Approximate search: a subtree is only searched if it can contain points
+  // which are closer than the current best distance divided by
+  // (1 + epsilon). The distance of the neighbors found by findNearest and
+  // findKNearest is then at most (1 + epsilon) times the exact one. Radius
+  // queries stay exact. The default of zero gives the exact search.
+  void setEpsilon(const NumericType epsilon) {
+    pruningFactor = (1 + epsilon) * (1 + epsilon);
+  }
+
+  // Stop the kNN search after the given number of nodes (points) were
+  // visited, the neighbors found so far are returned. Should be larger than
+  // the depth of the tree plus k. Unlimited by default.
+  void setMaxVisitedNodes(const SizeType passedMaxVisitedNodes) {
+    maxVisitedNodes = passedMaxVisitedNodes;
+  }
+
   [[nodiscard]] std::optional<std::pair<SizeType, NumericType>>
   findNearest(const ValueType &x) const {
     if (!rootNode)
@@ -127,38 +151,187 @@ public:
 
   [[nodiscard]] std::optional<std::vector<std::pair<SizeType, NumericType>>>
   findKNearest(const ValueType &x, const int k) const {
-    if (!rootNode)
+    auto result = std::vector<std::pair<SizeType, NumericType>>();
+    if (!findKNearest(x, k, result))
       return {};
+    return result;
+  }
 
-    auto queue = psBoundedPQueue<NumericType, Node *>(k);
-    traverseDown(rootNode, queue, x);
+  // The k nearest neighbors sorted by distance are written to result. The
+  // capacity of result is reused, so repeated queries with the same vector
+  // do not allocate memory. Returns false if the tree was not built.
+  bool
+  findKNearest(const ValueType &x, const int k,
+               std::vector<std::pair<SizeType, NumericType>> &result) const {
+    result.clear();
+    if (!rootNode)
+      return false;
+
+    auto queue = psBoundedPQueue<NumericType, Node *>(
+        static_cast<SizeType>(std::max(k, 0)), getQueueStorage());
+    SizeType visitedNodes = 0;
+    traverseDown(rootNode, queue, x, visitedNodes);
+    for (const auto &[squaredDistance, node] : queue.sortedItems())
+      result.emplace_back(node->index, std::sqrt(squaredDistance));
+    return true;
+  }
 
+  [[nodiscard]] std::optional<std::vector<std::pair<SizeType, NumericType>>>
+  findNearestWithinRadius(const ValueType &x, const NumericType radius) const {
     auto result = std::vector<std::pair<SizeType, NumericType>>();
-    result.reserve(k);
+    if (!findNearestWithinRadius(x, radius, result))
+      return {};
+    return result;
+  }
 
-    while (!queue.empty()) {
-      auto best = queue.dequeueBest();
-      result.emplace_back(best->index, Distance(x, best->value));
+  // All neighbors within the radius sorted by distance are written to result.
+  // As for findKNearest, reusing result avoids allocations.
+  bool findNearestWithinRadius(
+      const ValueType &x, const NumericType radius,
+      std::vector<std::pair<SizeType, NumericType>> &result) const {
+    result.clear();
+    if (!rootNode)
+      return false;
+
+    auto queue = psClampedPQueue<NumericType, Node *>(radius * radius,
+                                                      getQueueStorage());
+    SizeType visitedNodes = 0;
+    traverseDown(rootNode, queue, x, visitedNodes);
+    for (const auto &[squaredDistance, node] : queue.sortedItems())
+      result.emplace_back(node->index, std::sqrt(squaredDistance));
+    return true;
+  }
+
+  /****************************************************************************
+   * Batch Queries                                                            *
+   ****************************************************************************/
+  // The batch queries process all query points in parallel. The points are
+  // sorted in Morton order first, so that consecutive queries of a thread
+  // visit the same parts of the tree. The results are written to flat arrays
+  // in the order of the query points.
+
+  // Index and distance of the nearest neighbor of each query point
+  void findNearestBatch(const std::vector<ValueType> &points,
+                        std::vector<SizeType> &indices,
+                        std::vector<NumericType> &distances) const {
+    indices.assign(points.size(), std::numeric_limits<SizeType>::max());
+    distances.assign(points.size(),
+                     std::numeric_limits<NumericType>::infinity());
+    if (!rootNode)
+      return;
+
+    const auto order = getQueryOrder(points);
+    const auto numQueries = static_cast<long>(points.size());
+#pragma omp parallel for schedule(dynamic, batchChunkSize)
+    for (long i = 0; i < numQueries; ++i) {
+      const auto queryIdx = order[static_cast<SizeType>(i)];
+      auto best =
+          std::pair{std::numeric_limits<NumericType>::infinity(), rootNode};
+      traverseDown(rootNode, best, points[queryIdx]);
+      indices[queryIdx] = best.second->index;
+      distances[queryIdx] = std::sqrt(best.first);
     }
-    return result;
   }
 
-  [[nodiscard]] std::optional<std::vector<std::pair<SizeType, NumericType>>>
-  findNearestWithinRadius(const ValueType &x, const NumericType radius) const {
+  // The k nearest neighbors of each query point, sorted by distance. The
+  // neighbors of query i are stored at i * k to (i + 1) * k - 1. If the tree
+  // holds less than k points the remaining entries are set to the maximum
+  // index and an infinite distance.
+  void findKNearestBatch(const std::vector<ValueType> &points, const int k,
+                         std::vector<SizeType> &indices,
+                         std::vector<NumericType> &distances) const {
+    const SizeType numNeighbors = k > 0 ? static_cast<SizeType>(k) : 0;
+    indices.assign(points.size() * numNeighbors,
+                   std::numeric_limits<SizeType>::max());
+    distances.assign(points.size() * numNeighbors,
+                     std::numeric_limits<NumericType>::infinity());
+    if (!rootNode || numNeighbors == 0)
+      return;
+
+    const auto order = getQueryOrder(points);
+    const auto numQueries = static_cast<long>(points.size());
+#pragma omp parallel for schedule(dynamic, batchChunkSize)
+    for (long i = 0; i < numQueries; ++i) {
+      const auto queryIdx = order[static_cast<SizeType>(i)];
+      auto queue = psBoundedPQueue<NumericType, Node *>(numNeighbors,
+                                                        getQueueStorage());
+      SizeType visitedNodes = 0;
+      traverseDown(rootNode, queue, points[queryIdx], visitedNodes);
+
+      auto offset = queryIdx * numNeighbors;
+      for (const auto &[squaredDistance, node] : queue.sortedItems()) {
+        indices[offset] = node->index;
+        distances[offset] = std::sqrt(squaredDistance);
+        ++offset;
+      }
+    }
+  }
+
+  // All neighbors within the radius of each query point, sorted by
+  // distance. The neighbors of query i are stored from offsets[i] to
+  // offsets[i + 1] - 1.
+  void findNearestWithinRadiusBatch(const std::vector<ValueType> &points,
+                                    const NumericType radius,
+                                    std::vector<SizeType> &offsets,
+                                    std::vector<SizeType> &indices,
+                                    std::vector<NumericType> &distances) const {
+    offsets.assign(points.size() + 1, 0);
+    indices.clear();
+    distances.clear();
     if (!rootNode)
-      return {};
+      return;
 
-    auto queue = psClampedPQueue<NumericType, Node *>(radius);
-    traverseDown(rootNode, queue, x);
+    const auto order = getQueryOrder(points);
+    const auto numQueries = static_cast<long>(points.size());
 
-    auto result = std::vector<std::pair<SizeType, NumericType>>();
-    result.reserve(queue.size());
+    // Each thread collects its results in its own buffer. The position of
+    // the results of each query is recorded, so that they can be copied to
+    // the output arrays in the order of the query points.
+    std::vector<std::vector<std::pair<SizeType, NumericType>>> threadResults;
+    std::vector<std::pair<SizeType, SizeType>> resultPosition(points.size());
+#pragma omp parallel
+    {
+      SizeType threadId = 0;
+#ifdef _OPENMP
+      threadId = static_cast<SizeType>(omp_get_thread_num());
+#pragma omp single
+      threadResults.resize(static_cast<SizeType>(omp_get_num_threads()));
+#else
+      threadResults.resize(1);
+#endif
+      auto &results = threadResults[threadId];
+
+#pragma omp for schedule(dynamic, batchChunkSize)
+      for (long i = 0; i < numQueries; ++i) {
+        const auto queryIdx = order[static_cast<SizeType>(i)];
+        auto queue = psClampedPQueue<NumericType, Node *>(radius * radius,
+                                                          getQueueStorage());
+        SizeType visitedNodes = 0;
+        traverseDown(rootNode, queue, points[queryIdx], visitedNodes);
+
+        resultPosition[queryIdx] = {threadId, results.size()};
+        offsets[queryIdx + 1] = queue.size();
+        for (const auto &[squaredDistance, node] : queue.sortedItems())
+          results.emplace_back(node->index, std::sqrt(squaredDistance));
+      }
+    }
 
-    while (!queue.empty()) {
-      auto best = queue.dequeueBest();
-      result.emplace_back(best->index, Distance(x, best->value));
+    for (SizeType i = 0; i < points.size(); ++i)
+      offsets[i + 1] += offsets[i];
+    indices.resize(offsets.back());
+    distances.resize(offsets.back());
+
+#pragma omp parallel for
+    for (long i = 0; i < numQueries; ++i) {
+      const auto queryIdx = static_cast<SizeType>(i);
+      const auto &results = threadResults[resultPosition[queryIdx].first];
+      auto resultIdx = resultPosition[queryIdx].second;
+      for (auto j = offsets[queryIdx]; j < offsets[queryIdx + 1];
+           ++j, ++resultIdx) {
+        indices[j] = results[resultIdx].first;
+        distances[j] = results[resultIdx].second;
+      }
     }
-    return result;
   }
 
   void build() {
@@ -314,7 +487,7 @@ private:
     auto distanceToHyperplane =
         scalingFactors[axis] * std::abs(x[axis] - currentNode->value[axis]);
     distanceToHyperplane *= distanceToHyperplane;
-    if (distanceToHyperplane < best.first) {
+    if (pruningFactor * distanceToHyperplane < best.first) {
       if (isLeft)
         traverseDown(currentNode->right, best, x);
       else
@@ -327,12 +500,18 @@ private:
             typename = std::enable_if_t<
                 std::is_same_v<Q, psBoundedPQueue<NumericType, Node *>> ||
                 std::is_same_v<Q, psClampedPQueue<NumericType, Node *>>>>
-  void traverseDown(Node *currentNode, Q &queue,
-                    const std::vector<NumericType> &x) const {
+  void traverseDown(Node *currentNode, Q &queue, const ValueType &x,
+                    SizeType &visitedNodes) const {
     if (currentNode == nullptr)
       return;
 
-    int axis = currentNode->axis;
+    if constexpr (std::is_same_v<Q, psBoundedPQueue<NumericType, Node *>>) {
+      if (visitedNodes >= maxVisitedNodes)
+        return;
+      ++visitedNodes;
+    }
+
+    auto axis = currentNode->axis;
 
     // For distance comparison operations we only use the squared distance which
     // is less compute intensive, but order preserving version of the distance
@@ -342,10 +521,10 @@ private:
 
     bool isLeft;
     if (x[axis] < currentNode->value[axis]) {
-      traverseDown(currentNode->left, queue, x);
+      traverseDown(currentNode->left, queue, x, visitedNodes);
       isLeft = true;
     } else {
-      traverseDown(currentNode->right, queue, x);
+      traverseDown(currentNode->right, queue, x, visitedNodes);
       isLeft = false;
     }
 
@@ -360,17 +539,17 @@ private:
     bool intersects = false;
     if constexpr (std::is_same_v<Q, psBoundedPQueue<NumericType, Node *>>) {
       intersects = queue.size() < queue.maxSize() ||
-                   distanceToHyperplane < queue.worst();
+                   pruningFactor * distanceToHyperplane < queue.worst();
     } else if constexpr (std::is_same_v<Q,
                                         psClampedPQueue<NumericType, Node *>>) {
-      intersects = distanceToHyperplane < queue.worst();
+      intersects = !(queue.thresholdValue() < distanceToHyperplane);
     }
 
     if (intersects) {
       if (isLeft)
-        traverseDown(currentNode->right, queue, x);
+        traverseDown(currentNode->right, queue, x, visitedNodes);
       else
-        traverseDown(currentNode->left, queue, x);
+        traverseDown(currentNode->left, queue, x, visitedNodes);
     }
     return;
   }
@@ -379,6 +558,71 @@ private:
    * Utility Functions                                                        *
    ****************************************************************************/
 
+  // Storage of the queues of the kNN and radius queries. Each thread reuses
+  // its storage, so that the queries do not allocate memory.
+  static std::vector<std::pair<NumericType, Node *>> &getQueueStorage() {
+    static thread_local std::vector<std::pair<NumericType, Node *>> storage;
+    return storage;
+  }
+
+  // Number of consecutive queries a thread takes at once in the batch queries
+  static constexpr int batchChunkSize = 256;
+
+  // Order in which the batch queries are processed: sorted by the Morton code
+  // of the first (up to) three coordinates within the bounding box of the
+  // query points.
+  [[nodiscard]] std::vector<SizeType>
+  getQueryOrder(const std::vector<ValueType> &points) const {
+    static constexpr int bitsPerAxis = 21;
+    const SizeType numAxes = std::min(D, SizeType(3));
+    const auto numQueries = static_cast<long>(points.size());
+
+    std::array<NumericType, 3> minimum, scale;
+    minimum.fill(std::numeric_limits<NumericType>::max());
+    scale.fill(std::numeric_limits<NumericType>::lowest());
+    for (const auto &point : points) {
+      for (SizeType axis = 0; axis < numAxes; ++axis) {
+        minimum[axis] = std::min(minimum[axis], point[axis]);
+        scale[axis] = std::max(scale[axis], point[axis]);
+      }
+    }
+    for (SizeType axis = 0; axis < numAxes; ++axis) {
+      const auto extent = scale[axis] - minimum[axis];
+      scale[axis] = extent > 0 ? ((1 << bitsPerAxis) - 1) / extent : 0;
+    }
+
+    std::vector<std::pair<uint64_t, SizeType>> codes(points.size());
+#pragma omp parallel for
+    for (long i = 0; i < numQueries; ++i) {
+      const auto queryIdx = static_cast<SizeType>(i);
+      uint64_t code = 0;
+      for (SizeType axis = 0; axis < numAxes; ++axis) {
+        const auto cell = static_cast<uint64_t>(
+            (points[queryIdx][axis] - minimum[axis]) * scale[axis]);
+        code |= spreadBits(cell) << axis;
+      }
+      codes[queryIdx] = {code, queryIdx};
+    }
+    std::sort(codes.begin(), codes.end());
+
+    std::vector<SizeType> order(points.size());
+#pragma omp parallel for
+    for (long i = 0; i < numQueries; ++i)
+      order[static_cast<SizeType>(i)] = codes[static_cast<SizeType>(i)].second;
+    return order;
+  }
+
+  // Insert two zero bits between each of the lower 21 bits
+  [[nodiscard]] static constexpr uint64_t spreadBits(uint64_t x) {
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffff;
+    x = (x | x << 16) & 0x1f0000ff0000ff;
+    x = (x | x << 8) & 0x100f00f00f00f00f;
+    x = (x | x << 4) & 0x10c30c30c30c30c3;
+    x = (x | x << 2) & 0x1249249249249249;
+    return x;
+  }
+
   // Converts Iterator to a raw pointer
   template <class Iterator>
   [[nodiscard]] static typename Iterator::pointer
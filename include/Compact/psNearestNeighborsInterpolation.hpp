@@ -53,6 +53,9 @@ class psNearestNeighborsInterpolation
 
   psKDTree<NumericType> kdtree;
 
+  // Reused between estimates, so the neighbor search does not allocate
+  std::vector<std::pair<std::size_t, NumericType>> neighbors;
+
   int numberOfNeighbors = 3.;
   NumericType distanceExponent = 2.;
 
@@ -115,20 +118,15 @@ public:
       if (!initialize())
         return {};
 
-    auto neighborsOpt = kdtree.findKNearest(input, numberOfNeighbors);
-    if (!neighborsOpt)
+    if (!kdtree.findKNearest(input, numberOfNeighbors, neighbors))
       return {};
 
-    auto neighbors = neighborsOpt.value();
-
     ItemType result(outputDim, 0.);
 
     NumericType weightSum{0};
     NumericType minDistance = std::numeric_limits<NumericType>::infinity();
 
-    for (int j = 0; j < numberOfNeighbors; ++j) {
-      auto [nearestIndex, distance] = neighbors.at(j);
-
+    for (const auto &[nearestIndex, distance] : neighbors) {
       minDistance = std::min({distance, minDistance});
 
       NumericType weight;
@@ -7,119 +7,138 @@
  * URL: https://www.keithschwarz.com/interesting/
  */
 
+#include <algorithm>
 #include <functional>
 #include <limits>
-#include <map>
 #include <utility>
+#include <vector>
 
 // A bounded priority queue implementation.
 // If a certain predifined number of elements are already stored in the queue,
 // then a new item with a worse value than the worst already in the queue won't
 // be added when enqueue is called with the new item.
+// The items are kept in a max-heap in a storage vector provided by the caller.
+// The storage is cleared, but keeps its capacity, so a storage which is reused
+// for many queues (e.g. one per thread) does not allocate memory.
 template <class K, class V, typename Comparator = std::less<K>>
 struct psBoundedPQueue {
-  using MapType = std::multimap<K, V, Comparator>;
+  using ItemType = std::pair<K, V>;
+  using StorageType = std::vector<ItemType>;
   using SizeType = std::size_t;
 
 private:
-  MapType mmap;
+  StorageType &heap;
   const SizeType maximumSize;
+  Comparator comparator;
 
-public:
-  psBoundedPQueue(SizeType passedMaximumSize)
-      : maximumSize(passedMaximumSize) {}
+  // The worst item is at the front of the heap
+  bool compare(const ItemType &a, const ItemType &b) const {
+    return comparator(a.first, b.first);
+  }
 
-  void enqueue(std::pair<K, V> &&item) {
-    // Optimization: If this isn't going to be added, don't add it.
-    if (size() == maxSize() && mmap.key_comp()(worst(), item.first))
-      return;
+public:
+  psBoundedPQueue(SizeType passedMaximumSize, StorageType &passedStorage)
+      : heap(passedStorage), maximumSize(passedMaximumSize) {
+    heap.clear();
+    heap.reserve(maximumSize);
+  }
 
-    // Add the element to the collection.
-    mmap.emplace(std::forward<std::pair<K, V>>(item));
+  void enqueue(ItemType &&item) {
+    auto cmp = [this](const ItemType &a, const ItemType &b) {
+      return compare(a, b);
+    };
 
-    // If there are too many elements in the queue, drop off the last one.
-    if (size() > maxSize()) {
-      auto last = mmap.end();
-      --last; // Now points to highest-priority element
-      mmap.erase(last);
+    if (size() < maxSize()) {
+      heap.push_back(std::move(item));
+      std::push_heap(heap.begin(), heap.end(), cmp);
+      return;
     }
-  }
 
-  V dequeueBest() {
-    // Copy the best value.
-    V result = mmap.begin()->second;
+    // Optimization: If this isn't going to be added, don't add it.
+    if (maxSize() == 0 || !comparator(item.first, worst()))
+      return;
 
-    // Remove it from the map.
-    mmap.erase(mmap.begin());
+    // Replace the worst element
+    std::pop_heap(heap.begin(), heap.end(), cmp);
+    heap.back() = std::move(item);
+    std::push_heap(heap.begin(), heap.end(), cmp);
+  }
 
-    return result;
+  // Sorts the items from best to worst. No more items can be added afterwards.
+  const StorageType &sortedItems() {
+    std::sort_heap(heap.begin(), heap.end(),
+                   [this](const ItemType &a, const ItemType &b) {
+                     return compare(a, b);
+                   });
+    return heap;
   }
 
   [[nodiscard]] SizeType maxSize() const { return maximumSize; }
 
-  [[nodiscard]] SizeType size() const { return mmap.size(); }
+  [[nodiscard]] SizeType size() const { return heap.size(); }
 
-  [[nodiscard]] bool empty() const { return mmap.empty(); }
-
-  [[nodiscard]] K best() const {
-    return mmap.empty() ? std::numeric_limits<K>::infinity()
-                        : mmap.begin()->first;
-  }
+  [[nodiscard]] bool empty() const { return heap.empty(); }
 
   [[nodiscard]] K worst() const {
-    return mmap.empty() ? std::numeric_limits<K>::infinity()
-                        : mmap.rbegin()->first;
+    return heap.empty() ? std::numeric_limits<K>::infinity()
+                        : heap.front().first;
   }
 };
 
 // A clamped priority queue implementation.
 // Only items whose value is better than that of a predefined threshold can be
 // added to the queue.
+// The items are appended unordered to a storage vector provided by the caller
+// and only sorted once all items were added. As for the bounded queue, a
+// reused storage does not allocate memory.
 template <class K, class V, typename Comparator = std::less<K>>
 struct psClampedPQueue {
-  using MapType = std::multimap<K, V, Comparator>;
+  using ItemType = std::pair<K, V>;
+  using StorageType = std::vector<ItemType>;
   using SizeType = std::size_t;
 
 private:
-  MapType mmap;
+  StorageType &items;
   const K thresValue;
+  Comparator comparator;
 
 public:
-  psClampedPQueue(K passedThresValue) : thresValue(passedThresValue) {}
+  psClampedPQueue(K passedThresValue, StorageType &passedStorage)
+      : items(passedStorage), thresValue(passedThresValue) {
+    items.clear();
+  }
 
-  void enqueue(std::pair<K, V> &&item) {
+  void enqueue(ItemType &&item) {
     // Optimization: If this isn't going to be added, don't add it.
-    if (mmap.key_comp()(thresValue, item.first))
+    if (comparator(thresValue, item.first))
       return;
 
-    // Add the element to the collection.
-    mmap.emplace(std::forward<std::pair<K, V>>(item));
+    items.push_back(std::move(item));
   }
 
-  V dequeueBest() {
-    // Copy the best value.
-    V result = mmap.begin()->second;
-
-    // Remove it from the map.
-    mmap.erase(mmap.begin());
-
-    return result;
+  // Sorts the items from best to worst. If only the best numberOfItems are
+  // needed, only those are sorted.
+  const StorageType &
+  sortedItems(SizeType numberOfItems = std::numeric_limits<SizeType>::max()) {
+    auto cmp = [this](const ItemType &a, const ItemType &b) {
+      return comparator(a.first, b.first);
+    };
+    if (numberOfItems < items.size()) {
+      const auto middle =
+          items.begin() +
+          static_cast<typename StorageType::difference_type>(numberOfItems);
+      std::partial_sort(items.begin(), middle, items.end(), cmp);
+      items.resize(numberOfItems);
+    } else {
+      std::sort(items.begin(), items.end(), cmp);
+    }
+    return items;
   }
 
   [[nodiscard]] K thresholdValue() const { return thresValue; }
 
-  [[nodiscard]] SizeType size() const { return mmap.size(); }
+  [[nodiscard]] SizeType size() const { return items.size(); }
 
-  [[nodiscard]] bool empty() const { return mmap.empty(); }
-
-  [[nodiscard]] K best() const {
-    return mmap.empty() ? std::numeric_limits<K>::infinity()
-                        : mmap.begin()->first;
-  }
-
-  [[nodiscard]] K worst() const {
-    return mmap.empty() ? std::numeric_limits<K>::infinity()
-                        : mmap.rbegin()->first;
-  }
+  [[nodiscard]] bool empty() const { return items.empty(); }
 };
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,563 @@
+#ifndef PS_SPATIAL_HASH_GRID_HPP
+#define PS_SPATIAL_HASH_GRID_HPP
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include <psLogger.hpp>
+#include <psQueues.hpp>
+
+/**
+  Spatial index for points which are spread about evenly on a length scale,
+  e.g. the surface points of a level set, which lie close to the grid points.
+  The points are sorted into the cells of a uniform grid, usually with the
+  grid delta of the level set as cell size. The points of all cells are
+  stored consecutively in one array and the occupied cells are found with an
+  open addressing hash table. Queries search the cells in rings of
+  increasing distance around the cell of the query point, until no closer
+  point can be found.
+
+  The query interface matches the one of psKDTree, including the batch
+  queries.
+*/
+template <class NumericType, std::size_t D> class psSpatialHashGrid {
+  static_assert(D == 2 || D == 3,
+                "psSpatialHashGrid is only defined for 2 or 3 dimensions.");
+
+public:
+  using SizeType = std::size_t;
+  using PointType = std::array<NumericType, D>;
+
+private:
+  using CellType = std::array<long, D>;
+
+  static constexpr SizeType bitsPerAxis = 64 / D;
+  static constexpr uint64_t emptyKey = std::numeric_limits<uint64_t>::max();
+  static constexpr SizeType invalid = std::numeric_limits<SizeType>::max();
+
+  NumericType cellSize = 1.;
+  // range of the occupied cells
+  CellType minimumCell;
+  CellType maximumCell;
+
+  // points and their original indices sorted by cell
+  std::vector<PointType> points;
+  std::vector<SizeType> indices;
+  // points of the cell i are stored from cellOffsets[i] to cellOffsets[i + 1]
+  std::vector<SizeType> cellOffsets;
+
+  // hash table of the occupied cells: key and index of each cell
+  std::vector<std::pair<uint64_t, SizeType>> table;
+  uint64_t tableMask = 0;
+
+public:
+  psSpatialHashGrid() {}
+
+  psSpatialHashGrid(const std::vector<PointType> &passedPoints,
+                    const NumericType passedCellSize) {
+    setPoints(passedPoints, passedCellSize);
+  }
+
+  // Sort the points into the cells of a grid with the given cell size
+  void setPoints(const std::vector<PointType> &passedPoints,
+                 const NumericType passedCellSize) {
+    points.clear();
+    indices.clear();
+    cellOffsets.clear();
+    if (passedPoints.empty()) {
+      psLogger::getInstance()
+          .addWarning("psSpatialHashGrid: the provided points vector is empty.")
+          .print();
+      return;
+    }
+    if (!(passedCellSize > 0.)) {
+      psLogger::getInstance()
+          .addWarning("psSpatialHashGrid: the cell size has to be positive.")
+          .print();
+      return;
+    }
+
+    cellSize = passedCellSize;
+    const auto numPoints = static_cast<long>(passedPoints.size());
+    findCellRange(passedPoints);
+
+    // sort the points by their cell key
+    std::vector<std::pair<uint64_t, SizeType>> keys(passedPoints.size());
+#pragma omp parallel for
+    for (long i = 0; i < numPoints; ++i) {
+      const auto pointIdx = static_cast<SizeType>(i);
+      keys[pointIdx] = {getKey(getCell(passedPoints[pointIdx])), pointIdx};
+    }
+    std::sort(keys.begin(), keys.end());
+
+    points.resize(keys.size());
+    indices.resize(keys.size());
+#pragma omp parallel for
+    for (long i = 0; i < numPoints; ++i) {
+      const auto position = static_cast<SizeType>(i);
+      points[position] = passedPoints[keys[position].second];
+      indices[position] = keys[position].second;
+    }
+
+    std::vector<uint64_t> cellKeys;
+    for (SizeType i = 0; i < keys.size(); ++i) {
+      if (i == 0 || keys[i].first != keys[i - 1].first) {
+        cellKeys.push_back(keys[i].first);
+        cellOffsets.push_back(i);
+      }
+    }
+    cellOffsets.push_back(keys.size());
+
+    // hash table with a load factor of at most one half
+    SizeType tableSize = 2;
+    while (tableSize < 2 * cellKeys.size())
+      tableSize *= 2;
+    tableMask = tableSize - 1;
+    table.assign(tableSize, {emptyKey, 0});
+    for (SizeType cellIdx = 0; cellIdx < cellKeys.size(); ++cellIdx) {
+      auto slot = hash(cellKeys[cellIdx]) & tableMask;
+      while (table[slot].first != emptyKey)
+        slot = (slot + 1) & tableMask;
+      table[slot] = {cellKeys[cellIdx], cellIdx};
+    }
+  }
+
+  [[nodiscard]] SizeType size() const { return points.size(); }
+
+  [[nodiscard]] NumericType getCellSize() const { return cellSize; }
+
+  [[nodiscard]] std::optional<std::pair<SizeType, NumericType>>
+  findNearest(const PointType &x) const {
+    if (points.empty())
+      return {};
+
+    auto best = std::pair{std::numeric_limits<NumericType>::infinity(),
+                          SizeType(0)};
+    traverse(x, [&](const SizeType position, const NumericType distance) {
+      if (distance < best.first)
+        best = {distance, position};
+      return best.first;
+    });
+    return std::pair{indices[best.second], std::sqrt(best.first)};
+  }
+
+  [[nodiscard]] std::optional<std::vector<std::pair<SizeType, NumericType>>>
+  findKNearest(const PointType &x, const int k) const {
+    auto result = std::vector<std::pair<SizeType, NumericType>>();
+    if (!findKNearest(x, k, result))
+      return {};
+    return result;
+  }
+
+  // The k nearest neighbors sorted by distance are written to result.
+  // Repeated queries with the same result vector do not allocate memory.
+  bool
+  findKNearest(const PointType &x, const int k,
+               std::vector<std::pair<SizeType, NumericType>> &result) const {
+    result.clear();
+    if (points.empty())
+      return false;
+
+    const SizeType numNeighbors = k > 0 ? static_cast<SizeType>(k) : 0;
+    auto queue = psBoundedPQueue<NumericType, SizeType>(numNeighbors,
+                                                        getQueueStorage());
+    traverse(x, [&](const SizeType position, const NumericType distance) {
+      queue.enqueue({distance, position});
+      return queue.size() < queue.maxSize()
+                 ? std::numeric_limits<NumericType>::infinity()
+                 : queue.worst();
+    });
+    for (const auto &[squaredDistance, position] : queue.sortedItems())
+      result.emplace_back(indices[position], std::sqrt(squaredDistance));
+    return true;
+  }
+
+  [[nodiscard]] std::optional<std::vector<std::pair<SizeType, NumericType>>>
+  findNearestWithinRadius(const PointType &x, const NumericType radius) const {
+    auto result = std::vector<std::pair<SizeType, NumericType>>();
+    if (!findNearestWithinRadius(x, radius, result))
+      return {};
+    return result;
+  }
+
+  // All neighbors within the radius sorted by distance are written to result.
+  bool findNearestWithinRadius(
+      const PointType &x, const NumericType radius,
+      std::vector<std::pair<SizeType, NumericType>> &result) const {
+    result.clear();
+    if (points.empty())
+      return false;
+
+    const auto squaredRadius = radius * radius;
+    const auto searchRadius = std::nextafter(
+        squaredRadius, std::numeric_limits<NumericType>::infinity());
+    auto queue = psClampedPQueue<NumericType, SizeType>(squaredRadius,
+                                                        getQueueStorage());
+    traverse(
+        x,
+        [&](const SizeType position, const NumericType distance) {
+          queue.enqueue({distance, position});
+          return searchRadius;
+        },
+        searchRadius);
+    for (const auto &[squaredDistance, position] : queue.sortedItems())
+      result.emplace_back(indices[position], std::sqrt(squaredDistance));
+    return true;
+  }
+
+  /****************************************************************************
+   * Batch Queries                                                            *
+   ****************************************************************************/
+  // The batch queries process all query points in parallel, sorted by the
+  // cell they lie in. The results are written to flat arrays in the order of
+  // the query points, as for psKDTree.
+
+  // Index and distance of the nearest neighbor of each query point
+  void findNearestBatch(const std::vector<PointType> &queries,
+                        std::vector<SizeType> &nearestIndices,
+                        std::vector<NumericType> &distances) const {
+    nearestIndices.assign(queries.size(),
+                          std::numeric_limits<SizeType>::max());
+    distances.assign(queries.size(),
+                     std::numeric_limits<NumericType>::infinity());
+    if (points.empty())
+      return;
+
+    const auto order = getQueryOrder(queries);
+    const auto numQueries = static_cast<long>(queries.size());
+#pragma omp parallel for schedule(dynamic, batchChunkSize)
+    for (long i = 0; i < numQueries; ++i) {
+      const auto queryIdx = order[static_cast<SizeType>(i)];
+      if (auto nearest = findNearest(queries[queryIdx])) {
+        nearestIndices[queryIdx] = nearest->first;
+        distances[queryIdx] = nearest->second;
+      }
+    }
+  }
+
+  // The k nearest neighbors of each query point, sorted by distance. The
+  // neighbors of query i are stored at i * k to (i + 1) * k - 1, missing
+  // neighbors have the maximum index and an infinite distance.
+  void findKNearestBatch(const std::vector<PointType> &queries, const int k,
+                         std::vector<SizeType> &nearestIndices,
+                         std::vector<NumericType> &distances) const {
+    const SizeType numNeighbors = k > 0 ? static_cast<SizeType>(k) : 0;
+    nearestIndices.assign(queries.size() * numNeighbors,
+                          std::numeric_limits<SizeType>::max());
+    distances.assign(queries.size() * numNeighbors,
+                     std::numeric_limits<NumericType>::infinity());
+    if (points.empty() || numNeighbors == 0)
+      return;
+
+    const auto order = getQueryOrder(queries);
+    const auto numQueries = static_cast<long>(queries.size());
+#pragma omp parallel
+    {
+      std::vector<std::pair<SizeType, NumericType>> neighbors;
+#pragma omp for schedule(dynamic, batchChunkSize)
+      for (long i = 0; i < numQueries; ++i) {
+        const auto queryIdx = order[static_cast<SizeType>(i)];
+        findKNearest(queries[queryIdx], k, neighbors);
+        auto offset = queryIdx * numNeighbors;
+        for (const auto &[index, distance] : neighbors) {
+          nearestIndices[offset] = index;
+          distances[offset] = distance;
+          ++offset;
+        }
+      }
+    }
+  }
+
+  // All neighbors within the radius of each query point, sorted by
+  // distance. The neighbors of query i are stored from offsets[i] to
+  // offsets[i + 1] - 1.
+  void findNearestWithinRadiusBatch(const std::vector<PointType> &queries,
+                                    const NumericType radius,
+                                    std::vector<SizeType> &offsets,
+                                    std::vector<SizeType> &nearestIndices,
+                                    std::vector<NumericType> &distances) const {
+    const auto numQueries = static_cast<long>(queries.size());
+    offsets.assign(queries.size() + 1, 0);
+    nearestIndices.clear();
+    distances.clear();
+    if (points.empty())
+      return;
+
+    // count first, then write the neighbors to their final position
+    const auto order = getQueryOrder(queries);
+#pragma omp parallel
+    {
+      std::vector<std::pair<SizeType, NumericType>> neighbors;
+#pragma omp for schedule(dynamic, batchChunkSize)
+      for (long i = 0; i < numQueries; ++i) {
+        const auto queryIdx = order[static_cast<SizeType>(i)];
+        findNearestWithinRadius(queries[queryIdx], radius, neighbors);
+        offsets[queryIdx + 1] = neighbors.size();
+      }
+    }
+
+    for (SizeType i = 0; i < queries.size(); ++i)
+      offsets[i + 1] += offsets[i];
+    nearestIndices.resize(offsets.back());
+    distances.resize(offsets.back());
+
+#pragma omp parallel
+    {
+      std::vector<std::pair<SizeType, NumericType>> neighbors;
+#pragma omp for schedule(dynamic, batchChunkSize)
+      for (long i = 0; i < numQueries; ++i) {
+        const auto queryIdx = order[static_cast<SizeType>(i)];
+        findNearestWithinRadius(queries[queryIdx], radius, neighbors);
+        auto offset = offsets[queryIdx];
+        for (const auto &[index, distance] : neighbors) {
+          nearestIndices[offset] = index;
+          distances[offset] = distance;
+          ++offset;
+        }
+      }
+    }
+  }
+
+private:
+  static constexpr int batchChunkSize = 256;
+
+  void findCellRange(const std::vector<PointType> &passedPoints) {
+    minimumCell.fill(std::numeric_limits<long>::max());
+    maximumCell.fill(std::numeric_limits<long>::lowest());
+    for (const auto &point : passedPoints) {
+      for (SizeType axis = 0; axis < D; ++axis) {
+        const auto cell = getCellCoordinate(point[axis]);
+        minimumCell[axis] = std::min(minimumCell[axis], cell);
+        maximumCell[axis] = std::max(maximumCell[axis], cell);
+      }
+    }
+
+    // the relative cell coordinates have to fit into the key
+    long maxExtent = 0;
+    for (SizeType axis = 0; axis < D; ++axis)
+      maxExtent = std::max(maxExtent, maximumCell[axis] - minimumCell[axis]);
+    if (maxExtent >= (1l << bitsPerAxis) - 1) {
+      const auto factor =
+          std::ceil(static_cast<NumericType>(maxExtent + 1) /
+                    static_cast<NumericType>((1l << bitsPerAxis) - 1));
+      psLogger::getInstance()
+          .addDebug("psSpatialHashGrid: too many cells, increasing the cell "
+                    "size by a factor of " +
+                    std::to_string(factor))
+          .print();
+      cellSize *= factor;
+      findCellRange(passedPoints);
+    }
+  }
+
+  // The cells are centered at the multiples of the cell size, so that points
+  // on the level set grid lie in the centers of the cells
+  long getCellCoordinate(const NumericType coordinate) const {
+    return static_cast<long>(std::floor(coordinate / cellSize + 0.5));
+  }
+
+  // Lower boundary of the cells with the coordinate
+  NumericType getCellBoundary(const long cell) const {
+    return (static_cast<NumericType>(cell) - NumericType(0.5)) * cellSize;
+  }
+
+  CellType getCell(const PointType &point) const {
+    CellType cell;
+    for (SizeType axis = 0; axis < D; ++axis)
+      cell[axis] = getCellCoordinate(point[axis]);
+    return cell;
+  }
+
+  // Unique key of a cell inside the range of occupied cells
+  uint64_t getKey(const CellType &cell) const {
+    uint64_t key = 0;
+    for (SizeType axis = 0; axis < D; ++axis)
+      key = (key << bitsPerAxis) |
+            static_cast<uint64_t>(cell[axis] - minimumCell[axis]);
+    return key;
+  }
+
+  static uint64_t hash(uint64_t key) {
+    // finalizer of MurmurHash3
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ull;
+    key ^= key >> 33;
+    return key;
+  }
+
+  // Index of the cell in the cell arrays, invalid if the cell is empty
+  SizeType findCell(const CellType &cell) const {
+    const auto key = getKey(cell);
+    auto slot = hash(key) & tableMask;
+    while (table[slot].first != emptyKey) {
+      if (table[slot].first == key)
+        return table[slot].second;
+      slot = (slot + 1) & tableMask;
+    }
+    return invalid;
+  }
+
+  // Visit all points which can be closer than the current search radius,
+  // ring by ring around the cell of x. visit(position, squaredDistance)
+  // returns the squared search radius.
+  template <class VisitorType>
+  void traverse(const PointType &x, VisitorType &&visit,
+                NumericType searchRadius =
+                    std::numeric_limits<NumericType>::infinity()) const {
+    const auto center = getCell(x);
+
+    // the rings closer to the center than the occupied cells are empty
+    long firstRing = 0;
+    for (SizeType axis = 0; axis < D; ++axis) {
+      firstRing = std::max({firstRing, minimumCell[axis] - center[axis],
+                            center[axis] - maximumCell[axis]});
+    }
+
+    for (long ring = firstRing;; ++ring) {
+      // all points in this and further rings are at least this far away
+      if (ring > 0) {
+        NumericType bound = std::numeric_limits<NumericType>::infinity();
+        for (SizeType axis = 0; axis < D; ++axis) {
+          const auto lower = getCellBoundary(center[axis] - ring + 1);
+          const auto upper = getCellBoundary(center[axis] + ring);
+          bound = std::min({bound, x[axis] - lower, upper - x[axis]});
+        }
+        if (!(bound * bound < searchRadius))
+          return;
+      }
+
+      // the range of cells of the ring which can be occupied and intersect
+      // the sphere of the search radius
+      const auto radius = std::sqrt(searchRadius);
+      CellType first, last;
+      bool coversAll = true;
+      bool empty = false;
+      for (SizeType axis = 0; axis < D; ++axis) {
+        first[axis] = std::max(center[axis] - ring, minimumCell[axis]);
+        last[axis] = std::min(center[axis] + ring, maximumCell[axis]);
+        coversAll &= center[axis] - ring <= minimumCell[axis] &&
+                     center[axis] + ring >= maximumCell[axis];
+        if (radius < std::numeric_limits<NumericType>::infinity()) {
+          first[axis] =
+              std::max(first[axis], getCellCoordinate(x[axis] - radius));
+          last[axis] =
+              std::min(last[axis], getCellCoordinate(x[axis] + radius));
+        }
+        empty |= first[axis] > last[axis];
+      }
+
+      if (!empty)
+        visitRing(x, center, ring, first, last, visit, searchRadius);
+      if (coversAll)
+        return;
+    }
+  }
+
+  // Visit the points of all occupied cells in the range which lie on the
+  // ring, i.e. at least one coordinate differs by ring from the center.
+  template <class VisitorType>
+  void visitRing(const PointType &x, const CellType &center, const long ring,
+                 const CellType &first, const CellType &last,
+                 VisitorType &visit, NumericType &searchRadius) const {
+    CellType cell = first;
+    while (true) {
+      bool onRing = false;
+      for (SizeType axis = 0; axis + 1 < D; ++axis)
+        onRing |= std::abs(cell[axis] - center[axis]) == ring;
+
+      if (onRing) {
+        for (cell[D - 1] = first[D - 1]; cell[D - 1] <= last[D - 1];
+             ++cell[D - 1])
+          visitCell(x, cell, visit, searchRadius);
+      } else {
+        // only the two ends of the last axis lie on the ring
+        for (const auto end : {center[D - 1] - ring, center[D - 1] + ring}) {
+          if (end < first[D - 1] || end > last[D - 1])
+            continue;
+          cell[D - 1] = end;
+          visitCell(x, cell, visit, searchRadius);
+          if (ring == 0)
+            break;
+        }
+      }
+
+      // next cell in the range, the last axis is handled above
+      bool advanced = false;
+      for (SizeType axis = D - 1; axis-- > 0;) {
+        if (cell[axis] < last[axis]) {
+          ++cell[axis];
+          advanced = true;
+          break;
+        }
+        cell[axis] = first[axis];
+      }
+      if (!advanced)
+        return;
+      cell[D - 1] = first[D - 1];
+    }
+  }
+
+  template <class VisitorType>
+  void visitCell(const PointType &x, const CellType &cell, VisitorType &visit,
+                 NumericType &searchRadius) const {
+    // skip the hash table lookup if the cell is too far away
+    NumericType boxDistance = 0.;
+    for (SizeType axis = 0; axis < D; ++axis) {
+      const auto difference =
+          std::max({getCellBoundary(cell[axis]) - x[axis], NumericType(0),
+                    x[axis] - getCellBoundary(cell[axis] + 1)});
+      boxDistance += difference * difference;
+    }
+    if (!(boxDistance < searchRadius))
+      return;
+
+    const auto cellIdx = findCell(cell);
+    if (cellIdx == invalid)
+      return;
+    for (auto i = cellOffsets[cellIdx]; i < cellOffsets[cellIdx + 1]; ++i) {
+      const auto distance = squaredDistance(x, points[i]);
+      if (distance < searchRadius)
+        searchRadius = visit(i, distance);
+    }
+  }
+
+  static NumericType squaredDistance(const PointType &x, const PointType &y) {
+    NumericType distance = 0.;
+    for (SizeType axis = 0; axis < D; ++axis)
+      distance += (x[axis] - y[axis]) * (x[axis] - y[axis]);
+    return distance;
+  }
+
+  // Queries sorted by the cell they lie in
+  std::vector<SizeType>
+  getQueryOrder(const std::vector<PointType> &queries) const {
+    const auto numQueries = static_cast<long>(queries.size());
+    std::vector<std::pair<CellType, SizeType>> cells(queries.size());
+#pragma omp parallel for
+    for (long i = 0; i < numQueries; ++i) {
+      const auto queryIdx = static_cast<SizeType>(i);
+      cells[queryIdx] = {getCell(queries[queryIdx]), queryIdx};
+    }
+    std::sort(cells.begin(), cells.end());
+
+    std::vector<SizeType> order(queries.size());
+    for (SizeType i = 0; i < order.size(); ++i)
+      order[i] = cells[i].second;
+    return order;
+  }
+
+  static std::vector<std::pair<NumericType, SizeType>> &getQueueStorage() {
+    static thread_local std::vector<std::pair<NumericType, SizeType>> storage;
+    return storage;
+  }
+};
+
+#endif
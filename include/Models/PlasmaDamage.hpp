@@ -1,3 +1,4 @@
+#include <csSlidingWindow.hpp>
 #include <csTracing.hpp>
 #include <csTracingParticle.hpp>
 
@@ -71,7 +72,7 @@ public:
   }
 
   T collision(csVolumeParticle<T> &particle, rayRNG &RNG,
-              std::vector<csVolumeParticle<T>> &particleStack) override final {
+              csParticleStack<T> &particleStack) override final {
     T fill = 0.;
 
     // inelastic losses through electrons (stopping power)
@@ -185,10 +186,14 @@ class DamageModel : public psAdvectionCallback<NumericType, D> {
 protected:
   using psAdvectionCallback<NumericType, D>::domain;
   csTracing<NumericType, D> tracer;
+  // thickness of the cell set window below the surface, 0 keeps all cells
+  const NumericType windowThickness = 0.;
+  std::unique_ptr<csSlidingWindow<NumericType, D>> window;
 
 public:
   DamageModel(const NumericType energy, const NumericType meanFreePath,
-              const int maskID) {
+              const int maskID, const NumericType passedWindowThickness = 0.)
+      : windowThickness(passedWindowThickness) {
     tracer.setNumberOfRaysPerPoint(1000);
     tracer.setExcludeMaterialId(maskID);
 
@@ -206,7 +211,15 @@ public:
   }
 
   bool applyPostAdvect(const NumericType advectionTime) override {
-    domain->getCellSet()->updateSurface();
+    if (windowThickness <= 0.) {
+      domain->getCellSet()->updateSurface();
+      return true;
+    }
+
+    if (!window)
+      window = std::make_unique<csSlidingWindow<NumericType, D>>(
+          domain->getCellSet(), windowThickness);
+    window->apply();
     return true;
   }
 };
@@ -218,9 +231,10 @@ class PlasmaDamage : public psProcessModel<NumericType, D> {
 public:
   PlasmaDamage(const NumericType ionEnergy = 100.,
                const NumericType meanFreePath = 1.,
-               const int maskMaterial = 0) {
+               const int maskMaterial = 0,
+               const NumericType windowThickness = 0.) {
     auto volumeModel = psSmartPointer<DamageModel<NumericType, D>>::New(
-        ionEnergy, meanFreePath, maskMaterial);
+        ionEnergy, meanFreePath, maskMaterial, windowThickness);
 
     this->setProcessName("PlasmaDamage");
     this->setAdvectionCallback(volumeModel);
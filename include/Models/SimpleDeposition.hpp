@@ -85,5 +85,6 @@ public:
     this->setVelocityField(velField);
     this->setProcessName("SimpleDeposition");
     this->insertNextParticleType(depoParticle);
+    this->setParticleDiffuse(0);
   }
 };
\ No newline at end of file
@@ -1,12 +1,15 @@
 #pragma once
 
 #include <csDenseCellSet.hpp>
+#include <csStencil.hpp>
+#include <csTransportSolver.hpp>
 
 #include <lsAdvect.hpp>
 
 #include <psAdvectionCallback.hpp>
 #include <psDomain.hpp>
 #include <psProcessModel.hpp>
+#include <psSpatialHashGrid.hpp>
 #include <psToDiskMesh.hpp>
 
 // The selective etching model works in accordance with the geometry generated
@@ -39,29 +42,41 @@ private:
   const NumericType oxide_rate;
 };
 
+// The velocity of each level set point is taken from the nearest of the
+// given points. If a grid delta is passed, the nearest point is found with a
+// spatial hash grid with the grid delta as cell size instead of a kd-tree.
 template <class NumericType>
 class RedepositionVelocityField : public lsVelocityField<NumericType> {
 public:
   RedepositionVelocityField(
       const std::vector<NumericType> &passedVelocities,
-      const std::vector<std::array<NumericType, 3>> &points)
-      : velocities(passedVelocities), kdTree(points) {
+      const std::vector<std::array<NumericType, 3>> &points,
+      const NumericType gridDelta = 0.)
+      : velocities(passedVelocities), useHashGrid(gridDelta > 0.) {
     assert(points.size() == passedVelocities.size());
-    kdTree.build();
+    if (useHashGrid) {
+      hashGrid.setPoints(points, gridDelta);
+    } else {
+      kdTree.setPoints(points);
+      kdTree.build();
+    }
   }
 
   NumericType getScalarVelocity(const std::array<NumericType, 3> &coordinate,
                                 int matId,
                                 const std::array<NumericType, 3> &normalVector,
                                 unsigned long pointId) override {
-    auto nearest = kdTree.findNearest(coordinate);
+    auto nearest = useHashGrid ? hashGrid.findNearest(coordinate)
+                               : kdTree.findNearest(coordinate);
     assert(nearest->first < velocities.size());
     return velocities[nearest->first];
   }
 
 private:
   const std::vector<NumericType> &velocities;
+  const bool useHashGrid;
   psKDTree<NumericType, std::array<NumericType, 3>> kdTree;
+  psSpatialHashGrid<NumericType, 3> hashGrid;
 };
 
 template <class T, int D>
@@ -81,6 +96,7 @@ class ByproductDynamics : public psAdvectionCallback<T, D> {
   std::vector<std::array<T, 3>> nodes;
   T prevProcTime = 0.;
   unsigned counter = 0;
+  bool redeposited = false;
 
 public:
   ByproductDynamics(const T passedDiffCoeff, const T passedSink,
@@ -162,7 +178,8 @@ public:
 
       // advect surface
       auto redepVelField =
-          psSmartPointer<RedepositionVelocityField<T>>::New(depoRate, points);
+          psSmartPointer<RedepositionVelocityField<T>>::New(
+              depoRate, points, cellSet->getGridDelta());
 
       lsAdvect<T, D> advectionKernel;
       advectionKernel.insertNextLevelSet(domain->getLevelSets()->back());
@@ -172,6 +189,7 @@ public:
 
       prevProcTime = processTime;
       counter++;
+      redeposited = true;
     }
 
     return true;
@@ -179,7 +197,10 @@ public:
 
   bool applyPostAdvect(const T advectedTime) override {
     auto &cellSet = domain->getCellSet();
-    cellSet->updateMaterials();
+    // a single advection step moves the interfaces by less than a cell, the
+    // redeposition can move the top level set further
+    cellSet->updateMaterials(!redeposited);
+    redeposited = false;
     const auto gridDelta = cellSet->getGridDelta();
 
     // add byproducs
@@ -198,87 +219,32 @@ private:
                          const T timeStep) {
     auto data = cellSet->getFillingFractions();
     auto materialIds = cellSet->getScalarData("Material");
-    auto elems = cellSet->getElements();
-    auto nodes = cellSet->getNodes();
     const auto gridDelta = cellSet->getGridDelta();
-    // calculate time discretization
-    const T dt =
-        std::min(gridDelta * gridDelta / diffusionCoefficient * 0.245, 1.);
-    const int numSteps = static_cast<int>(timeStep / dt);
-    const T C = dt * diffusionCoefficient / (gridDelta * gridDelta);
-    const T holeC = dt / gridDelta * holeStreamVel;
-    const T scallopC = dt / gridDelta * scallopStreamVel;
-
-    for (int ts = 0; ts < numSteps; ts++) {
-      std::vector<T> solution(data->size(), 0.);
-
-#pragma omp parallel for
-      for (int e = 0; e < data->size(); e++) {
-        if (psMaterialMap::isMaterial(materialIds->at(e), psMaterial::GAS)) {
-          continue;
-        }
-
-        int numNeighbors = 0;
-        auto coord = nodes[elems[e][0]];
-        for (int i = 0; i < D; i++) {
-          coord[i] += gridDelta / 2.;
-        }
-
-        auto cellNeighbors = cellSet->getNeighbors(e);
-        for (const auto &n : cellNeighbors) {
-          if (n == -1 ||
-              !psMaterialMap::isMaterial(materialIds->at(n), psMaterial::GAS))
-            continue;
-
-          solution[e] += data->at(n);
-          numNeighbors++;
-        }
-
-        // diffusion
-        solution[e] =
-            data->at(e) +
-            C * (solution[e] - static_cast<T>(numNeighbors) * data->at(e));
 
-        // sink at the top
-        if (coord[1] > top - gridDelta) {
-          solution[e] = std::max(solution[e] - sink, 0.);
-          continue;
-        }
-
-        // convection
-        if (std::abs(coord[0]) < holeRadius) {
-          // in hole
-          assert(cellNeighbors[2] != -1 && "holeStream up neighbor wrong");
-          if (psMaterialMap::isMaterial(materialIds->at(cellNeighbors[2]),
-                                        psMaterial::GAS)) {
-            solution[e] -= holeC * (((coord[1] - gridDelta) / top) *
-                                        data->at(cellNeighbors[2]) -
-                                    (coord[1] / top) * data->at(e));
-          }
-        } else {
-          if (coord[0] < 0) {
-            // left side scallop - use forward difference
-            assert(cellNeighbors[1] != -1 &&
-                   "scallopStream right neighbor wrong");
-            if (psMaterialMap::isMaterial(materialIds->at(cellNeighbors[1]),
-                                          psMaterial::GAS)) {
-              solution[e] -=
-                  scallopC * (data->at(cellNeighbors[1]) - data->at(e));
-            }
-          } else {
-            // right side scallop - use backward difference
-            assert(cellNeighbors[0] != -1 &&
-                   "scallopStream left neighbor wrong");
-            if (psMaterialMap::isMaterial(materialIds->at(cellNeighbors[0]),
-                                          psMaterial::GAS)) {
-              solution[e] +=
-                  scallopC * (data->at(e) - data->at(cellNeighbors[0]));
-            }
-          }
-        }
+    // the byproducts are transported in the gas
+    const auto gasMask = csStencil<T, D>::materialMask(*cellSet, [](int m) {
+      return psMaterialMap::isMaterial(m, psMaterial::GAS);
+    });
+
+    // stream up in the hole and towards the hole in the scallops
+    csTransportSolver<T, D> solver(cellSet);
+    solver.setDiffusionCoefficient(diffusionCoefficient);
+    solver.setVelocityField([this](const csTriple<T> &point) {
+      csTriple<T> velocity = {0., 0., 0.};
+      if (std::abs(point[0]) < holeRadius) {
+        velocity[D - 1] = holeStreamVel * point[D - 1] / top;
+      } else {
+        velocity[0] = point[0] < 0 ? scallopStreamVel : -scallopStreamVel;
       }
-      *data = std::move(solution);
-    }
+      return velocity;
+    });
+    // sink at the top, removes the byproducts in the top cells at the rate
+    // given by the sink strength
+    solver.setSinkField([this, gridDelta](const csTriple<T> &point) {
+      return point[D - 1] > top - gridDelta ? sink : T(0);
+    });
+    solver.apply(*data, gasMask, timeStep);
+
     auto sum = cellSet->getScalarData("byproductSum");
 
 #pragma omp parallel for shared(sum)
@@ -203,6 +203,7 @@ public:
 
       this->setSurfaceModel(surfModel);
       this->insertNextParticleType(particle);
+      this->setParticleDiffuse(0);
       this->setProcessName("SingleParticleTEOS");
     } else {
       // use multi (two) particle model
@@ -220,6 +221,8 @@ public:
       this->setSurfaceModel(surfModel);
       this->insertNextParticleType(particle1);
       this->insertNextParticleType(particle2);
+      this->setParticleDiffuse(0);
+      this->setParticleDiffuse(1);
       this->setProcessName("MultiParticleTEOS");
     }
   }
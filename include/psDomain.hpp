@@ -153,14 +153,18 @@ public:
 
   materialMapType getMaterialMap() const { return materialMap; }
 
+  // A non-zero sparseBandThickness only allocates the cells within this
+  // distance of the surface (see csDenseCellSet::setSparseBandThickness).
   void generateCellSet(const NumericType depth = 0.,
-                       const bool passedCellSetPosition = false) {
+                       const bool passedCellSetPosition = false,
+                       const NumericType sparseBandThickness = 0.) {
     useCellSet = true;
     cellSetDepth = depth;
     if (cellSet == nullptr) {
       cellSet = csDomainType::New();
     }
     cellSet->setCellSetPosition(passedCellSetPosition);
+    cellSet->setSparseBandThickness(sparseBandThickness);
     cellSet->fromLevelSets(levelSets, materialMap, cellSetDepth);
   }
 
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <psLogger.hpp>
+#include <psUtils.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+/**
+  Edge-aware denoising of the fluxes on the surface disks. Each flux is
+  replaced by a weighted average over the disks within the filter radius
+  (joint bilateral filter). The weights are guided by the geometry only:
+  - a Gaussian in the distance between the disk centres,
+  - a Gaussian in (1 - cosine) of the angle between the disk normals, which
+    keeps corners and the edges of trenches and holes sharp,
+  - zero for disks of a different material, so that discontinuities at
+    material boundaries are preserved.
+  The weights are calculated once per geometry in setGeometry() and then
+  applied to any number of rate vectors.
+*/
+template <class NumericType, int D> class psFluxDenoiser {
+  // filter radius and spatial standard deviation in units of the grid delta
+  NumericType filterRadius = 2.;
+  NumericType spatialSigma = 1.;
+  // standard deviation of (1 - cos) of the angle between two normals
+  NumericType normalSigma = 0.1;
+  bool preserveMaterialBoundaries = true;
+
+  // row-normalized filter weights in compressed row storage
+  std::vector<unsigned> rowStart;
+  std::vector<unsigned> column;
+  std::vector<NumericType> weight;
+
+public:
+  psFluxDenoiser() {}
+
+  psFluxDenoiser(const NumericType passedFilterRadius,
+                 const NumericType passedSpatialSigma,
+                 const NumericType passedNormalSigma)
+      : filterRadius(passedFilterRadius), spatialSigma(passedSpatialSigma),
+        normalSigma(passedNormalSigma) {}
+
+  // Radius of the filter neighborhood in units of the grid delta.
+  void setFilterRadius(const NumericType passedFilterRadius) {
+    filterRadius = passedFilterRadius;
+  }
+
+  // Standard deviation of the spatial weight in units of the grid delta.
+  void setSpatialSigma(const NumericType passedSpatialSigma) {
+    spatialSigma = passedSpatialSigma;
+  }
+
+  // Standard deviation of the normal weight. Smaller values preserve corners
+  // more strictly.
+  void setNormalSigma(const NumericType passedNormalSigma) {
+    normalSigma = passedNormalSigma;
+  }
+
+  void setPreserveMaterialBoundaries(const bool passedPreserve) {
+    preserveMaterialBoundaries = passedPreserve;
+  }
+
+  // Calculate the filter weights for the surface disks. This has to be
+  // called every time the surface changes.
+  void setGeometry(const std::vector<std::array<NumericType, 3>> &points,
+                   const std::vector<std::array<NumericType, 3>> &normals,
+                   const std::vector<NumericType> &materialIds,
+                   const NumericType gridDelta) {
+    psUtils::Timer timer;
+    timer.start();
+
+    const auto numPoints = points.size();
+    const NumericType cellSize = filterRadius * gridDelta;
+    const NumericType radius2 = cellSize * cellSize;
+    const NumericType spatialFactor =
+        -1 / (2 * spatialSigma * spatialSigma * gridDelta * gridDelta);
+    const NumericType normalFactor = -1 / (2 * normalSigma * normalSigma);
+
+    // sort the points into a uniform grid with the filter radius as cell size
+    std::array<NumericType, 3> minimum{0., 0., 0.};
+    for (int i = 0; i < D; ++i) {
+      minimum[i] = std::numeric_limits<NumericType>::max();
+      for (const auto &p : points)
+        minimum[i] = std::min(minimum[i], p[i]);
+    }
+    auto cellIndex = [&](const std::array<NumericType, 3> &p, int i) {
+      return static_cast<std::uint64_t>((p[i] - minimum[i]) / cellSize);
+    };
+    auto cellKey = [](const std::array<std::uint64_t, 3> &c) {
+      return (c[2] << 42) | (c[1] << 21) | c[0];
+    };
+
+    std::vector<std::pair<std::uint64_t, unsigned>> sorted(numPoints);
+#pragma omp parallel for
+    for (long i = 0; i < static_cast<long>(numPoints); ++i) {
+      std::array<std::uint64_t, 3> c{0, 0, 0};
+      for (int j = 0; j < D; ++j)
+        c[j] = cellIndex(points[i], j);
+      sorted[i] = {cellKey(c), static_cast<unsigned>(i)};
+    }
+    std::sort(sorted.begin(), sorted.end());
+
+    std::vector<std::vector<std::pair<unsigned, NumericType>>> rows(numPoints);
+#pragma omp parallel for schedule(dynamic, 64)
+    for (long i = 0; i < static_cast<long>(numPoints); ++i) {
+      const auto &point = points[i];
+      const auto &normal = normals[i];
+      std::array<std::uint64_t, 3> c{0, 0, 0};
+      for (int j = 0; j < D; ++j)
+        c[j] = cellIndex(point, j);
+
+      auto &row = rows[i];
+      NumericType weightSum = 0.;
+      std::array<std::uint64_t, 3> n{0, 0, 0};
+      for (int dz = (D == 3 ? -1 : 0); dz <= (D == 3 ? 1 : 0); ++dz) {
+        for (int dy = -1; dy <= 1; ++dy) {
+          for (int dx = -1; dx <= 1; ++dx) {
+            const int offset[3] = {dx, dy, dz};
+            bool valid = true;
+            for (int j = 0; j < D; ++j) {
+              if (c[j] == 0 && offset[j] < 0)
+                valid = false;
+              n[j] = c[j] + offset[j];
+            }
+            if (!valid)
+              continue;
+
+            const auto key = cellKey(n);
+            auto it = std::lower_bound(
+                sorted.begin(), sorted.end(),
+                std::pair<std::uint64_t, unsigned>{key, 0});
+            for (; it != sorted.end() && it->first == key; ++it) {
+              const auto j = it->second;
+              if (preserveMaterialBoundaries &&
+                  materialIds[j] != materialIds[i])
+                continue;
+
+              NumericType distance2 = 0.;
+              for (int k = 0; k < D; ++k) {
+                const auto diff = points[j][k] - point[k];
+                distance2 += diff * diff;
+              }
+              if (distance2 > radius2)
+                continue;
+
+              NumericType cosine = 0.;
+              for (int k = 0; k < D; ++k)
+                cosine += normals[j][k] * normal[k];
+              const NumericType normalDistance = 1 - cosine;
+
+              const NumericType w =
+                  std::exp(spatialFactor * distance2 +
+                           normalFactor * normalDistance * normalDistance);
+              row.emplace_back(j, w);
+              weightSum += w;
+            }
+          }
+        }
+      }
+
+      for (auto &entry : row)
+        entry.second /= weightSum;
+    }
+
+    rowStart.resize(numPoints + 1);
+    rowStart[0] = 0;
+    for (size_t i = 0; i < numPoints; ++i)
+      rowStart[i + 1] = rowStart[i] + rows[i].size();
+    column.resize(rowStart.back());
+    weight.resize(rowStart.back());
+#pragma omp parallel for
+    for (long i = 0; i < static_cast<long>(numPoints); ++i) {
+      auto k = rowStart[i];
+      for (const auto &[j, w] : rows[i]) {
+        column[k] = j;
+        weight[k++] = w;
+      }
+    }
+
+    timer.finish();
+    psLogger::getInstance().addTiming("Flux denoiser setup", timer).print();
+  }
+
+  // Denoise the passed flux in place.
+  void apply(std::vector<NumericType> &flux) const {
+    if (flux.size() + 1 != rowStart.size()) {
+      psLogger::getInstance()
+          .addWarning("psFluxDenoiser: Flux does not match the geometry. "
+                      "Flux is not denoised.")
+          .print();
+      return;
+    }
+
+    std::vector<NumericType> filtered(flux.size());
+#pragma omp parallel for
+    for (long i = 0; i < static_cast<long>(flux.size()); ++i) {
+      NumericType sum = 0.;
+      for (auto k = rowStart[i]; k < rowStart[i + 1]; ++k)
+        sum += weight[k] * flux[column[k]];
+      filtered[i] = sum;
+    }
+    flux.swap(filtered);
+  }
+};
@@ -8,12 +8,15 @@
 
 #include <psAdvectionCallback.hpp>
 #include <psDomain.hpp>
+#include <psFluxDenoiser.hpp>
 #include <psLogger.hpp>
 #include <psProcessModel.hpp>
+#include <psRouletteParticle.hpp>
 #include <psSmartPointer.hpp>
 #include <psSurfaceModel.hpp>
 #include <psTranslationField.hpp>
 #include <psVelocityField.hpp>
+#include <psViewFactorFlux.hpp>
 
 #include <rayBoundCondition.hpp>
 #include <rayParticle.hpp>
@@ -51,11 +54,42 @@ public:
 
   void setSmoothFlux(bool pSmoothFlux) { smoothFlux = pSmoothFlux; }
 
+  // Set an edge-aware denoiser which is applied to every rate vector after
+  // the flux calculation.
+  void setFluxDenoiser(
+      psSmartPointer<psFluxDenoiser<NumericType, D>> passedDenoiser) {
+    fluxDenoiser = passedDenoiser;
+  }
+
+  // Set the backend used for the flux calculation. The view-factor backend
+  // solves the reflection balance deterministically. It is only used for the
+  // particle types declared diffuse in the process model (see
+  // psProcessModel::setParticleDiffuse), all other particle types are traced
+  // with Monte Carlo ray tracing.
+  void setFluxEngine(const psFluxEngineType passedFluxEngine) {
+    fluxEngine = passedFluxEngine;
+  }
+
+  // Set how source rays are sampled. Quasi-random sampling is used by the
+  // view-factor flux engine; rayTrace always samples pseudo-randomly.
+  void setSourceSampling(const psSourceSamplingType passedSampling) {
+    sourceSampling = passedSampling;
+  }
+
   void
   setIntegrationScheme(const lsIntegrationSchemeEnum passedIntegrationScheme) {
     integrationScheme = passedIntegrationScheme;
   }
 
+  // Approximate nearest neighbor search for the translation of the velocities
+  // from the surface points to the level set points with the kd-tree
+  // (translation field option 2). The surface point found is at most
+  // (1 + epsilon) times farther away than the nearest one. Zero gives the
+  // exact search.
+  void setTranslationEpsilon(const NumericType passedEpsilon) {
+    translationEpsilon = passedEpsilon;
+  }
+
   // Sets the minimum time between printing intermediate results during the
   // process. If this is set to a non-positive value, no intermediate results
   // are printed.
@@ -127,6 +161,7 @@ public:
     auto transField = psSmartPointer<psTranslationField<NumericType>>::New(
         model->getVelocityField(), domain->getMaterialMap());
     transField->setTranslator(translator);
+    transField->setEpsilon(translationEpsilon);
 
     lsAdvect<NumericType, D> advectionKernel;
     advectionKernel.setVelocityField(transField);
@@ -142,6 +177,16 @@ public:
 
     rayTraceBoundary rayBoundaryCondition[D];
     rayTrace<NumericType, D> rayTrace;
+    psSmartPointer<psViewFactorFlux<NumericType, D>> viewFactorFlux = nullptr;
+    // particle types using the view-factor flux calculation
+    std::vector<bool> useViewFactor;
+    bool useMonteCarlo = true;
+    // particles passed to rayTrace, which count their rays and apply the
+    // Russian roulette set in the process model
+    std::vector<std::unique_ptr<rayAbstractParticle<NumericType>>>
+        tracedParticles;
+    std::vector<psSmartPointer<psParticleStatistics>> particleStatistics;
+    std::vector<psUtils::Timer<>> particleTimers;
 
     if (useRayTracing) {
       // Map the domain boundary to the ray tracing boundaries
@@ -155,6 +200,84 @@ public:
       rayTrace.setUseRandomSeeds(useRandomSeeds);
       rayTrace.setCalculateFlux(false);
 
+      if (fluxEngine == psFluxEngineType::VIEW_FACTOR) {
+        // The view-factor calculation never calls surfaceCollision and assumes
+        // diffuse re-emission with a sticking probability independent of the
+        // incidence angle, so it is only used for particle types which declare
+        // this in the process model.
+        const auto numParticles = model->getParticleTypes()->size();
+        for (std::size_t i = 0; i < numParticles; ++i) {
+          const bool supported =
+              model->getParticleDiffuse(i) &&
+              model->getParticleTypes()->at(i)->getRequiredLocalDataSize() == 1;
+          useViewFactor.push_back(supported);
+          if (!supported) {
+            psLogger::getInstance()
+                .addWarning("Particle type " + std::to_string(i) +
+                            " is not declared diffuse in the process model. "
+                            "Using Monte Carlo flux calculation for it.")
+                .print();
+          } else if (model->getParticleLogSize(i) > 0) {
+            psLogger::getInstance()
+                .addWarning("No particle data log is recorded for particle "
+                            "type " +
+                            std::to_string(i) +
+                            " with view-factor flux calculation.")
+                .print();
+          }
+        }
+
+        if (std::find(useViewFactor.begin(), useViewFactor.end(), true) !=
+            useViewFactor.end()) {
+          viewFactorFlux =
+              psSmartPointer<psViewFactorFlux<NumericType, D>>::New();
+          viewFactorFlux->setSourceDirection(sourceDirection);
+          viewFactorFlux->setNumberOfRaysPerPoint(raysPerPoint);
+          viewFactorFlux->setBoundaryConditions(rayBoundaryCondition);
+          viewFactorFlux->setUseRandomSeeds(useRandomSeeds);
+          viewFactorFlux->setSourceSampling(sourceSampling);
+          psLogger::getInstance()
+              .addInfo("Using view-factor flux calculation.")
+              .print();
+        }
+      }
+      useViewFactor.resize(model->getParticleTypes()->size(), false);
+      useMonteCarlo = std::find(useViewFactor.begin(), useViewFactor.end(),
+                                false) != useViewFactor.end();
+
+      if (!viewFactorFlux &&
+          sourceSampling == psSourceSamplingType::QUASI_RANDOM) {
+        psLogger::getInstance()
+            .addWarning("Quasi-random source sampling is only available with "
+                        "the view-factor flux engine. Using pseudo-random "
+                        "source sampling.")
+            .print();
+      }
+
+      // ViennaRay applies its own roulette below a weight of 0.1, so the
+      // wrapper is only needed for higher thresholds or to count the rays
+      // for the statistics logged with the timings
+      constexpr NumericType rayRouletteThreshold = 0.1;
+      const bool logStatistics =
+          psLogger::getLogLevel() >= static_cast<unsigned>(psLogLevel::TIMING);
+      const auto numParticles = model->getParticleTypes()->size();
+      particleTimers.resize(numParticles);
+      for (std::size_t i = 0; i < numParticles; i++) {
+        const auto &particle = model->getParticleTypes()->at(i);
+        const auto [threshold, survivalWeight] = model->getParticleRoulette(i);
+        if (threshold <= rayRouletteThreshold && !logStatistics) {
+          particleStatistics.push_back(nullptr);
+          tracedParticles.push_back(particle->clone());
+          continue;
+        }
+        particleStatistics.push_back(
+            psSmartPointer<psParticleStatistics>::New());
+        tracedParticles.push_back(
+            std::make_unique<psRouletteParticle<NumericType>>(
+                particle, threshold, survivalWeight,
+                particleStatistics.back()));
+      }
+
       // initialize particle data logs
       particleDataLogs.resize(model->getParticleTypes()->size());
       for (std::size_t i = 0; i < model->getParticleTypes()->size(); i++) {
@@ -200,8 +323,14 @@ public:
         auto normals = *diskMesh->getCellData().getVectorData("Normals");
         auto materialIds =
             *diskMesh->getCellData().getScalarData("MaterialIds");
-        rayTrace.setGeometry(points, normals, gridDelta);
-        rayTrace.setMaterialIds(materialIds);
+        if (viewFactorFlux)
+          viewFactorFlux->setGeometry(points, normals, materialIds, gridDelta);
+        if (useMonteCarlo) {
+          rayTrace.setGeometry(points, normals, gridDelta);
+          rayTrace.setMaterialIds(materialIds);
+        }
+        if (fluxDenoiser)
+          fluxDenoiser->setGeometry(points, normals, materialIds, gridDelta);
 
         for (size_t iterations = 0; iterations < maxIterations; iterations++) {
           // move coverages to the ray tracer
@@ -225,13 +354,26 @@ public:
 
           std::size_t particleIdx = 0;
           for (auto &particle : *model->getParticleTypes()) {
+            if (useViewFactor[particleIdx]) {
+              auto rate =
+                  viewFactorFlux->calculateFlux(particle, &rayTraceCoverages);
+              if (fluxDenoiser)
+                fluxDenoiser->apply(rate);
+              Rates->insertNextScalarData(std::move(rate),
+                                          particle->getLocalDataLabels()[0]);
+              ++particleIdx;
+              continue;
+            }
+
             int dataLogSize = model->getParticleLogSize(particleIdx);
             if (dataLogSize > 0) {
               rayTrace.getDataLog().data.resize(1);
               rayTrace.getDataLog().data[0].resize(dataLogSize, 0.);
             }
-            rayTrace.setParticleType(particle);
+            particleTimers[particleIdx].start();
+            rayTrace.setParticleType(tracedParticles[particleIdx]);
             rayTrace.apply();
+            particleTimers[particleIdx].finish();
 
             // fill up rates vector with rates from this particle type
             auto &localData = rayTrace.getLocalData();
@@ -242,6 +384,8 @@ public:
               rayTrace.normalizeFlux(rate);
               if (smoothFlux)
                 rayTrace.smoothFlux(rate);
+              if (fluxDenoiser)
+                fluxDenoiser->apply(rate);
               Rates->insertNextScalarData(std::move(rate),
                                           localData.getVectorDataLabel(i));
             }
@@ -303,8 +447,14 @@ public:
       if (useRayTracing) {
         rtTimer.start();
         auto normals = *diskMesh->getCellData().getVectorData("Normals");
-        rayTrace.setGeometry(points, normals, gridDelta);
-        rayTrace.setMaterialIds(materialIds);
+        if (viewFactorFlux)
+          viewFactorFlux->setGeometry(points, normals, materialIds, gridDelta);
+        if (useMonteCarlo) {
+          rayTrace.setGeometry(points, normals, gridDelta);
+          rayTrace.setMaterialIds(materialIds);
+        }
+        if (fluxDenoiser)
+          fluxDenoiser->setGeometry(points, normals, materialIds, gridDelta);
 
         // move coverages to ray tracer
         rayTracingData<NumericType> rayTraceCoverages;
@@ -328,13 +478,26 @@ public:
 
         std::size_t particleIdx = 0;
         for (auto &particle : *model->getParticleTypes()) {
+          if (useViewFactor[particleIdx]) {
+            auto rate = viewFactorFlux->calculateFlux(
+                particle, useCoverages ? &rayTraceCoverages : nullptr);
+            if (fluxDenoiser)
+              fluxDenoiser->apply(rate);
+            Rates->insertNextScalarData(std::move(rate),
+                                        particle->getLocalDataLabels()[0]);
+            ++particleIdx;
+            continue;
+          }
+
           int dataLogSize = model->getParticleLogSize(particleIdx);
           if (dataLogSize > 0) {
             rayTrace.getDataLog().data.resize(1);
             rayTrace.getDataLog().data[0].resize(dataLogSize, 0.);
           }
-          rayTrace.setParticleType(particle);
+          particleTimers[particleIdx].start();
+          rayTrace.setParticleType(tracedParticles[particleIdx]);
           rayTrace.apply();
+          particleTimers[particleIdx].finish();
 
           // fill up rates vector with rates from this particle type
           auto numRates = particle->getRequiredLocalDataSize();
@@ -346,6 +509,8 @@ public:
             rayTrace.normalizeFlux(rate);
             if (smoothFlux)
               rayTrace.smoothFlux(rate);
+            if (fluxDenoiser)
+              fluxDenoiser->apply(rate);
             Rates->insertNextScalarData(std::move(rate),
                                         localData.getVectorDataLabel(i));
           }
@@ -370,8 +535,12 @@ public:
       auto velocitites = model->getSurfaceModel()->calculateVelocities(
           Rates, points, materialIds);
       model->getVelocityField()->setVelocities(velocitites);
-      if (model->getVelocityField()->getTranslationFieldOptions() == 2)
+      const auto translationFieldOptions =
+          model->getVelocityField()->getTranslationFieldOptions();
+      if (translationFieldOptions == 2)
         transField->buildKdTree(points);
+      else if (translationFieldOptions == 3)
+        transField->buildHashGrid(points, gridDelta);
 
       // print debug output
       if (psLogger::getLogLevel() >= 4) {
@@ -479,6 +648,7 @@ public:
                      rtTimer.totalDuration * 1e-9,
                      processTimer.totalDuration * 1e-9)
           .print();
+      logParticleStatistics(particleStatistics, particleTimers);
     }
     if (useAdvectionCallback) {
       psLogger::getInstance()
@@ -506,6 +676,32 @@ public:
   }
 
 private:
+  void logParticleStatistics(
+      const std::vector<psSmartPointer<psParticleStatistics>> &statistics,
+      const std::vector<psUtils::Timer<>> &timers) {
+    for (std::size_t i = 0; i < statistics.size(); i++) {
+      if (timers[i].totalDuration == 0)
+        continue;
+      if (statistics[i] && statistics[i]->rays > 0) {
+        const auto [threshold, survivalWeight] = model->getParticleRoulette(i);
+        std::string info =
+            "Particle type " + std::to_string(i) + ": " +
+            std::to_string(statistics[i]->rays) +
+            " rays, average path length " +
+            std::to_string(statistics[i]->getAveragePathLength());
+        if (threshold > 0.)
+          info += ", " + std::to_string(statistics[i]->terminations) +
+                  " rays terminated by Russian roulette below weight " +
+                  std::to_string(threshold);
+        psLogger::getInstance().addInfo(info);
+      }
+      psLogger::getInstance()
+          .addTiming("Particle type " + std::to_string(i) + " tracing time",
+                     timers[i].totalDuration * 1e-9)
+          .print();
+    }
+  }
+
   void printSurfaceMesh(lsSmartPointer<lsDomain<NumericType, D>> dom,
                         std::string name) {
     auto mesh = lsSmartPointer<lsMesh<NumericType>>::New();
@@ -622,8 +818,12 @@ private:
   std::vector<rayDataLog<NumericType>> particleDataLogs;
   bool useRandomSeeds = true;
   bool smoothFlux = false;
+  psSmartPointer<psFluxDenoiser<NumericType, D>> fluxDenoiser = nullptr;
+  psFluxEngineType fluxEngine = psFluxEngineType::MONTE_CARLO;
+  psSourceSamplingType sourceSampling = psSourceSamplingType::PSEUDO_RANDOM;
   size_t maxIterations = 20;
   bool coveragesInitialized = false;
+  NumericType translationEpsilon = 0.;
   NumericType printTime = 0.;
   NumericType processTime = 0.;
 };
@@ -3,6 +3,7 @@
 
 #include <psAdvectionCallback.hpp>
 #include <psGeometricModel.hpp>
+#include <psLogger.hpp>
 #include <psSmartPointer.hpp>
 #include <psSurfaceModel.hpp>
 #include <psVelocityField.hpp>
@@ -16,6 +17,10 @@ private:
 
   psSmartPointer<ParticleTypeList> particles = nullptr;
   std::vector<int> particleLogSize;
+  // Russian roulette threshold and survival weight per particle type
+  std::vector<std::pair<NumericType, NumericType>> particleRoulette;
+  // Particle types which may use the view-factor flux calculation
+  std::vector<bool> particleDiffuse;
   psSmartPointer<psSurfaceModel<NumericType>> surfaceModel = nullptr;
   psSmartPointer<psAdvectionCallback<NumericType, D>> advectionCallback =
       nullptr;
@@ -49,6 +54,15 @@ public:
     return particleLogSize[particleIdx];
   }
 
+  std::pair<NumericType, NumericType>
+  getParticleRoulette(std::size_t particleIdx) {
+    return particleRoulette[particleIdx];
+  }
+
+  bool getParticleDiffuse(std::size_t particleIdx) {
+    return particleDiffuse[particleIdx];
+  }
+
   template <typename ParticleType>
   void insertNextParticleType(std::unique_ptr<ParticleType> &passedParticle,
                               const int dataLogSize = 0) {
@@ -57,6 +71,47 @@ public:
     }
     particles->push_back(passedParticle->clone());
     particleLogSize.push_back(dataLogSize);
+    particleRoulette.emplace_back(0., 0.);
+    particleDiffuse.push_back(false);
+  }
+
+  // Declare that a particle type re-emits diffusely, has a sticking
+  // probability independent of the incidence angle and only accumulates the
+  // incoming ray weight in a single flux vector. Only such particle types can
+  // use the view-factor flux calculation, all others are traced with Monte
+  // Carlo ray tracing.
+  void setParticleDiffuse(std::size_t particleIdx, const bool diffuse = true) {
+    if (particleIdx >= particleDiffuse.size()) {
+      psLogger::getInstance()
+          .addWarning("Setting diffuse re-emission of non-existing particle "
+                      "type.")
+          .print();
+      return;
+    }
+    particleDiffuse[particleIdx] = diffuse;
+  }
+
+  // Apply Russian roulette to the rays of a particle type: a ray whose weight
+  // falls below the threshold is terminated with probability
+  // 1 - weight / survivalWeight and otherwise continues with the survival
+  // weight. A threshold of zero disables the roulette.
+  void setParticleRoulette(std::size_t particleIdx,
+                           const NumericType threshold,
+                           const NumericType survivalWeight = 0.3) {
+    if (particleIdx >= particleRoulette.size()) {
+      psLogger::getInstance()
+          .addWarning("Setting Russian roulette of non-existing particle type.")
+          .print();
+      return;
+    }
+    if (threshold > 0. && survivalWeight <= threshold) {
+      psLogger::getInstance()
+          .addWarning("Russian roulette survival weight has to be larger than "
+                      "the threshold.")
+          .print();
+      return;
+    }
+    particleRoulette[particleIdx] = {threshold, survivalWeight};
   }
 
   template <typename SurfaceModelType>
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <raySource.hpp>
+#include <rayRNG.hpp>
+#include <rayUtil.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+// Sampling of the ray origins and directions on the source plane
+// PSEUDO_RANDOM: independent pseudo-random numbers (raySourceRandom)
+// QUASI_RANDOM: randomly shifted Halton sequence (psQuasiRandomSource)
+enum class psSourceSamplingType : unsigned {
+  PSEUDO_RANDOM = 0,
+  QUASI_RANDOM = 1
+};
+
+namespace psQuasiRandom {
+
+// Radical inverse of the index in the given prime base (Halton sequence)
+template <class NumericType, unsigned Base>
+NumericType radicalInverse(unsigned long long index) {
+  constexpr double invBase = 1. / Base;
+  double invBaseN = 1.;
+  unsigned long long reversed = 0;
+  while (index) {
+    const auto next = index / Base;
+    reversed = reversed * Base + (index - next * Base);
+    invBaseN *= invBase;
+    index = next;
+  }
+  // keep the result strictly below one, also in single precision
+  return static_cast<NumericType>(
+      std::min(reversed * invBaseN, 0.99999994039535522));
+}
+
+// Cranley-Patterson rotation: shifts the sample by a random offset modulo one,
+// which keeps the low discrepancy but makes the estimate unbiased
+template <class NumericType>
+NumericType rotate(const NumericType sample, const NumericType shift) {
+  const NumericType shifted = sample + shift;
+  return shifted < NumericType(1) ? shifted : shifted - NumericType(1);
+}
+
+// Sample the i-th point of the four-dimensional Halton sequence
+template <class NumericType>
+std::array<NumericType, 4>
+haltonSample(const unsigned long long index,
+             const std::array<NumericType, 4> &shift) {
+  return {rotate(radicalInverse<NumericType, 2>(index), shift[0]),
+          rotate(radicalInverse<NumericType, 3>(index), shift[1]),
+          rotate(radicalInverse<NumericType, 5>(index), shift[2]),
+          rotate(radicalInverse<NumericType, 7>(index), shift[3])};
+}
+
+template <class NumericType>
+std::array<NumericType, 4> randomShift(rayRNG &rng) {
+  std::uniform_real_distribution<NumericType> uniDist;
+  return {uniDist(rng), uniDist(rng), uniDist(rng), uniDist(rng)};
+}
+
+// Cosine weighted direction around the normal from two uniform samples. This
+// is the deterministic counterpart of rayReflectionDiffuse.
+template <class NumericType, int D>
+rayTriple<NumericType> diffuseDirection(const rayTriple<NumericType> &normal,
+                                        const NumericType u1,
+                                        const NumericType u2) {
+  if constexpr (D == 2) {
+    const NumericType sinTheta = 2 * u1 - 1;
+    const NumericType cosTheta = std::sqrt(1 - sinTheta * sinTheta);
+    return {normal[0] * cosTheta - normal[1] * sinTheta,
+            normal[0] * sinTheta + normal[1] * cosTheta, 0.};
+  } else {
+    // orthonormal basis around the normal
+    rayTriple<NumericType> tangent =
+        std::abs(normal[0]) > NumericType(0.9)
+            ? rayTriple<NumericType>{normal[1], -normal[0], 0.}
+            : rayTriple<NumericType>{0., normal[2], -normal[1]};
+    rayInternal::Normalize(tangent);
+    const rayTriple<NumericType> bitangent{
+        normal[1] * tangent[2] - normal[2] * tangent[1],
+        normal[2] * tangent[0] - normal[0] * tangent[2],
+        normal[0] * tangent[1] - normal[1] * tangent[0]};
+
+    const NumericType phi = 2 * rayInternal::PI * u1;
+    const NumericType sinTheta = std::sqrt(u2);
+    const NumericType cosTheta = std::sqrt(1 - u2);
+    const NumericType a = std::cos(phi) * sinTheta;
+    const NumericType b = std::sin(phi) * sinTheta;
+    return {a * tangent[0] + b * bitangent[0] + cosTheta * normal[0],
+            a * tangent[1] + b * bitangent[1] + cosTheta * normal[1],
+            a * tangent[2] + b * bitangent[2] + cosTheta * normal[2]};
+  }
+}
+
+} // namespace psQuasiRandom
+
+/**
+  Ray source on the top plane of the bounding box, which samples the ray
+  origins and the (power cosine distributed) directions with a randomly
+  shifted Halton sequence instead of independent pseudo-random numbers. The
+  ray index selects the point of the sequence, so the origins of all rays of
+  one trace are stratified over the source plane and, for the same number of
+  rays, the flux noise is lower than with raySourceRandom. The random shift is
+  drawn from the seed, so different seeds give independent estimates.
+*/
+template <class NumericType, int D>
+class psQuasiRandomSource : public raySource<NumericType, D> {
+  using boundingBoxType = rayPair<rayTriple<NumericType>>;
+
+  const boundingBoxType bdBox;
+  const int rayDir;
+  const int firstDir;
+  const int secondDir;
+  const int minMax;
+  const NumericType posNeg;
+  const NumericType ee;
+  const size_t numPoints;
+  std::array<NumericType, 4> shift;
+
+public:
+  psQuasiRandomSource(boundingBoxType passedBoundingBox,
+                      NumericType passedCosinePower,
+                      std::array<int, 5> &passedTraceSettings,
+                      const size_t passedNumPoints, const size_t seed = 0)
+      : bdBox(passedBoundingBox), rayDir(passedTraceSettings[0]),
+        firstDir(passedTraceSettings[1]), secondDir(passedTraceSettings[2]),
+        minMax(passedTraceSettings[3]), posNeg(passedTraceSettings[4]),
+        ee(NumericType(2) / (passedCosinePower + 1)),
+        numPoints(passedNumPoints) {
+    rayRNG rng(seed);
+    shift = psQuasiRandom::randomShift<NumericType>(rng);
+  }
+
+  void fillRay(RTCRay &ray, const size_t idx, rayRNG &, rayRNG &, rayRNG &,
+               rayRNG &) override final {
+    // index 0 of the Halton sequence is the origin, skip it
+    const auto sample = psQuasiRandom::haltonSample(idx + 1, shift);
+
+    rayTriple<NumericType> origin{0., 0., 0.};
+    origin[rayDir] = bdBox[minMax][rayDir];
+    origin[firstDir] = bdBox[0][firstDir] +
+                       (bdBox[1][firstDir] - bdBox[0][firstDir]) * sample[0];
+    if constexpr (D == 3) {
+      origin[secondDir] =
+          bdBox[0][secondDir] +
+          (bdBox[1][secondDir] - bdBox[0][secondDir]) * sample[1];
+    }
+
+    rayTriple<NumericType> direction{0., 0., 0.};
+    const NumericType tt = std::pow(sample[3], ee);
+    direction[rayDir] = posNeg * std::sqrt(1 - tt);
+    direction[firstDir] = std::cos(2 * rayInternal::PI * sample[2]) *
+                          std::sqrt(tt);
+    if constexpr (D == 2) {
+      rayInternal::Normalize(direction);
+    } else {
+      direction[secondDir] = std::sin(2 * rayInternal::PI * sample[2]) *
+                             std::sqrt(tt);
+    }
+
+    ray.org_x = static_cast<float>(origin[0]);
+    ray.org_y = static_cast<float>(origin[1]);
+    ray.org_z = static_cast<float>(origin[2]);
+    ray.tnear = 1e-4f;
+
+    ray.dir_x = static_cast<float>(direction[0]);
+    ray.dir_y = static_cast<float>(direction[1]);
+    ray.dir_z = static_cast<float>(direction[2]);
+    ray.time = 0.0f;
+  }
+
+  size_t getNumPoints() const override final { return numPoints; }
+};
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <rayParticle.hpp>
+#include <rayRNG.hpp>
+#include <rayTracingData.hpp>
+#include <rayUtil.hpp>
+
+#include <psSmartPointer.hpp>
+
+#include <atomic>
+#include <memory>
+#include <random>
+
+// Ray statistics of one particle type, accumulated over all threads
+struct psParticleStatistics {
+  std::atomic<unsigned long long> rays{0};
+  std::atomic<unsigned long long> reflections{0};
+  std::atomic<unsigned long long> terminations{0};
+
+  void reset() {
+    rays = 0;
+    reflections = 0;
+    terminations = 0;
+  }
+
+  // average number of surface hits per ray
+  double getAveragePathLength() const {
+    return rays > 0 ? static_cast<double>(reflections) / rays : 0.;
+  }
+};
+
+/**
+  Wraps a particle type and applies Russian roulette to its rays: if the
+  weight of a ray after a surface hit falls below the threshold, the ray is
+  terminated with probability 1 - weight / survivalWeight and otherwise
+  continues with the survival weight. The expected deposited flux is
+  unchanged, but rays with a small remaining weight are not traced through
+  many more reflections. The roulette is expressed through the sticking
+  coefficient returned to the ray tracer (a sticking of one terminates the
+  ray, a negative sticking raises its weight).
+
+  ViennaRay applies its own roulette below a weight of 0.1 (survival weight
+  0.3), so only thresholds above 0.1 terminate rays earlier.
+
+  Every clone counts its rays, reflections and terminations and adds them to
+  the shared statistics when it is destroyed, which avoids atomic operations
+  per surface hit.
+*/
+template <class NumericType>
+class psRouletteParticle : public rayAbstractParticle<NumericType> {
+  std::unique_ptr<rayAbstractParticle<NumericType>> particle;
+  NumericType threshold = 0.1;
+  NumericType survivalWeight = 0.3;
+  psSmartPointer<psParticleStatistics> statistics;
+
+  unsigned long long rays = 0;
+  unsigned long long reflections = 0;
+  unsigned long long terminations = 0;
+
+public:
+  psRouletteParticle(
+      const std::unique_ptr<rayAbstractParticle<NumericType>> &passedParticle,
+      const NumericType passedThreshold,
+      const NumericType passedSurvivalWeight,
+      psSmartPointer<psParticleStatistics> passedStatistics)
+      : particle(passedParticle->clone()), threshold(passedThreshold),
+        survivalWeight(passedSurvivalWeight), statistics(passedStatistics) {}
+
+  psRouletteParticle(const psRouletteParticle &other)
+      : particle(other.particle->clone()), threshold(other.threshold),
+        survivalWeight(other.survivalWeight), statistics(other.statistics) {}
+
+  ~psRouletteParticle() {
+    if (statistics && rays > 0) {
+      statistics->rays += rays;
+      statistics->reflections += reflections;
+      statistics->terminations += terminations;
+    }
+  }
+
+  std::unique_ptr<rayAbstractParticle<NumericType>>
+  clone() const override final {
+    return std::make_unique<psRouletteParticle>(*this);
+  }
+
+  void initNew(rayRNG &rng) override final {
+    ++rays;
+    particle->initNew(rng);
+  }
+
+  std::pair<NumericType, rayTriple<NumericType>>
+  surfaceReflection(NumericType rayWeight, const rayTriple<NumericType> &rayDir,
+                    const rayTriple<NumericType> &geomNormal,
+                    const unsigned int primID, const int materialId,
+                    const rayTracingData<NumericType> *globalData,
+                    rayRNG &rng) override final {
+    ++reflections;
+    auto stickingDirection = particle->surfaceReflection(
+        rayWeight, rayDir, geomNormal, primID, materialId, globalData, rng);
+
+    const NumericType remainingWeight =
+        rayWeight * (1 - stickingDirection.first);
+    if (remainingWeight <= 0 || remainingWeight >= threshold)
+      return stickingDirection;
+
+    std::uniform_real_distribution<NumericType> uniDist;
+    if (uniDist(rng) < remainingWeight / survivalWeight) {
+      // continue with the survival weight
+      stickingDirection.first = 1 - survivalWeight / rayWeight;
+    } else {
+      ++terminations;
+      stickingDirection.first = 1;
+    }
+    return stickingDirection;
+  }
+
+  void surfaceCollision(NumericType rayWeight,
+                        const rayTriple<NumericType> &rayDir,
+                        const rayTriple<NumericType> &geomNormal,
+                        const unsigned int primID, const int materialId,
+                        rayTracingData<NumericType> &localData,
+                        const rayTracingData<NumericType> *globalData,
+                        rayRNG &rng) override final {
+    particle->surfaceCollision(rayWeight, rayDir, geomNormal, primID,
+                               materialId, localData, globalData, rng);
+  }
+
+  int getRequiredLocalDataSize() const override final {
+    return particle->getRequiredLocalDataSize();
+  }
+
+  NumericType getSourceDistributionPower() const override final {
+    return particle->getSourceDistributionPower();
+  }
+
+  std::vector<std::string> getLocalDataLabels() const override final {
+    return particle->getLocalDataLabels();
+  }
+
+  void logData(rayDataLog<NumericType> &log) override final {
+    particle->logData(log);
+  }
+};
@@ -6,6 +6,7 @@
 
 #include <psKDTree.hpp>
 #include <psSmartPointer.hpp>
+#include <psSpatialHashGrid.hpp>
 
 template <class NumericType, int D> class psSurfacePointValuesToLevelSet {
   using lsDomainType = psSmartPointer<lsDomain<NumericType, D>>;
@@ -13,6 +14,7 @@ template <class NumericType, int D> class psSurfacePointValuesToLevelSet {
   lsDomainType levelSet;
   psSmartPointer<lsMesh<NumericType>> mesh;
   std::vector<std::string> dataNames;
+  bool useHashGrid = false;
 
 public:
   psSurfacePointValuesToLevelSet() {}
@@ -38,6 +40,12 @@ public:
     dataNames = passesDataNames;
   }
 
+  // Find the nearest mesh points with a spatial hash grid with the grid delta
+  // of the level set as cell size instead of a kd-tree
+  void setUseHashGrid(bool passedUseHashGrid) {
+    useHashGrid = passedUseHashGrid;
+  }
+
   void apply() {
     if (!levelSet) {
       psLogger::getInstance()
@@ -53,31 +61,40 @@ public:
       return;
     }
 
-    psKDTree<NumericType, std::array<NumericType, 3>> transTree(
-        mesh->getNodes());
-    transTree.build();
     const auto gridDelta = levelSet->getGrid().getGridDelta();
 
-    std::vector<std::size_t> levelSetPointToMeshIds(
-
-        levelSet->getNumberOfPoints());
-
+    // collect the level set points and find their nearest mesh points in
+    // one batch
+    std::vector<std::array<NumericType, 3>> levelSetPoints(
+        levelSet->getNumberOfPoints(), {0., 0., 0.});
     for (hrleConstSparseIterator<typename lsDomain<NumericType, D>::DomainType>
              it(levelSet->getDomain());
          !it.isFinished(); ++it) {
 
       if (it.isDefined()) {
         auto lsIndicies = it.getStartIndices();
-        std::array<NumericType, 3> levelSetPointCoordinate{0., 0., 0.};
+        assert(it.getPointId() < levelSet->getNumberOfPoints());
+        auto &levelSetPointCoordinate = levelSetPoints[it.getPointId()];
         for (unsigned i = 0; i < D; i++) {
           levelSetPointCoordinate[i] = lsIndicies[i] * gridDelta;
         }
-        auto meshPointId = transTree.findNearest(levelSetPointCoordinate);
-        assert(it.getPointId() < levelSet->getNumberOfPoints());
-        levelSetPointToMeshIds[it.getPointId()] = meshPointId->first;
       }
     }
 
+    std::vector<std::size_t> levelSetPointToMeshIds;
+    std::vector<NumericType> distances;
+    if (useHashGrid) {
+      psSpatialHashGrid<NumericType, 3> transGrid(mesh->getNodes(), gridDelta);
+      transGrid.findNearestBatch(levelSetPoints, levelSetPointToMeshIds,
+                                 distances);
+    } else {
+      psKDTree<NumericType, std::array<NumericType, 3>> transTree(
+          mesh->getNodes());
+      transTree.build();
+      transTree.findNearestBatch(levelSetPoints, levelSetPointToMeshIds,
+                                 distances);
+    }
+
     for (const auto dataName : dataNames) {
       auto pointData = mesh->getCellData().getScalarData(dataName);
       if (!pointData) {
@@ -3,7 +3,8 @@
 
 #include <iostream>
 #include <lsVelocityField.hpp>
-#include <psKDTree.hpp>
+#include <psIncrementalKDTree.hpp>
+#include <psSpatialHashGrid.hpp>
 #include <psVelocityField.hpp>
 
 template <typename NumericType>
@@ -55,9 +56,19 @@ public:
     translator = passedTranslator;
   }
 
+  // Approximate nearest neighbor search of the kd-tree, the surface point
+  // found is at most (1 + epsilon) times farther away than the nearest one
+  void setEpsilon(const NumericType epsilon) { kdTree.setEpsilon(epsilon); }
+
+  // The surface points only move slightly between time steps, so the tree is
+  // only rebuilt if its quality degraded
   void buildKdTree(const std::vector<std::array<NumericType, 3>> &points) {
     kdTree.setPoints(points);
-    kdTree.build();
+  }
+
+  void buildHashGrid(const std::vector<std::array<NumericType, 3>> &points,
+                     const NumericType gridDelta) {
+    hashGrid.setPoints(points, gridDelta);
   }
 
   void translateLsId(unsigned long &lsId,
@@ -65,6 +76,9 @@ public:
     if (translationMethod == 2) {
       auto nearest = kdTree.findNearest(coordinate);
       lsId = nearest->first;
+    } else if (translationMethod == 3) {
+      auto nearest = hashGrid.findNearest(coordinate);
+      lsId = nearest->first;
     } else {
       if (auto it = translator->find(lsId); it != translator->end()) {
         lsId = it->second;
@@ -78,7 +92,8 @@ public:
 
 private:
   psSmartPointer<translatorType> translator;
-  psKDTree<NumericType, std::array<NumericType, 3>> kdTree;
+  psIncrementalKDTree<NumericType, 3> kdTree;
+  psSpatialHashGrid<NumericType, 3> hashGrid;
   const psSmartPointer<psVelocityField<NumericType>> modelVelocityField;
   const psSmartPointer<psMaterialMap> materialMap;
 };
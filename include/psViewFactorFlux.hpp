@@ -0,0 +1,658 @@
+#pragma once
+
+#include <embree3/rtcore.h>
+
+#include <rayBoundary.hpp>
+#include <rayGeometry.hpp>
+#include <rayParticle.hpp>
+#include <rayReflection.hpp>
+#include <rayRNG.hpp>
+#include <raySourceRandom.hpp>
+#include <rayTracingData.hpp>
+#include <rayUtil.hpp>
+
+#include <csUtil.hpp>
+
+#include <psLogger.hpp>
+#include <psQuasiRandomSource.hpp>
+#include <psSmartPointer.hpp>
+
+#include <cassert>
+#include <memory>
+#include <omp.h>
+#include <unordered_map>
+
+// Flux calculation backends available in psProcess
+// MONTE_CARLO: trace every particle with rayTrace (default)
+// VIEW_FACTOR: deterministic multiple-reflection balance on a pre-computed
+//              view-factor matrix (diffuse re-emission models only)
+enum class psFluxEngineType : unsigned { MONTE_CARLO = 0, VIEW_FACTOR = 1 };
+
+/**
+  Flux calculation for particles with diffuse re-emission (e.g.
+  SimpleDepositionParticle, TEOSSingleParticle, TEOSMultiParticle). Instead of
+  following every particle through all of its bounces, the surface is traced
+  once per geometry update to build a sparse disk-to-disk transfer matrix.
+  The multiple-reflection balance is then solved iteratively for each particle
+  type, where the sticking probability of every disk is queried from the
+  particle. This also captures coverage-dependent sticking.
+
+  The particle must have exactly one local data vector, which accumulates the
+  incoming ray weight, and must reflect diffusely. surfaceCollision is never
+  called and the sticking probability is evaluated at normal incidence, so
+  particles with angle dependent sticking or yields get wrong fluxes. psProcess
+  therefore only uses this engine for particles declared diffuse in the
+  process model.
+*/
+template <class NumericType, int D> class psViewFactorFlux {
+  using BoundingBoxType = rayPair<rayTriple<NumericType>>;
+
+  // sparse row-major matrix, one row per receiving disk
+  struct SparseMatrix {
+    std::vector<unsigned> rowStart;
+    std::vector<unsigned> column;
+    std::vector<NumericType> value;
+
+    void clear() {
+      rowStart.clear();
+      column.clear();
+      value.clear();
+    }
+  };
+
+  RTCDevice device;
+  RTCScene scene = nullptr;
+  rayGeometry<NumericType, D> geometry;
+  psSmartPointer<rayBoundary<NumericType, D>> boundary = nullptr;
+  unsigned boundaryID = RTC_INVALID_GEOMETRY_ID;
+  BoundingBoxType boundingBox;
+  std::array<int, 5> traceSettings;
+
+  std::vector<std::array<NumericType, 3>> points;
+  std::vector<std::array<NumericType, 3>> normals;
+  std::vector<NumericType> materialIds;
+  std::vector<std::vector<unsigned>> diskNeighbors;
+  NumericType diskRadius = 0.;
+  // area of each disk inside the domain, as used by the Monte Carlo flux
+  // normalization
+  std::vector<NumericType> diskAreas;
+  NumericType sourceArea = 0.;
+
+  // first disk hit by a ray re-emitted from a disk
+  SparseMatrix primaryTransfer;
+  // disks counting a ray re-emitted from a disk
+  SparseMatrix countTransfer;
+  // direct source contribution, cached per source distribution power
+  std::unordered_map<NumericType, std::pair<std::vector<NumericType>,
+                                            std::vector<NumericType>>>
+      sourceContributions;
+
+  rayTraceBoundary boundaryConds[D] = {};
+  rayTraceDirection sourceDirection =
+      D == 3 ? rayTraceDirection::POS_Z : rayTraceDirection::POS_Y;
+  size_t numberOfRaysPerPoint = 1000;
+  bool useRandomSeeds = true;
+  psSourceSamplingType sourceSampling = psSourceSamplingType::PSEUDO_RANDOM;
+  size_t runNumber = 0;
+  size_t maxIterations = 1000;
+  NumericType tolerance = 1e-6;
+
+public:
+  psViewFactorFlux() : device(csUtil::getSharedDevice()) {
+    for (int i = 0; i < D; i++)
+      boundaryConds[i] = rayTraceBoundary::REFLECTIVE;
+  }
+
+  ~psViewFactorFlux() { releaseScene(); }
+
+  void setBoundaryConditions(const rayTraceBoundary passedBoundaryConds[D]) {
+    for (int i = 0; i < D; i++)
+      boundaryConds[i] = passedBoundaryConds[i];
+  }
+
+  void setSourceDirection(const rayTraceDirection passedDirection) {
+    sourceDirection = passedDirection;
+  }
+
+  // Number of rays traced from each disk when building the transfer matrix
+  // and number of source rays per disk when calculating the direct flux.
+  void setNumberOfRaysPerPoint(const size_t passedNumber) {
+    numberOfRaysPerPoint = passedNumber;
+  }
+
+  void setUseRandomSeeds(const bool passedUseRandomSeeds) {
+    useRandomSeeds = passedUseRandomSeeds;
+  }
+
+  // Quasi-random sampling uses a randomly shifted Halton sequence for the
+  // source rays and, per disk, for the re-emitted rays of the transfer matrix.
+  void setSourceSampling(const psSourceSamplingType passedSampling) {
+    if (sourceSampling != passedSampling)
+      sourceContributions.clear();
+    sourceSampling = passedSampling;
+  }
+
+  // Set the maximum number of iterations and the relative tolerance of the
+  // iterative solution of the reflection balance.
+  void setSolverParameters(const size_t passedMaxIterations,
+                           const NumericType passedTolerance) {
+    maxIterations = passedMaxIterations;
+    tolerance = passedTolerance;
+  }
+
+  // Set up the surface disks and build the transfer matrices. This has to be
+  // called every time the surface changes.
+  void setGeometry(const std::vector<std::array<NumericType, 3>> &passedPoints,
+                   const std::vector<std::array<NumericType, 3>> &passedNormals,
+                   const std::vector<NumericType> &passedMaterialIds,
+                   const NumericType gridDelta) {
+    psUtils::Timer timer;
+    timer.start();
+
+    releaseScene();
+    sourceContributions.clear();
+    runNumber++;
+
+    points = passedPoints;
+    normals = passedNormals;
+    materialIds = passedMaterialIds;
+    diskRadius = gridDelta * rayInternal::DiskFactor<D>;
+
+    geometry.initGeometry(device, points, normals, diskRadius);
+    geometry.setMaterialIds(materialIds);
+
+    boundingBox = geometry.getBoundingBox();
+    rayInternal::adjustBoundingBox<NumericType, D>(boundingBox, sourceDirection,
+                                                   diskRadius);
+    traceSettings = rayInternal::getTraceSettings(sourceDirection);
+    boundary = psSmartPointer<rayBoundary<NumericType, D>>::New(
+        device, boundingBox, boundaryConds, traceSettings);
+
+    const int firstDir = traceSettings[1];
+    const int secondDir = traceSettings[2];
+    sourceArea = boundingBox[1][firstDir] - boundingBox[0][firstDir];
+    if constexpr (D == 3)
+      sourceArea *= boundingBox[1][secondDir] - boundingBox[0][secondDir];
+
+    scene = rtcNewScene(device);
+    rtcSetSceneFlags(scene, RTC_SCENE_FLAG_NONE);
+    rtcSetSceneBuildQuality(scene, RTC_BUILD_QUALITY_HIGH);
+    boundaryID = rtcAttachGeometry(scene, boundary->getRTCGeometry());
+    rtcAttachGeometry(scene, geometry.getRTCGeometry());
+    rtcCommitScene(scene);
+    assert(rtcGetDeviceError(device) == RTC_ERROR_NONE &&
+           "Embree device error");
+
+    computeDiskAreas();
+    buildDiskNeighborhood();
+    buildTransferMatrices();
+
+    timer.finish();
+    psLogger::getInstance()
+        .addTiming("View-factor matrix calculation", timer)
+        .print();
+  }
+
+  // Calculate the normalized flux of the given particle type on all disks. The
+  // global data (coverages) is passed to the particle to evaluate the sticking
+  // probability.
+  std::vector<NumericType>
+  calculateFlux(std::unique_ptr<rayAbstractParticle<NumericType>> &particle,
+                const rayTracingData<NumericType> *globalData) {
+    const auto numPoints = points.size();
+    std::vector<NumericType> flux(numPoints, 0.);
+    if (numPoints == 0 || scene == nullptr) {
+      psLogger::getInstance()
+          .addWarning("psViewFactorFlux: No geometry set.")
+          .print();
+      return flux;
+    }
+
+    if (particle->getRequiredLocalDataSize() != 1) {
+      psLogger::getInstance()
+          .addWarning("psViewFactorFlux: Only particles with a single local "
+                      "data vector are supported.")
+          .print();
+      return flux;
+    }
+
+    const auto &[directPrimary, directCount] =
+        getSourceContribution(particle->getSourceDistributionPower());
+
+    // re-emission probability of each disk
+    std::vector<NumericType> reemission(numPoints);
+    {
+      rayRNG rng(runNumber);
+      auto localParticle = particle->clone();
+      for (unsigned p = 0; p < numPoints; ++p) {
+        const auto &normal = normals[p];
+        const rayTriple<NumericType> inDir{-normal[0], -normal[1], -normal[2]};
+        const auto sticking =
+            localParticle
+                ->surfaceReflection(1., inDir, normal, p,
+                                    static_cast<int>(materialIds[p]),
+                                    globalData, rng)
+                .first;
+        reemission[p] = std::clamp(NumericType(1) - sticking, NumericType(0),
+                                   NumericType(1));
+      }
+    }
+
+    // Solve W = S + P^T (r * W) for the weight W of rays having their primary
+    // hit on each disk with Jacobi iterations.
+    std::vector<NumericType> weight(directPrimary);
+    std::vector<NumericType> emitted(numPoints);
+    std::vector<NumericType> update(numPoints);
+    size_t iteration = 0;
+    NumericType residual = 0.;
+    for (; iteration < maxIterations; ++iteration) {
+#pragma omp parallel for
+      for (long p = 0; p < static_cast<long>(numPoints); ++p)
+        emitted[p] = reemission[p] * weight[p];
+
+      std::copy(directPrimary.begin(), directPrimary.end(), update.begin());
+      addIncoming(primaryTransfer, emitted, update);
+
+      NumericType diff = 0., norm = 0.;
+#pragma omp parallel for reduction(+ : diff, norm)
+      for (long p = 0; p < static_cast<long>(numPoints); ++p) {
+        diff += std::abs(update[p] - weight[p]);
+        norm += std::abs(update[p]);
+      }
+      weight.swap(update);
+      residual = norm > 0. ? diff / norm : 0.;
+      if (residual < tolerance)
+        break;
+    }
+
+    if (iteration == maxIterations) {
+      psLogger::getInstance()
+          .addWarning("psViewFactorFlux: Reflection balance did not converge "
+                      "(residual " +
+                      std::to_string(residual) + ").")
+          .print();
+    }
+    psLogger::getInstance()
+        .addDebug("psViewFactorFlux: Reflection balance converged after " +
+                  std::to_string(iteration + 1) + " iterations.")
+        .print();
+
+    // counted weight on each disk, normalized the same way as the Monte Carlo
+    // flux (source area, number of source rays, disk area)
+#pragma omp parallel for
+    for (long p = 0; p < static_cast<long>(numPoints); ++p)
+      emitted[p] = reemission[p] * weight[p];
+
+    std::copy(directCount.begin(), directCount.end(), flux.begin());
+    addIncoming(countTransfer, emitted, flux);
+
+#pragma omp parallel for
+    for (long i = 0; i < static_cast<long>(numPoints); ++i)
+      flux[i] *= sourceArea / diskAreas[i];
+
+    return flux;
+  }
+
+private:
+  void releaseScene() {
+    if (scene == nullptr)
+      return;
+    rtcReleaseScene(scene);
+    scene = nullptr;
+    boundary->releaseGeometry();
+    geometry.releaseGeometry();
+  }
+
+  // Disks which are cut by a lateral boundary of the domain only cover half
+  // of their area (a quarter in the corners), the same as in rayTrace.
+  void computeDiskAreas() {
+    const auto numPoints = points.size();
+    diskAreas.resize(numPoints);
+    NumericType fullArea;
+    if constexpr (D == 3)
+      fullArea = diskRadius * diskRadius * rayInternal::PI;
+    else
+      fullArea = 2 * diskRadius;
+
+#pragma omp parallel for
+    for (long p = 0; p < static_cast<long>(numPoints); ++p) {
+      diskAreas[p] = fullArea;
+      for (int i = 1; i < D; ++i) {
+        const int dir = traceSettings[i];
+        if (std::abs(points[p][dir] - boundingBox[0][dir]) < diskRadius ||
+            std::abs(points[p][dir] - boundingBox[1][dir]) < diskRadius)
+          diskAreas[p] /= 2;
+      }
+    }
+  }
+
+  // result[i] += sum_p matrix(i, p) * x[p]
+  static void addIncoming(const SparseMatrix &matrix,
+                          const std::vector<NumericType> &x,
+                          std::vector<NumericType> &result) {
+    const auto numRows = static_cast<long>(matrix.rowStart.size()) - 1;
+#pragma omp parallel for schedule(dynamic, 256)
+    for (long row = 0; row < numRows; ++row) {
+      NumericType sum = 0.;
+      for (auto k = matrix.rowStart[row]; k < matrix.rowStart[row + 1]; ++k)
+        sum += matrix.value[k] * x[matrix.column[k]];
+      result[row] += sum;
+    }
+  }
+
+  // Returns the probability of a source ray to have its primary hit on each
+  // disk and the expected number of counts on each disk per source ray.
+  const std::pair<std::vector<NumericType>, std::vector<NumericType>> &
+  getSourceContribution(const NumericType sourcePower) {
+    if (auto it = sourceContributions.find(sourcePower);
+        it != sourceContributions.end())
+      return it->second;
+
+    const auto numPoints = points.size();
+    const long long numRays = numPoints * numberOfRaysPerPoint;
+    std::unique_ptr<raySource<NumericType, D>> source;
+    if (sourceSampling == psSourceSamplingType::QUASI_RANDOM) {
+      source = std::make_unique<psQuasiRandomSource<NumericType, D>>(
+          boundingBox, sourcePower, traceSettings, numPoints,
+          useRandomSeeds ? std::random_device{}() : runNumber);
+    } else {
+      source = std::make_unique<raySourceRandom<NumericType, D>>(
+          boundingBox, sourcePower, traceSettings, numPoints);
+    }
+
+    std::vector<NumericType> primary(numPoints, 0.);
+    std::vector<NumericType> counts(numPoints, 0.);
+
+#pragma omp parallel
+    {
+      std::vector<NumericType> localPrimary(numPoints, 0.);
+      std::vector<NumericType> localCounts(numPoints, 0.);
+      std::vector<unsigned> hitDisks;
+      auto rngs = createRNGStates(5);
+      auto rtcContext = RTCIntersectContext{};
+      rtcInitIntersectContext(&rtcContext);
+      alignas(128) auto rayHit =
+          RTCRayHit{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+#pragma omp for schedule(dynamic, 1024)
+      for (long long idx = 0; idx < numRays; ++idx) {
+        source->fillRay(rayHit.ray, idx, rngs[0], rngs[1], rngs[2], rngs[3]);
+        const int primaryHit = traceRay(rayHit, rtcContext, hitDisks);
+        if (primaryHit < 0)
+          continue;
+        localPrimary[primaryHit] += 1.;
+        for (const auto disk : hitDisks)
+          localCounts[disk] += 1.;
+      }
+
+#pragma omp critical
+      for (size_t i = 0; i < numPoints; ++i) {
+        primary[i] += localPrimary[i];
+        counts[i] += localCounts[i];
+      }
+    }
+
+    const NumericType invNumRays = NumericType(1) / numRays;
+    for (size_t i = 0; i < numPoints; ++i) {
+      primary[i] *= invNumRays;
+      counts[i] *= invNumRays;
+    }
+
+    return sourceContributions[sourcePower] =
+               std::pair{std::move(primary), std::move(counts)};
+  }
+
+  void buildTransferMatrices() {
+    const auto numPoints = points.size();
+    std::vector<std::vector<std::pair<unsigned, NumericType>>> primaryRows(
+        numPoints);
+    std::vector<std::vector<std::pair<unsigned, NumericType>>> countRows(
+        numPoints);
+    const NumericType invNumRays = NumericType(1) / numberOfRaysPerPoint;
+
+#pragma omp parallel
+    {
+      // dense scratch arrays with a list of touched entries, so that the
+      // accumulation of a row does not allocate
+      std::vector<NumericType> primaryScratch(numPoints, 0.);
+      std::vector<NumericType> countScratch(numPoints, 0.);
+      std::vector<unsigned> primaryTouched;
+      std::vector<unsigned> countTouched;
+      std::vector<unsigned> hitDisks;
+      auto rngs = createRNGStates(1);
+      auto rtcContext = RTCIntersectContext{};
+      rtcInitIntersectContext(&rtcContext);
+      alignas(128) auto rayHit =
+          RTCRayHit{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+#pragma omp for schedule(dynamic)
+      for (long p = 0; p < static_cast<long>(numPoints); ++p) {
+        const auto &origin = points[p];
+        const auto &normal = normals[p];
+
+        // stratify the re-emitted directions of each disk separately
+        const auto shift = psQuasiRandom::randomShift<NumericType>(rngs[0]);
+
+        for (size_t r = 0; r < numberOfRaysPerPoint; ++r) {
+          rayTriple<NumericType> direction;
+          if (sourceSampling == psSourceSamplingType::QUASI_RANDOM) {
+            const auto sample = psQuasiRandom::haltonSample(r + 1, shift);
+            direction = psQuasiRandom::diffuseDirection<NumericType, D>(
+                normal, sample[0], sample[1]);
+          } else {
+            direction = rayReflectionDiffuse<NumericType, D>(normal, rngs[0]);
+          }
+          fillRay(rayHit.ray, origin, direction);
+
+          const int primaryHit = traceRay(rayHit, rtcContext, hitDisks);
+          if (primaryHit < 0)
+            continue;
+
+          if (primaryScratch[primaryHit] == 0.)
+            primaryTouched.push_back(primaryHit);
+          primaryScratch[primaryHit] += invNumRays;
+          for (const auto disk : hitDisks) {
+            if (countScratch[disk] == 0.)
+              countTouched.push_back(disk);
+            countScratch[disk] += invNumRays;
+          }
+        }
+
+        auto &primaryRow = primaryRows[p];
+        primaryRow.reserve(primaryTouched.size());
+        for (const auto disk : primaryTouched) {
+          primaryRow.emplace_back(disk, primaryScratch[disk]);
+          primaryScratch[disk] = 0.;
+        }
+        primaryTouched.clear();
+
+        auto &countRow = countRows[p];
+        countRow.reserve(countTouched.size());
+        for (const auto disk : countTouched) {
+          countRow.emplace_back(disk, countScratch[disk]);
+          countScratch[disk] = 0.;
+        }
+        countTouched.clear();
+      }
+    }
+
+    toSparseMatrix(primaryRows, primaryTransfer);
+    toSparseMatrix(countRows, countTransfer);
+
+    psLogger::getInstance()
+        .addDebug("psViewFactorFlux: Transfer matrix has " +
+                  std::to_string(countTransfer.value.size()) + " entries.")
+        .print();
+  }
+
+  // Stores the transposed rows, so that each row of the matrix holds the
+  // contributions arriving at one disk.
+  static void toSparseMatrix(
+      std::vector<std::vector<std::pair<unsigned, NumericType>>> &rows,
+      SparseMatrix &matrix) {
+    matrix.clear();
+    matrix.rowStart.resize(rows.size() + 1, 0);
+    for (const auto &row : rows)
+      for (const auto &entry : row)
+        ++matrix.rowStart[entry.first + 1];
+    for (size_t i = 0; i < rows.size(); ++i)
+      matrix.rowStart[i + 1] += matrix.rowStart[i];
+
+    matrix.column.resize(matrix.rowStart.back());
+    matrix.value.resize(matrix.rowStart.back());
+    auto fill = matrix.rowStart;
+    for (size_t emitter = 0; emitter < rows.size(); ++emitter) {
+      for (const auto &[receiver, value] : rows[emitter]) {
+        const auto k = fill[receiver]++;
+        matrix.column[k] = emitter;
+        matrix.value[k] = value;
+      }
+      std::vector<std::pair<unsigned, NumericType>>().swap(rows[emitter]);
+    }
+  }
+
+  // Trace a ray through the scene until it hits the front side of a disk.
+  // Returns the primary disk and fills all disks which count the hit.
+  int traceRay(RTCRayHit &rayHit, RTCIntersectContext &rtcContext,
+               std::vector<unsigned> &hitDisks) const {
+    hitDisks.clear();
+    bool reflect = false;
+    bool hitFromBack = false;
+    do {
+      rayHit.ray.tfar = std::numeric_limits<rtcNumericType>::max();
+      rayHit.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
+      rayHit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
+
+      rtcIntersect1(scene, &rtcContext, &rayHit);
+
+      if (rayHit.hit.geomID == RTC_INVALID_GEOMETRY_ID)
+        return -1;
+
+      if (rayHit.hit.geomID == boundaryID) {
+        boundary->processHit(rayHit, reflect);
+        continue;
+      }
+
+      const auto &ray = rayHit.ray;
+      const rayTriple<NumericType> hitPoint{ray.org_x + ray.dir_x * ray.tfar,
+                                            ray.org_y + ray.dir_y * ray.tfar,
+                                            ray.org_z + ray.dir_z * ray.tfar};
+      const rayTriple<NumericType> rayDir{ray.dir_x, ray.dir_y, ray.dir_z};
+      const auto primID = rayHit.hit.primID;
+
+      if (rayInternal::DotProduct(rayDir, normals[primID]) > 0) {
+        // let the ray pass through the back of a disk once
+        if (hitFromBack)
+          return -1;
+        hitFromBack = true;
+        reflect = true;
+        fillRay(rayHit.ray, hitPoint, rayDir);
+        continue;
+      }
+
+      hitDisks.push_back(primID);
+      for (const auto neighbor : diskNeighbors[primID]) {
+        if (intersectsDisk(hitPoint, rayDir, neighbor))
+          hitDisks.push_back(neighbor);
+      }
+      return static_cast<int>(primID);
+    } while (reflect);
+
+    return -1;
+  }
+
+  bool intersectsDisk(const rayTriple<NumericType> &hitPoint,
+                      const rayTriple<NumericType> &rayDir,
+                      const unsigned disk) const {
+    const auto &normal = normals[disk];
+    if (rayInternal::DotProduct(rayDir, normal) >= 0)
+      return false;
+
+    // project the hit point onto the disk plane along the ray
+    const auto &center = points[disk];
+    const rayTriple<NumericType> diff{center[0] - hitPoint[0],
+                                      center[1] - hitPoint[1],
+                                      center[2] - hitPoint[2]};
+    const auto t = rayInternal::DotProduct(diff, normal) /
+                   rayInternal::DotProduct(rayDir, normal);
+    NumericType distance = 0.;
+    for (int i = 0; i < 3; ++i) {
+      const auto d = hitPoint[i] + t * rayDir[i] - center[i];
+      distance += d * d;
+    }
+    return distance <= diskRadius * diskRadius;
+  }
+
+  // Disks whose centers are closer than two disk radii can be hit by the same
+  // ray.
+  void buildDiskNeighborhood() {
+    const auto numPoints = points.size();
+    const NumericType cellSize = 2 * diskRadius;
+    auto cellKey = [cellSize](const std::array<NumericType, 3> &point,
+                              const std::array<int, 3> &offset) {
+      std::array<long long, 3> key;
+      for (int i = 0; i < 3; ++i)
+        key[i] = static_cast<long long>(std::floor(point[i] / cellSize)) +
+                 offset[i];
+      return (key[0] * 73856093) ^ (key[1] * 19349663) ^ (key[2] * 83492791);
+    };
+
+    std::unordered_map<long long, std::vector<unsigned>> cells;
+    for (unsigned p = 0; p < numPoints; ++p)
+      cells[cellKey(points[p], {0, 0, 0})].push_back(p);
+
+    diskNeighbors.clear();
+    diskNeighbors.resize(numPoints);
+    const int zRange = D == 3 ? 1 : 0;
+#pragma omp parallel for schedule(dynamic, 64)
+    for (long p = 0; p < static_cast<long>(numPoints); ++p) {
+      for (int i = -1; i <= 1; ++i)
+        for (int j = -1; j <= 1; ++j)
+          for (int k = -zRange; k <= zRange; ++k) {
+            auto it = cells.find(cellKey(points[p], {i, j, k}));
+            if (it == cells.end())
+              continue;
+            for (const auto n : it->second) {
+              if (n == p)
+                continue;
+              NumericType distance = 0.;
+              for (int d = 0; d < 3; ++d) {
+                const auto diff = points[n][d] - points[p][d];
+                distance += diff * diff;
+              }
+              if (distance < cellSize * cellSize &&
+                  std::find(diskNeighbors[p].begin(), diskNeighbors[p].end(),
+                            n) == diskNeighbors[p].end())
+                diskNeighbors[p].push_back(n);
+            }
+          }
+    }
+  }
+
+  std::vector<rayRNG> createRNGStates(const int numStates) const {
+    std::vector<rayRNG> rngs;
+    rngs.reserve(numStates);
+    if (useRandomSeeds) {
+      std::random_device rd;
+      for (int i = 0; i < numStates; ++i)
+        rngs.emplace_back(rd());
+    } else {
+      for (int i = 0; i < numStates; ++i)
+        rngs.emplace_back((omp_get_thread_num() + 1) * 31 + i + runNumber);
+    }
+    return rngs;
+  }
+
+  static void fillRay(RTCRay &ray, const rayTriple<NumericType> &origin,
+                      const rayTriple<NumericType> &direction) {
+    ray.org_x = static_cast<rtcNumericType>(origin[0]);
+    ray.org_y = static_cast<rtcNumericType>(origin[1]);
+    ray.org_z = static_cast<rtcNumericType>(origin[2]);
+    ray.tnear = 1e-4f;
+
+    ray.dir_x = static_cast<rtcNumericType>(direction[0]);
+    ray.dir_y = static_cast<rtcNumericType>(direction[1]);
+    ray.dir_z = static_cast<rtcNumericType>(direction[2]);
+    ray.time = 0.0f;
+  }
+};